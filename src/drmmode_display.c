@@ -34,8 +34,10 @@
 #include "xorgVersion.h"
 
 #include "msm.h"
+#include "msm-accel.h"
 #include "xf86Crtc.h"
 #include "xf86drmMode.h"
+#include "drm_fourcc.h"
 #include "xf86DDC.h"
 #include "xf86Cursor.h"
 #include "xf86RandR12.h"
@@ -59,32 +61,135 @@
 #endif
 
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <libudev.h>
 
 
 static Bool drmmode_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height);
 
+/* An overlay plane, which can be used to scan out a buffer on top of
+ * the crtc's primary scanout buffer:
+ */
 typedef struct {
-	int fd;
+	uint32_t plane_id;
+	uint32_t possible_crtcs;   /* bitmask of crtc indices */
+	Bool format_ok;            /* supports XRGB8888 */
+	int crtc_index;            /* crtc it is assigned to, or -1 */
+	uint32_t fb_id;            /* fb currently shown, if assigned */
+} drmmode_plane_rec, *drmmode_plane_ptr;
+
+/* A kms framebuffer.  These are refcounted, since with each crtc flipping
+ * at its own pace, the same fb can be scanned out by, or have a flip in
+ * flight on, several crtcs at once, and must stick around until the
+ * last of them is done with it:
+ */
+typedef struct {
+	int refcnt;
 	uint32_t fb_id;
+} drmmode_fb_rec, *drmmode_fb_ptr;
+
+typedef struct {
+	int fd;
+	drmmode_fb_ptr fb;     /* fb of the current scanout bo */
 	drmModeResPtr mode_res;
+	int num_planes;
+	drmmode_plane_ptr planes;
 	int cpp;
+	Bool async_flip;
+	int cursor_width, cursor_height;
+	Bool set_cursor2;   /* cleared if the kernel lacks SetCursor2 */
+	Bool atomic;        /* use atomic modeset/flip */
 	drmEventContext event_context;
+	/* TearFree: rather than scanning out the screen pixmap directly,
+	 * damaged areas are copied to one of a pair of scanout buffers,
+	 * which is then flipped to:
+	 */
+	struct {
+		Bool enabled;
+		struct fd_bo *bo[2];
+		drmmode_fb_ptr fb[2];
+		PixmapPtr pix[2];
+		int back;            /* the buffer not being scanned out */
+		DamagePtr damage;
+		RegionRec prev;      /* damage copied in the previous frame */
+		Bool flip_pending;
+		/* to keep track of the extra bandwidth: */
+		uint64_t frames;
+		uint64_t copied;     /* bytes copied */
+		uint64_t full;       /* bytes full screen copies would be */
+	} tearfree;
+	Bool hotplug;       /* re-probing in response to hotplug events */
+	/* bumped on hotplug, to invalidate the cached connector state (if
+	 * zero, there are no hotplug events, so nothing is cached):
+	 */
+	uint32_t connector_gen;
+	/* connector property metadata (shared by all connectors): */
+	int num_props;
+	drmModePropertyPtr *props;
 #ifdef HAVE_LIBUDEV
 	struct udev_monitor *uevent_monitor;
+	OsTimerPtr hotplug_timer;
 #endif
 } drmmode_rec, *drmmode_ptr;
 
+static void drmmode_planes_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode);
+
+/* Small cache of uploaded cursor images, so that switching between the
+ * handful of commonly used cursors (arrow/text/busy/etc) is just a
+ * drmModeSetCursor() without touching the image:
+ */
+#define CURSOR_CACHE_SIZE 4
+
+typedef struct {
+	struct fd_bo *bo;
+	uint32_t hash;
+	int xhot, yhot;
+	uint32_t last_used;
+	CARD32 *image;       /* copy of image, to check for hash collisions */
+} drmmode_cursor_rec, *drmmode_cursor_ptr;
+
+typedef struct {
+	ScrnInfoPtr pScrn;
+	int flip_count;
+	drmmode_event_handler handler;
+	void *event_data;
+	/* msc/ust of the reference crtc's flip, reported to the caller: */
+	uint64_t msc, ust;
+} drmmode_flipdata_rec, *drmmode_flipdata_ptr;
+
 typedef struct {
 	drmmode_ptr drmmode;
 	drmModeCrtcPtr mode_crtc;
-	struct fd_bo *cursor;
+	int index;  /* index of the crtc in mode_res->crtcs */
+	/* for extending the 32bit kernel vblank sequence to 64bits: */
+	uint32_t msc_prev;
+	uint64_t msc_high;
+	drmmode_cursor_rec cursors[CURSOR_CACHE_SIZE];
+	drmmode_cursor_ptr cursor;   /* currently loaded cursor */
+	uint32_t cursor_serial;
 	struct fd_bo *rotate_bo;
 	int rotate_pitch;
 	PixmapPtr rotate_pixmap;
 	uint32_t rotate_fb_id;
 	Bool cursor_visible;
+	/* the fbs the crtc holds on to, released once it moves off them: */
+	drmmode_fb_ptr scanout_fb;   /* fb currently scanned out */
+	drmmode_fb_ptr flip_fb;      /* fb of the flip in flight */
+	Bool flip_superseded;        /* a modeset replaced flip_fb */
+#ifdef HAVE_DRM_ATOMIC
+	/* for atomic modeset, the crtc's primary plane and property ids: */
+	uint32_t plane_id;
+	uint32_t mode_blob_id;
+	struct {
+		uint32_t mode_id, active;
+	} crtc_props;
+	struct {
+		uint32_t fb_id, crtc_id;
+		uint32_t src_x, src_y, src_w, src_h;
+		uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+	} plane_props;
+#endif
 } drmmode_crtc_private_rec, *drmmode_crtc_private_ptr;
 
 typedef struct {
@@ -102,25 +207,32 @@ typedef struct {
 	drmModeConnectorPtr mode_output;
 	drmModeEncoderPtr mode_encoder;
 	drmModePropertyBlobPtr edid_blob;
+	uint32_t edid_blob_id;   /* blob id of the cached edid_blob */
+	Bool probe;              /* flagged by a hotplug event */
+	uint32_t gen;            /* connector_gen when mode_output was fetched */
+	Bool probed;             /* mode_output is fresh from output_init */
 	int num_props;
 	drmmode_prop_ptr props;
+#ifdef HAVE_DRM_ATOMIC
+	uint32_t prop_crtc_id;
+	uint32_t crtc_id;        /* crtc the connector is currently routed to */
+#endif
 } drmmode_output_private_rec, *drmmode_output_private_ptr;
 
-typedef struct {
-	drmmode_ptr drmmode;
-	unsigned old_fb_id;
-	int flip_count;
-	void *event_data;
-	unsigned int fe_frame;
-	unsigned int fe_tv_sec;
-	unsigned int fe_tv_usec;
-} drmmode_flipdata_rec, *drmmode_flipdata_ptr;
-
 typedef struct {
 	drmmode_flipdata_ptr flipdata;
-	Bool dispatch_me;
+	xf86CrtcPtr crtc;       /* the crtc, if only one was flipped */
+	xf86CrtcPtr ref_crtc;   /* crtc whose completion is reported, if any */
+	int count;              /* crtcs still to deliver their event */
 } drmmode_flipevtcarrier_rec, *drmmode_flipevtcarrier_ptr;
 
+typedef struct {
+	xf86CrtcPtr crtc;
+	drmmode_event_handler handler;
+	void *event_data;
+	Bool swap;              /* counted in pending_page_flips */
+} drmmode_vblank_event_rec, *drmmode_vblank_event_ptr;
+
 static void drmmode_output_dpms(xf86OutputPtr output, int mode);
 
 static drmmode_ptr
@@ -136,6 +248,66 @@ drmmode_from_scrn(ScrnInfoPtr scrn)
 	return NULL;
 }
 
+static drmmode_fb_ptr
+drmmode_fb_new(drmmode_ptr drmmode, int width, int height, int depth,
+		int bpp, int pitch, struct fd_bo *bo)
+{
+	drmmode_fb_ptr fb = calloc(1, sizeof(*fb));
+
+	if (!fb)
+		return NULL;
+
+	if (drmModeAddFB(drmmode->fd, width, height, depth, bpp, pitch,
+			fd_bo_handle(bo), &fb->fb_id)) {
+		int err = errno;
+		free(fb);
+		errno = err;
+		return NULL;
+	}
+
+	fb->refcnt = 1;
+
+	return fb;
+}
+
+static drmmode_fb_ptr
+drmmode_fb_ref(drmmode_fb_ptr fb)
+{
+	if (fb)
+		fb->refcnt++;
+	return fb;
+}
+
+static void
+drmmode_fb_unref(drmmode_ptr drmmode, drmmode_fb_ptr fb)
+{
+	if (fb && (--fb->refcnt == 0)) {
+		drmModeRmFB(drmmode->fd, fb->fb_id);
+		free(fb);
+	}
+}
+
+/* Drop the caller's reference to the fb, along with those of any crtcs
+ * scanning it out, so that it gets removed (which turns off any crtc
+ * still using it) unless there is still a flip in flight to it:
+ */
+static void
+drmmode_fb_release(ScrnInfoPtr pScrn, drmmode_ptr drmmode, drmmode_fb_ptr fb)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc = config->crtc[i]->driver_private;
+		if (drmmode_crtc->scanout_fb == fb) {
+			drmmode_fb_unref(drmmode, fb);
+			drmmode_crtc->scanout_fb = NULL;
+		}
+	}
+
+	drmmode_fb_unref(drmmode, fb);
+}
+
 static PixmapPtr
 drmmode_pixmap_wrap(ScreenPtr pScreen, int width, int height, int depth,
 		int bpp, int pitch, struct fd_bo *bo, void *data)
@@ -220,6 +392,79 @@ drmmode_crtc_dpms(xf86CrtcPtr drmmode_crtc, int mode)
 
 }
 
+/**
+ * Initialize the contents of a newly allocated scanout buffer, copying
+ * over what fits of the previous scanout buffer (if any), and clearing
+ * the rest.  This is done on the gpu when possible, since a CPU memset
+ * of a 1080p+ buffer takes several ms and faults in every page.
+ */
+static void
+drmmode_copy_scanout(ScreenPtr pScreen, struct fd_bo *old_bo,
+		int old_width, int old_height, int old_pitch)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	MSMPtr pMsm = MSMPTR(pScrn);
+	ExaDriverPtr exa = pMsm->pExa;
+	int w = pScrn->virtualX, h = pScrn->virtualY, bpp = pScrn->bitsPerPixel;
+	int cw = 0, ch = 0;
+	PixmapPtr old_pix = NULL, scanout_pix;
+	void *ptr;
+
+	if (!exa || pMsm->NoAccel)
+		goto fallback;
+
+	scanout_pix = drmmode_pixmap_wrap(pScreen, w, h, pScrn->depth,
+			bpp, pScrn->displayWidth * bpp / 8, pMsm->scanout, NULL);
+	if (!scanout_pix)
+		goto fallback;
+
+	if (old_bo) {
+		old_pix = drmmode_pixmap_wrap(pScreen, old_width, old_height,
+				pScrn->depth, bpp, old_pitch, old_bo, NULL);
+	}
+
+	if (old_pix && exa->PrepareCopy(old_pix, scanout_pix, 1, 1, GXcopy, ~0)) {
+		cw = min(w, old_width);
+		ch = min(h, old_height);
+		exa->Copy(scanout_pix, 0, 0, 0, 0, cw, ch);
+		exa->DoneCopy(scanout_pix);
+	}
+
+	if (old_pix)
+		pScreen->DestroyPixmap(old_pix);
+
+	/* clear whatever is not covered by the old contents: */
+	if ((cw < w) || (ch < h)) {
+		if (!exa->PrepareSolid(scanout_pix, GXcopy, ~0, 0)) {
+			pScreen->DestroyPixmap(scanout_pix);
+			goto fallback;
+		}
+		if (cw < w)
+			exa->Solid(scanout_pix, cw, 0, w, h);
+		if (ch < h)
+			exa->Solid(scanout_pix, 0, ch, cw, h);
+		exa->DoneSolid(scanout_pix);
+	}
+
+	MSMFlushAccel(pScreen);
+
+	/* wait for completion before the new buffer is scanned out, to
+	 * avoid a momentary flash of garbage:
+	 */
+	exa->PrepareAccess(scanout_pix, EXA_PREPARE_SRC);
+	exa->FinishAccess(scanout_pix, EXA_PREPARE_SRC);
+
+	pScreen->DestroyPixmap(scanout_pix);
+
+	return;
+
+fallback:
+	ptr = fd_bo_map(pMsm->scanout);
+	if (!ptr)
+		return;
+	memset(ptr, 0x00, fd_bo_size(pMsm->scanout));
+}
+
 static void
 drmmode_fbcon_copy(ScreenPtr pScreen)
 {
@@ -233,7 +478,6 @@ drmmode_fbcon_copy(ScreenPtr pScreen)
 	uint32_t fbcon_id = 0;
 	struct fd_bo *fbcon_bo;
 	PixmapPtr fbcon_pix, scanout_pix;
-	void *ptr;
 	int i;
 
 	for (i = 0; i < config->num_crtc; i++) {
@@ -291,8 +535,11 @@ drmmode_fbcon_copy(ScreenPtr pScreen)
 	 * then we need to do things in terms of drawables and regions.
 	 * So meh, we have XA, let's not worry too much about it.
 	 */
-	if (!exa->PrepareCopy(fbcon_pix, scanout_pix, 0, 0, GXcopy, ~0))
+	if (!exa->PrepareCopy(fbcon_pix, scanout_pix, 0, 0, GXcopy, ~0)) {
+		pScreen->DestroyPixmap(scanout_pix);
+		pScreen->DestroyPixmap(fbcon_pix);
 		goto fallback;
+	}
 	exa->Copy(scanout_pix, 0, 0, 0, 0, w, h);
 	exa->DoneCopy(scanout_pix);
 
@@ -314,1070 +561,2631 @@ drmmode_fbcon_copy(ScreenPtr pScreen)
 	return;
 
 fallback:
-	ptr = fd_bo_map(pMsm->scanout);
-	if (!ptr)
-		return;
-	memset(ptr, 0x00, fd_bo_size(pMsm->scanout));
+	drmmode_copy_scanout(pScreen, NULL, 0, 0, 0);
 }
 
-static Bool
-drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
-		Rotation rotation, int x, int y)
+/**
+ * Copy the region from one pixmap to another, on the gpu if possible.
+ */
+static void
+drmmode_tearfree_copy(ScreenPtr pScreen, PixmapPtr src, PixmapPtr dst,
+		RegionPtr region)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	MSMPtr pMsm = MSMPTR(pScrn);
-	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
-	uint32_t *output_ids;
-	int output_count = 0;
-	int ret = TRUE;
-	int i;
-	int fb_id;
-	drmModeModeInfo kmode;
-
-	if (drmmode->fb_id == 0) {
-		int pitch = MSMAlignedStride(pScrn->virtualX,
-				pScrn->bitsPerPixel);
-		ret = drmModeAddFB(drmmode->fd, pScrn->virtualX, pScrn->virtualY,
-				pScrn->depth, pScrn->bitsPerPixel, pitch,
-				fd_bo_handle(pMsm->scanout), &drmmode->fb_id);
-		if (ret) {
-			xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-					"Error adding FB for scanout: %s\n",
-					strerror(-ret));
-			return FALSE;
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(pScreen);
+	ExaDriverPtr exa = pMsm->pExa;
+	BoxPtr box = RegionRects(region);
+	int n = RegionNumRects(region);
+	struct fd_bo *src_bo, *dst_bo;
+	int cpp = dst->drawable.bitsPerPixel / 8;
+	int src_pitch, dst_pitch;
+	uint8_t *src_ptr, *dst_ptr;
+
+	if (exa && !pMsm->NoAccel &&
+			exa->PrepareCopy(src, dst, 1, 1, GXcopy, ~0)) {
+		while (n--) {
+			exa->Copy(dst, box->x1, box->y1, box->x1, box->y1,
+					box->x2 - box->x1, box->y2 - box->y1);
+			box++;
 		}
-		pScrn->displayWidth = pitch / (pScrn->bitsPerPixel >> 3);
+		exa->DoneCopy(dst);
+		return;
 	}
 
-	if (!xf86CrtcRotate(crtc))
-		return FALSE;
+	src_bo = msm_get_pixmap_bo(src);
+	dst_bo = msm_get_pixmap_bo(dst);
+	if (!src_bo || !dst_bo)
+		return;
 
-	output_ids = calloc(sizeof(uint32_t), xf86_config->num_output);
-	if (!output_ids)
-		return FALSE;
+	src_ptr = fd_bo_map(src_bo);
+	dst_ptr = fd_bo_map(dst_bo);
+	if (!src_ptr || !dst_ptr)
+		return;
 
-	for (i = 0; i < xf86_config->num_output; i++) {
-		xf86OutputPtr output = xf86_config->output[i];
-		drmmode_output_private_ptr drmmode_output;
+	src_pitch = exaGetPixmapPitch(src);
+	dst_pitch = exaGetPixmapPitch(dst);
 
-		if (output->crtc != crtc)
-			continue;
+	if (pMsm->pipe)
+		msm_bo_cpu_prep(pMsm, src_bo, DRM_FREEDRENO_PREP_READ);
+	if (msm_trace_active)
+		msm_capture_cpu_write(dst_bo);
 
-		drmmode_output = output->driver_private;
-		output_ids[output_count] =
-				drmmode_output->mode_output->connector_id;
-		output_count++;
+	while (n--) {
+		int y, len = (box->x2 - box->x1) * cpp;
+		for (y = box->y1; y < box->y2; y++) {
+			memcpy(dst_ptr + (y * dst_pitch) + (box->x1 * cpp),
+					src_ptr + (y * src_pitch) + (box->x1 * cpp),
+					len);
+		}
+		box++;
 	}
 
-	drmmode_ConvertToKMode(crtc->scrn, &kmode, mode);
+	if (pMsm->pipe)
+		fd_bo_cpu_fini(src_bo);
+}
 
-	fb_id = drmmode->fb_id;
-	if (drmmode_crtc->rotate_fb_id) {
-		fb_id = drmmode_crtc->rotate_fb_id;
-		x = 0;
-		y = 0;
+static void
+drmmode_tearfree_free(ScreenPtr pScreen, drmmode_ptr drmmode)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (drmmode->tearfree.pix[i])
+			pScreen->DestroyPixmap(drmmode->tearfree.pix[i]);
+		drmmode_fb_unref(drmmode, drmmode->tearfree.fb[i]);
+		if (drmmode->tearfree.bo[i])
+			fd_bo_del(drmmode->tearfree.bo[i]);
+		drmmode->tearfree.pix[i] = NULL;
+		drmmode->tearfree.fb[i] = NULL;
+		drmmode->tearfree.bo[i] = NULL;
 	}
+}
 
-	ret = drmModeSetCrtc(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
-			fb_id, x, y, output_ids, output_count, &kmode);
-	free(output_ids);
+/**
+ * (Re)allocate the pair of TearFree scanout buffers to match the screen
+ * size, with the current contents of the screen, and return a reference
+ * to the fb of the one to scan out first.
+ */
+static drmmode_fb_ptr
+drmmode_tearfree_alloc(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
+{
+	ScreenPtr pScreen = xf86ScrnToScreen(pScrn);
+	MSMPtr pMsm = MSMPTR(pScrn);
+	int w = pScrn->virtualX, h = pScrn->virtualY;
+	int bpp = pScrn->bitsPerPixel, pitch = pScrn->displayWidth * bpp / 8;
+	BoxRec box = { 0, 0, w, h };
+	RegionRec region;
+	PixmapPtr src;
+	int i;
 
-	if (ret) {
-		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-				"failed to set mode: %s\n", strerror(-ret));
-		return FALSE;
-	}
+	drmmode_tearfree_free(pScreen, drmmode);
 
-	/* Work around some xserver stupidity */
-	for (i = 0; i < xf86_config->num_output; i++) {
-		xf86OutputPtr output = xf86_config->output[i];
+	for (i = 0; i < 2; i++) {
+		drmmode->tearfree.bo[i] = msm_bo_new(pMsm, pitch * h,
+				DRM_FREEDRENO_GEM_TYPE_KMEM);
+		if (!drmmode->tearfree.bo[i])
+			goto fail;
 
-		if (output->crtc != crtc)
-			continue;
+		drmmode->tearfree.fb[i] = drmmode_fb_new(drmmode, w, h,
+				pScrn->depth, bpp, pitch, drmmode->tearfree.bo[i]);
+		if (!drmmode->tearfree.fb[i])
+			goto fail;
 
-		drmmode_output_dpms(output, DPMSModeOn);
+		drmmode->tearfree.pix[i] = drmmode_pixmap_wrap(pScreen, w, h,
+				pScrn->depth, bpp, pitch, drmmode->tearfree.bo[i],
+				fd_bo_map(drmmode->tearfree.bo[i]));
+		if (!drmmode->tearfree.pix[i])
+			goto fail;
 	}
 
-	crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
-			crtc->gamma_blue, crtc->gamma_size);
+	RegionInit(&region, &box, 1);
 
-	if (pMsm->HWCursor)
-		xf86_reload_cursors(crtc->scrn->pScreen);
+	/* the screen pixmap might not be hooked up to the scanout bo yet,
+	 * so copy from the bo directly:
+	 */
+	src = drmmode_pixmap_wrap(pScreen, w, h, pScrn->depth, bpp, pitch,
+			pMsm->scanout, fd_bo_map(pMsm->scanout));
+	if (src) {
+		drmmode_tearfree_copy(pScreen, src, drmmode->tearfree.pix[0],
+				&region);
+		MSMFlushAccel(pScreen);
+		pScreen->DestroyPixmap(src);
+	}
 
-	return TRUE;
-}
+	/* and the other buffer needs a full update on the first frame: */
+	RegionCopy(&drmmode->tearfree.prev, &region);
+	RegionUninit(&region);
 
-static void
-drmmode_set_cursor_position (xf86CrtcPtr crtc, int x, int y)
-{
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmmode->tearfree.back = 1;
 
-	drmModeMoveCursor(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id, x, y);
+	return drmmode_fb_ref(drmmode->tearfree.fb[0]);
+
+fail:
+	WARNING_MSG("Could not allocate TearFree buffers, disabling TearFree");
+	drmmode_tearfree_free(pScreen, drmmode);
+	drmmode->tearfree.enabled = FALSE;
+	return NULL;
 }
 
-static void
-convert_cursor(CARD32 *dst, CARD32 *src, int dw, int sw)
+/**
+ * Create the fb for the current scanout, which (unless TearFree is
+ * enabled) is the screen pixmap's bo.
+ */
+static drmmode_fb_ptr
+drmmode_scanout_fb_new(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 {
-	int i, j;
+	MSMPtr pMsm = MSMPTR(pScrn);
+	drmmode_fb_ptr fb = NULL;
 
-	for (j = 0;  j < sw; j++) {
-		for (i = 0; i < sw; i++) {
-			dst[j * dw + i] = src[j * sw + i];
-		}
+	if (drmmode->tearfree.enabled)
+		fb = drmmode_tearfree_alloc(pScrn, drmmode);
+
+	if (!fb) {
+		fb = drmmode_fb_new(drmmode, pScrn->virtualX, pScrn->virtualY,
+				pScrn->depth, pScrn->bitsPerPixel,
+				pScrn->displayWidth * pScrn->bitsPerPixel / 8,
+				pMsm->scanout);
 	}
+
+	return fb;
 }
 
-static Bool
-drmmode_load_cursor_argb_check(xf86CrtcPtr crtc, CARD32 *image)
+/**
+ * Get the type (overlay/primary/cursor) of a plane.  Planes without a
+ * type property (older kernels, which only expose overlays) are treated
+ * as overlays.
+ */
+static int
+drmmode_plane_type(int fd, uint32_t plane_id)
 {
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	struct fd_bo *cursor = drmmode_crtc->cursor;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
-	void *ptr = fd_bo_map(cursor);
-	int ret = 0;
+	drmModeObjectPropertiesPtr props;
+	int type = DRM_PLANE_TYPE_OVERLAY;
+	unsigned i;
 
-	convert_cursor(ptr, image, 64, 64);
+	props = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return type;
 
-	if (drmmode_crtc->cursor_visible) {
-		ret = drmModeSetCursor(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
-				fd_bo_handle(cursor), 64, 64);
+	for (i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, "type"))
+			type = props->prop_values[i];
+		drmModeFreeProperty(prop);
 	}
 
-	return ret == 0;
-}
+	drmModeFreeObjectProperties(props);
 
-static void
-drmmode_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
-{
-	drmmode_load_cursor_argb_check(crtc, image);
+	return type;
 }
 
-static void
-drmmode_hide_cursor (xf86CrtcPtr crtc)
+#ifdef HAVE_DRM_ATOMIC
+/*
+ * Atomic modeset support.  When enabled, modesets and flips are done
+ * by updating the crtc's primary plane (and for modesets, the crtc's
+ * mode and the connector routing) in a single atomic commit.  Modesets
+ * are validated with a test-only commit first, so a configuration the
+ * hw can't do is rejected without touching the display, and flips of
+ * all the crtcs which are ready to flip are a single nonblocking commit.
+ */
+
+static uint32_t
+drmmode_prop_id(int fd, uint32_t obj_id, uint32_t obj_type, const char *name)
 {
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmModeObjectPropertiesPtr props;
+	uint32_t prop_id = 0;
+	unsigned i;
 
-	drmModeSetCursor(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
-			0, 64, 64);
-	drmmode_crtc->cursor_visible = FALSE;
-}
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return 0;
 
-static void
-drmmode_show_cursor (xf86CrtcPtr crtc)
-{
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	for (i = 0; (i < props->count_props) && !prop_id; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, name))
+			prop_id = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
 
-	drmModeSetCursor(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
-			fd_bo_handle(drmmode_crtc->cursor), 64, 64);
-	drmmode_crtc->cursor_visible = TRUE;
+	drmModeFreeObjectProperties(props);
+
+	return prop_id;
 }
 
-static void *
-drmmode_crtc_shadow_allocate(xf86CrtcPtr crtc, int width, int height)
+static Bool
+drmmode_atomic_crtc_init(xf86CrtcPtr crtc, drmModePlaneResPtr plane_res)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	MSMPtr pMsm = MSMPTR(pScrn);
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 	drmmode_ptr drmmode = drmmode_crtc->drmmode;
-	int ret, pitch, size;
-	void *ptr;
-
-	pitch = MSMAlignedStride(width, 32);
-	size = pitch * height;
+	uint32_t crtc_id = drmmode_crtc->mode_crtc->crtc_id;
+	int fd = drmmode->fd;
+	unsigned i;
 
-	drmmode_crtc->rotate_pitch = pitch;
-	drmmode_crtc->rotate_bo = fd_bo_new(pMsm->dev, size,
-			DRM_FREEDRENO_GEM_TYPE_KMEM);
-	if (!drmmode_crtc->rotate_bo) {
-		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-				"Couldn't allocate shadow memory for rotated CRTC\n");
-		return NULL;
+	for (i = 0; (i < plane_res->count_planes) && !drmmode_crtc->plane_id; i++) {
+		drmModePlanePtr plane = drmModeGetPlane(fd, plane_res->planes[i]);
+		if (!plane)
+			continue;
+		if ((plane->possible_crtcs & (1 << drmmode_crtc->index)) &&
+				(drmmode_plane_type(fd, plane->plane_id) ==
+						DRM_PLANE_TYPE_PRIMARY))
+			drmmode_crtc->plane_id = plane->plane_id;
+		drmModeFreePlane(plane);
 	}
 
-	ptr = fd_bo_map(drmmode_crtc->rotate_bo);
-	if (!ptr) {
-		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-				"Couldn't get virtual address of shadow scanout\n");
-		fd_bo_del(drmmode_crtc->rotate_bo);
-		drmmode_crtc->rotate_bo = NULL;
-		return NULL;
-	}
+	if (!drmmode_crtc->plane_id)
+		return FALSE;
 
-	ret = drmModeAddFB(drmmode->fd, width, height, crtc->scrn->depth,
-			crtc->scrn->bitsPerPixel, drmmode_crtc->rotate_pitch,
-			fd_bo_handle(drmmode_crtc->rotate_bo),
-			&drmmode_crtc->rotate_fb_id);
-	if (ret) {
-		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-				"Error adding FB for shadow scanout: %s\n",
-				strerror(-ret));
-		fd_bo_del(drmmode_crtc->rotate_bo);
-		drmmode_crtc->rotate_bo = NULL;
-		return NULL;
-	}
+#define CRTC_PROP(field, name) \
+	drmmode_crtc->crtc_props.field = drmmode_prop_id(fd, crtc_id, \
+			DRM_MODE_OBJECT_CRTC, name); \
+	if (!drmmode_crtc->crtc_props.field) \
+		return FALSE
+#define PLANE_PROP(field, name) \
+	drmmode_crtc->plane_props.field = drmmode_prop_id(fd, \
+			drmmode_crtc->plane_id, DRM_MODE_OBJECT_PLANE, name); \
+	if (!drmmode_crtc->plane_props.field) \
+		return FALSE
+
+	CRTC_PROP(mode_id, "MODE_ID");
+	CRTC_PROP(active, "ACTIVE");
+	PLANE_PROP(fb_id, "FB_ID");
+	PLANE_PROP(crtc_id, "CRTC_ID");
+	PLANE_PROP(src_x, "SRC_X");
+	PLANE_PROP(src_y, "SRC_Y");
+	PLANE_PROP(src_w, "SRC_W");
+	PLANE_PROP(src_h, "SRC_H");
+	PLANE_PROP(crtc_x, "CRTC_X");
+	PLANE_PROP(crtc_y, "CRTC_Y");
+	PLANE_PROP(crtc_w, "CRTC_W");
+	PLANE_PROP(crtc_h, "CRTC_H");
+
+#undef CRTC_PROP
+#undef PLANE_PROP
 
-	return ptr;
+	return TRUE;
 }
 
-static PixmapPtr
-drmmode_crtc_shadow_create(xf86CrtcPtr crtc, void *data, int width, int height)
+/**
+ * Look up the primary planes and property ids needed for atomic
+ * modeset.  If anything is missing, fall back to legacy modeset.
+ */
+static void
+drmmode_atomic_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	PixmapPtr rotate_pixmap;
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmModePlaneResPtr plane_res;
+	uint64_t value = 0;
+	int i;
 
-	if (!data)
-		data = drmmode_crtc_shadow_allocate (crtc, width, height);
+	/* a flip commit gets an event per crtc, with the same data, so
+	 * drmmode_flip_handler2() needs the crtc id in them (linux 4.12):
+	 */
+#ifdef DRM_CAP_CRTC_IN_VBLANK_EVENT
+	drmGetCap(drmmode->fd, DRM_CAP_CRTC_IN_VBLANK_EVENT, &value);
+#endif
+	if (!value)
+		goto fail;
 
-	rotate_pixmap = drmmode_pixmap_wrap(pScrn->pScreen, width, height,
-			pScrn->depth, pScrn->bitsPerPixel,
-			drmmode_crtc->rotate_pitch,
-			drmmode_crtc->rotate_bo, data);
+	plane_res = drmModeGetPlaneResources(drmmode->fd);
+	if (!plane_res)
+		goto fail;
 
-	drmmode_crtc->rotate_pixmap = rotate_pixmap;
-	return drmmode_crtc->rotate_pixmap;
-}
+	for (i = 0; i < config->num_crtc; i++) {
+		if (!drmmode_atomic_crtc_init(config->crtc[i], plane_res)) {
+			drmModeFreePlaneResources(plane_res);
+			goto fail;
+		}
+	}
 
-static void
-drmmode_crtc_shadow_destroy(xf86CrtcPtr crtc, PixmapPtr rotate_pixmap, void *data)
-{
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmModeFreePlaneResources(plane_res);
 
-	if (rotate_pixmap)
-		FreeScratchPixmapHeader(rotate_pixmap);
+	for (i = 0; i < config->num_output; i++) {
+		drmmode_output_private_ptr drmmode_output =
+				config->output[i]->driver_private;
+		drmmode_output->prop_crtc_id = drmmode_prop_id(drmmode->fd,
+				drmmode_output->output_id,
+				DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+		if (!drmmode_output->prop_crtc_id)
+			goto fail;
 
-	if (data) {
-		drmModeRmFB(drmmode->fd, drmmode_crtc->rotate_fb_id);
-		drmmode_crtc->rotate_fb_id = 0;
-		fd_bo_del(drmmode_crtc->rotate_bo);
-		drmmode_crtc->rotate_bo = NULL;
-		drmmode_crtc->rotate_pixmap = NULL;
+		/* whatever the connector was left routed to (ie. by fbcon),
+		 * so a modeset can detach it again:
+		 */
+		if (drmmode_output->mode_output &&
+				drmmode_output->mode_output->encoder_id) {
+			drmModeEncoderPtr encoder = drmModeGetEncoder(drmmode->fd,
+					drmmode_output->mode_output->encoder_id);
+			if (encoder) {
+				drmmode_output->crtc_id = encoder->crtc_id;
+				drmModeFreeEncoder(encoder);
+			}
+		}
 	}
-}
 
-static void
-drmmode_gamma_set(xf86CrtcPtr crtc, CARD16 *red, CARD16 *green, CARD16 *blue,
-		int size)
-{
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
-	int ret;
-
-	ret = drmModeCrtcSetGamma(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
-			size, red, green, blue);
-	if (ret != 0) {
-		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-				"failed to set gamma: %s\n", strerror(-ret));
-	}
-}
+	INFO_MSG("Using atomic modeset");
 
-static const xf86CrtcFuncsRec drmmode_crtc_funcs = {
-		.dpms = drmmode_crtc_dpms,
-		.set_mode_major = drmmode_set_mode_major,
-		.set_cursor_position = drmmode_set_cursor_position,
-		.show_cursor = drmmode_show_cursor,
-		.hide_cursor = drmmode_hide_cursor,
-#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1,15,99,902,0)
-		.load_cursor_argb_check = drmmode_load_cursor_argb_check,
-#endif
-		.load_cursor_argb = drmmode_load_cursor_argb,
-		.shadow_create = drmmode_crtc_shadow_create,
-		.shadow_allocate = drmmode_crtc_shadow_allocate,
-		.shadow_destroy = drmmode_crtc_shadow_destroy,
-		.gamma_set = drmmode_gamma_set,
-};
+	return;
 
+fail:
+	WARNING_MSG("Atomic modeset not usable, falling back to legacy");
+	drmmode->atomic = FALSE;
+}
 
-static void
-drmmode_crtc_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int num)
+static int
+drmmode_atomic_add_plane(drmModeAtomicReqPtr req, xf86CrtcPtr crtc,
+		uint32_t fb_id, int x, int y)
 {
-	MSMPtr pMsm = MSMPTR(pScrn);
-	xf86CrtcPtr crtc;
-	drmmode_crtc_private_ptr drmmode_crtc;
-
-	crtc = xf86CrtcCreate(pScrn, &drmmode_crtc_funcs);
-	if (crtc == NULL)
-		return;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	uint32_t plane_id = drmmode_crtc->plane_id;
+	int w = crtc->mode.HDisplay, h = crtc->mode.VDisplay;
+	int ret = 0;
 
-	drmmode_crtc = xnfcalloc(sizeof(drmmode_crtc_private_rec), 1);
-	drmmode_crtc->mode_crtc = drmModeGetCrtc(drmmode->fd,
-			drmmode->mode_res->crtcs[num]);
-	drmmode_crtc->drmmode = drmmode;
+#define ADD(field, val) \
+	if (ret >= 0) ret = drmModeAtomicAddProperty(req, plane_id, \
+			drmmode_crtc->plane_props.field, val)
 
-	drmmode_crtc->cursor = fd_bo_new(pMsm->dev, 64*64*4,
-			DRM_FREEDRENO_GEM_TYPE_KMEM);
-	assert(drmmode_crtc->cursor);
+	ADD(fb_id, fb_id);
+	ADD(crtc_id, drmmode_crtc->mode_crtc->crtc_id);
+	ADD(src_x, x << 16);
+	ADD(src_y, y << 16);
+	ADD(src_w, w << 16);
+	ADD(src_h, h << 16);
+	ADD(crtc_x, 0);
+	ADD(crtc_y, 0);
+	ADD(crtc_w, w);
+	ADD(crtc_h, h);
 
-	crtc->driver_private = drmmode_crtc;
+#undef ADD
 
-	return;
+	return ret;
 }
 
-static xf86OutputStatus
-drmmode_output_detect(xf86OutputPtr output)
+static xf86CrtcPtr
+drmmode_crtc_from_id(ScrnInfoPtr pScrn, uint32_t crtc_id)
 {
-	/* go to the hw and retrieve a new output struct */
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	xf86OutputStatus status;
-	drmModeFreeConnector(drmmode_output->mode_output);
-
-	drmmode_output->mode_output =
-			drmModeGetConnector(drmmode->fd, drmmode_output->output_id);
-
-	if (!drmmode_output->mode_output)
-		return XF86OutputStatusDisconnected;
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
 
-	switch (drmmode_output->mode_output->connection) {
-	case DRM_MODE_CONNECTED:
-		status = XF86OutputStatusConnected;
-		break;
-	case DRM_MODE_DISCONNECTED:
-		status = XF86OutputStatusDisconnected;
-		break;
-	default:
-	case DRM_MODE_UNKNOWNCONNECTION:
-		status = XF86OutputStatusUnknown;
-		break;
+	for (i = 0; i < config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc = config->crtc[i]->driver_private;
+		if (drmmode_crtc->mode_crtc->crtc_id == crtc_id)
+			return config->crtc[i];
 	}
-	return status;
+
+	return NULL;
 }
 
+/* A crtc we lit up which the xserver has since disabled, and which can
+ * be switched off as part of the next modeset:
+ */
 static Bool
-drmmode_output_mode_valid(xf86OutputPtr output, DisplayModePtr mode)
+drmmode_atomic_crtc_off(xf86CrtcPtr crtc)
 {
-	if (mode->type & M_T_DEFAULT)
-		/* Default modes are harmful here. */
-		return MODE_BAD;
-
-	return MODE_OK;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	return !crtc->enabled && drmmode_crtc->mode_blob_id;
 }
 
-static DisplayModePtr
-drmmode_output_get_modes(xf86OutputPtr output)
+/**
+ * Set the mode on the crtc, in a single commit (validated first with a
+ * test-only commit) which covers all of the crtcs: the other crtcs which
+ * we lit up are added as they are, so the configuration as a whole is
+ * checked, and those which the xserver has since disabled are switched
+ * off.  Connectors are routed to the crtc, and connectors which were
+ * on it (or on a crtc being switched off) but no longer are, detached.
+ */
+static Bool
+drmmode_atomic_set_mode(xf86CrtcPtr crtc, drmModeModeInfo *kmode,
+		uint32_t fb_id, int x, int y)
 {
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmModeConnectorPtr koutput = drmmode_output->mode_output;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	int i;
-	DisplayModePtr Modes = NULL, Mode;
-	drmModePropertyPtr props;
-	xf86MonPtr ddc_mon = NULL;
+	ScrnInfoPtr pScrn = crtc->scrn;
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	uint32_t crtc_id = drmmode_crtc->mode_crtc->crtc_id;
+	uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	drmModeAtomicReqPtr req;
+	uint32_t blob_id;
+	int i, ret;
 
-	if (!koutput)
-		return NULL;
+	ret = drmModeCreatePropertyBlob(drmmode->fd, kmode,
+			sizeof(*kmode), &blob_id);
+	if (ret) {
+		ERROR_MSG("failed to create mode blob: %s", strerror(-ret));
+		return FALSE;
+	}
 
-	/* look for an EDID property */
-	for (i = 0; i < koutput->count_props; i++) {
-		props = drmModeGetProperty(drmmode->fd, koutput->props[i]);
-		if (!props || !(props->flags & DRM_MODE_PROP_BLOB))
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		drmModeDestroyPropertyBlob(drmmode->fd, blob_id);
+		return FALSE;
+	}
+
+	for (i = 0; (i < config->num_crtc) && (ret >= 0); i++) {
+		xf86CrtcPtr other = config->crtc[i];
+		drmmode_crtc_private_ptr other_crtc = other->driver_private;
+		uint32_t other_id = other_crtc->mode_crtc->crtc_id;
+		uint32_t mode_id;
+		int active;
+
+		if (other == crtc) {
+			mode_id = blob_id;
+			active = 1;
+		} else if (drmmode_atomic_crtc_off(other)) {
+			mode_id = 0;
+			active = 0;
+		} else if (other->enabled && other_crtc->mode_blob_id) {
+			mode_id = other_crtc->mode_blob_id;
+			active = 1;
+		} else {
+			/* not (yet) set up by us, leave it alone: */
 			continue;
+		}
 
-		if (!strcmp(props->name, "EDID")) {
-			if (drmmode_output->edid_blob)
-				drmModeFreePropertyBlob(drmmode_output->edid_blob);
-			drmmode_output->edid_blob =
-					drmModeGetPropertyBlob(drmmode->fd,
-							koutput->prop_values[i]);
+		ret = drmModeAtomicAddProperty(req, other_id,
+				other_crtc->crtc_props.mode_id, mode_id);
+		if (ret >= 0)
+			ret = drmModeAtomicAddProperty(req, other_id,
+					other_crtc->crtc_props.active, active);
+
+		if ((ret >= 0) && !active) {
+			ret = drmModeAtomicAddProperty(req, other_crtc->plane_id,
+					other_crtc->plane_props.fb_id, 0);
+			if (ret >= 0)
+				ret = drmModeAtomicAddProperty(req, other_crtc->plane_id,
+						other_crtc->plane_props.crtc_id, 0);
 		}
-		drmModeFreeProperty(props);
 	}
 
-	if (drmmode_output->edid_blob) {
-		ddc_mon = xf86InterpretEDID(output->scrn->scrnIndex,
-				drmmode_output->edid_blob->data);
-		if (ddc_mon && drmmode_output->edid_blob->length > 128)
-			ddc_mon->flags |= MONITOR_EDID_COMPLETE_RAWDATA;
+	for (i = 0; (i < config->num_output) && (ret >= 0); i++) {
+		xf86OutputPtr output = config->output[i];
+		drmmode_output_private_ptr drmmode_output = output->driver_private;
+		xf86CrtcPtr cur = drmmode_crtc_from_id(pScrn, drmmode_output->crtc_id);
+
+		if (output->crtc == crtc) {
+			ret = drmModeAtomicAddProperty(req,
+					drmmode_output->output_id,
+					drmmode_output->prop_crtc_id, crtc_id);
+		} else if (cur && ((cur == crtc) || drmmode_atomic_crtc_off(cur))) {
+			ret = drmModeAtomicAddProperty(req,
+					drmmode_output->output_id,
+					drmmode_output->prop_crtc_id, 0);
+		}
 	}
-	xf86OutputSetEDID(output, ddc_mon);
 
-	/* modes should already be available */
-	for (i = 0; i < koutput->count_modes; i++) {
-		Mode = xnfalloc(sizeof(DisplayModeRec));
+	if (ret >= 0)
+		ret = drmmode_atomic_add_plane(req, crtc, fb_id, x, y);
 
-		drmmode_ConvertFromKMode(output->scrn, &koutput->modes[i],
-				Mode);
-		Modes = xf86ModesAdd(Modes, Mode);
+	/* validate first, so an unsupported configuration doesn't
+	 * result in a flicker:
+	 */
+	if (ret >= 0) {
+		ret = drmModeAtomicCommit(drmmode->fd, req,
+				flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+		if (ret) {
+			DEBUG_MSG("atomic test commit failed: %s", strerror(-ret));
+		}
+	}
+
+	if (ret >= 0)
+		ret = drmModeAtomicCommit(drmmode->fd, req, flags, NULL);
+
+	drmModeAtomicFree(req);
 
+	if (ret) {
+		drmModeDestroyPropertyBlob(drmmode->fd, blob_id);
+		return FALSE;
 	}
-	return Modes;
-}
 
-static void
-drmmode_output_destroy(xf86OutputPtr output)
-{
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	int i;
+	/* now that it has happened, update our view of the routing: */
+	for (i = 0; i < config->num_output; i++) {
+		xf86OutputPtr output = config->output[i];
+		drmmode_output_private_ptr drmmode_output = output->driver_private;
+		xf86CrtcPtr cur = drmmode_crtc_from_id(pScrn, drmmode_output->crtc_id);
 
-	if (drmmode_output->edid_blob)
-		drmModeFreePropertyBlob(drmmode_output->edid_blob);
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		drmModeFreeProperty(drmmode_output->props[i].mode_prop);
-		free(drmmode_output->props[i].atoms);
+		if (output->crtc == crtc)
+			drmmode_output->crtc_id = crtc_id;
+		else if (cur && ((cur == crtc) || drmmode_atomic_crtc_off(cur)))
+			drmmode_output->crtc_id = 0;
 	}
-	drmModeFreeConnector(drmmode_output->mode_output);
-	free(drmmode_output);
-	output->driver_private = NULL;
-}
 
-static void
-drmmode_output_dpms(xf86OutputPtr output, int mode)
-{
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmModeConnectorPtr koutput = drmmode_output->mode_output;
-	drmModePropertyPtr props;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	int mode_id = -1, i;
+	for (i = 0; i < config->num_crtc; i++) {
+		drmmode_crtc_private_ptr other_crtc = config->crtc[i]->driver_private;
 
-	for (i = 0; i < koutput->count_props; i++) {
-		props = drmModeGetProperty(drmmode->fd, koutput->props[i]);
-		if (props && (props->flags & DRM_MODE_PROP_ENUM)) {
-			if (!strcmp(props->name, "DPMS")) {
-				mode_id = koutput->props[i];
-				drmModeFreeProperty(props);
-				break;
-			}
-			drmModeFreeProperty(props);
-		}
+		if (!drmmode_atomic_crtc_off(config->crtc[i]))
+			continue;
+
+		drmModeDestroyPropertyBlob(drmmode->fd, other_crtc->mode_blob_id);
+		other_crtc->mode_blob_id = 0;
 	}
 
-	if (mode_id < 0)
-		return;
+	if (drmmode_crtc->mode_blob_id)
+		drmModeDestroyPropertyBlob(drmmode->fd, drmmode_crtc->mode_blob_id);
+	drmmode_crtc->mode_blob_id = blob_id;
 
-	drmModeConnectorSetProperty(drmmode->fd, koutput->connector_id,
-			mode_id, mode);
+	return TRUE;
 }
 
-static Bool
-drmmode_property_ignore(drmModePropertyPtr prop)
+/**
+ * Flip the crtcs, with a single nonblocking commit which only touches
+ * their primary planes.  The kernel sends an event per crtc, all with
+ * the same data.  Returns 0 or a negative error code, like
+ * drmModePageFlip().
+ */
+static int
+drmmode_atomic_page_flip(xf86CrtcPtr *crtcs, int num, uint32_t fb_id,
+		uint32_t flags, void *data)
 {
-	if (!prop)
-		return TRUE;
-	/* ignore blob prop */
-	if (prop->flags & DRM_MODE_PROP_BLOB)
-		return TRUE;
-	/* ignore standard property */
-	if (!strcmp(prop->name, "EDID") ||
-			!strcmp(prop->name, "DPMS"))
-		return TRUE;
+	drmmode_crtc_private_ptr drmmode_crtc = crtcs[0]->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmModeAtomicReqPtr req;
+	int i, ret = 0;
 
-	return FALSE;
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	for (i = 0; (i < num) && (ret >= 0); i++)
+		ret = drmmode_atomic_add_plane(req, crtcs[i], fb_id,
+				crtcs[i]->x, crtcs[i]->y);
+	if (ret >= 0)
+		ret = drmModeAtomicCommit(drmmode->fd, req,
+				flags | DRM_MODE_ATOMIC_NONBLOCK, data);
+
+	drmModeAtomicFree(req);
+
+	return ret;
 }
+#endif
 
-static void
-drmmode_output_create_resources(xf86OutputPtr output)
+/* connector ids of the outputs on the crtc, for drmModeSetCrtc(): */
+static uint32_t *
+drmmode_crtc_output_ids(xf86CrtcPtr crtc, int *count)
 {
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmModeConnectorPtr mode_output = drmmode_output->mode_output;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	drmModePropertyPtr drmmode_prop;
-	uint32_t value;
-	int i, j, err;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	uint32_t *output_ids;
+	int i;
 
-	drmmode_output->props = calloc(mode_output->count_props, sizeof(drmmode_prop_rec));
-	if (!drmmode_output->props)
-		return;
+	output_ids = calloc(sizeof(uint32_t), xf86_config->num_output);
+	if (!output_ids)
+		return NULL;
 
-	drmmode_output->num_props = 0;
-	for (i = 0, j = 0; i < mode_output->count_props; i++) {
-		drmmode_prop = drmModeGetProperty(drmmode->fd, mode_output->props[i]);
-		if (drmmode_property_ignore(drmmode_prop)) {
-			drmModeFreeProperty(drmmode_prop);
+	*count = 0;
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		drmmode_output_private_ptr drmmode_output;
+
+		if (output->crtc != crtc)
 			continue;
+
+		drmmode_output = output->driver_private;
+		output_ids[(*count)++] = drmmode_output->output_id;
+	}
+
+	return output_ids;
+}
+
+static Bool
+drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
+		Rotation rotation, int x, int y)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	MSMPtr pMsm = MSMPTR(pScrn);
+	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	uint32_t *output_ids;
+	int output_count = 0;
+	int ret = TRUE;
+	int i;
+	int fb_id;
+	drmModeModeInfo kmode;
+
+	if (!drmmode->fb) {
+		int pitch = MSMAlignedStride(pScrn->virtualX,
+				pScrn->bitsPerPixel);
+		pScrn->displayWidth = pitch / (pScrn->bitsPerPixel >> 3);
+		drmmode->fb = drmmode_scanout_fb_new(pScrn, drmmode);
+		if (!drmmode->fb) {
+			xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+					"Error adding FB for scanout: %s\n",
+					strerror(errno));
+			return FALSE;
 		}
-		drmmode_output->props[j].mode_prop = drmmode_prop;
-		drmmode_output->props[j].index = i;
-		drmmode_output->num_props++;
-		j++;
 	}
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		drmmode_prop_ptr p = &drmmode_output->props[i];
-		drmmode_prop = p->mode_prop;
+	if (!xf86CrtcRotate(crtc))
+		return FALSE;
 
-		value = drmmode_output->mode_output->prop_values[p->index];
+	output_ids = drmmode_crtc_output_ids(crtc, &output_count);
+	if (!output_ids)
+		return FALSE;
 
-		if (drmmode_prop->flags & DRM_MODE_PROP_RANGE) {
-			INT32 range[2];
+	drmmode_ConvertToKMode(crtc->scrn, &kmode, mode);
 
-			p->num_atoms = 1;
-			p->atoms = calloc(p->num_atoms, sizeof(Atom));
-			if (!p->atoms)
-				continue;
-			p->atoms[0] = MakeAtom(drmmode_prop->name, strlen(drmmode_prop->name), TRUE);
-			range[0] = drmmode_prop->values[0];
-			range[1] = drmmode_prop->values[1];
-			err = RRConfigureOutputProperty(output->randr_output, p->atoms[0],
-					FALSE, TRUE,
-					drmmode_prop->flags & DRM_MODE_PROP_IMMUTABLE ? TRUE : FALSE,
-							2, range);
-			if (err != 0) {
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRConfigureOutputProperty error, %d\n", err);
-			}
-			err = RRChangeOutputProperty(output->randr_output, p->atoms[0],
-					XA_INTEGER, 32, PropModeReplace, 1,
-					&value, FALSE, FALSE);
-			if (err != 0) {
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRChangeOutputProperty error, %d\n", err);
-			}
-		} else if (drmmode_prop->flags & DRM_MODE_PROP_ENUM) {
-			p->num_atoms = drmmode_prop->count_enums + 1;
-			p->atoms = calloc(p->num_atoms, sizeof(Atom));
-			if (!p->atoms)
-				continue;
-			p->atoms[0] = MakeAtom(drmmode_prop->name, strlen(drmmode_prop->name), TRUE);
-			for (j = 1; j <= drmmode_prop->count_enums; j++) {
-				struct drm_mode_property_enum *e = &drmmode_prop->enums[j-1];
-				p->atoms[j] = MakeAtom(e->name, strlen(e->name), TRUE);
-			}
-			err = RRConfigureOutputProperty(output->randr_output, p->atoms[0],
-					FALSE, FALSE,
-					drmmode_prop->flags & DRM_MODE_PROP_IMMUTABLE ? TRUE : FALSE,
-							p->num_atoms - 1, (INT32 *)&p->atoms[1]);
-			if (err != 0) {
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRConfigureOutputProperty error, %d\n", err);
-			}
-			for (j = 0; j < drmmode_prop->count_enums; j++)
-				if (drmmode_prop->enums[j].value == value)
-					break;
-			/* there's always a matching value */
-			err = RRChangeOutputProperty(output->randr_output, p->atoms[0],
-					XA_ATOM, 32, PropModeReplace, 1, &p->atoms[j+1], FALSE, FALSE);
-			if (err != 0) {
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRChangeOutputProperty error, %d\n", err);
-			}
+	fb_id = drmmode->fb->fb_id;
+	if (drmmode_crtc->rotate_fb_id) {
+		fb_id = drmmode_crtc->rotate_fb_id;
+		x = 0;
+		y = 0;
+	}
+
+#ifdef HAVE_DRM_ATOMIC
+	if (drmmode->atomic) {
+		ret = drmmode_atomic_set_mode(crtc, &kmode, fb_id, x, y) ? 0 : -EINVAL;
+	} else
+#endif
+	ret = drmModeSetCrtc(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
+			fb_id, x, y, output_ids, output_count, &kmode);
+	free(output_ids);
+
+	if (ret) {
+		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+				"failed to set mode: %s\n", strerror(-ret));
+		return FALSE;
+	}
+
+	/* the completion of the flip in flight (if any) no longer means
+	 * its fb is being scanned out:
+	 */
+	if (drmmode_crtc->flip_fb)
+		drmmode_crtc->flip_superseded = TRUE;
+	drmmode_fb_unref(drmmode, drmmode_crtc->scanout_fb);
+	drmmode_crtc->scanout_fb = drmmode_fb_ref(drmmode->fb);
+
+	/* Work around some xserver stupidity */
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+
+		if (output->crtc != crtc)
+			continue;
+
+		drmmode_output_dpms(output, DPMSModeOn);
+	}
+
+	crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
+			crtc->gamma_blue, crtc->gamma_size);
+
+	if (pMsm->HWCursor)
+		xf86_reload_cursors(crtc->scrn->pScreen);
+
+	return TRUE;
+}
+
+static void
+drmmode_set_cursor_position (xf86CrtcPtr crtc, int x, int y)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	drmModeMoveCursor(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id, x, y);
+}
+
+#define CURSOR_SIZE(drmmode) \
+	((drmmode)->cursor_width * (drmmode)->cursor_height * 4)
+
+/* FNV-1a, good enough to tell cursors apart: */
+static uint32_t
+hash_cursor(drmmode_ptr drmmode, const CARD32 *image)
+{
+	uint32_t hash = 2166136261u;
+	int i, n = drmmode->cursor_width * drmmode->cursor_height;
+
+	for (i = 0; i < n; i++) {
+		hash ^= image[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static drmmode_cursor_ptr
+drmmode_cursor_lookup(xf86CrtcPtr crtc, CARD32 *image)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	uint32_t hash = hash_cursor(drmmode, image);
+	CursorPtr cur = xf86CurrentCursor(crtc->scrn->pScreen);
+	int xhot = cur ? cur->bits->xhot : 0;
+	int yhot = cur ? cur->bits->yhot : 0;
+	drmmode_cursor_ptr lru = NULL;
+	int i;
+
+	for (i = 0; i < CURSOR_CACHE_SIZE; i++) {
+		drmmode_cursor_ptr cursor = &drmmode_crtc->cursors[i];
+
+		/* the hotspot is part of the key, since it is passed to the
+		 * kernel along with the bo:
+		 */
+		if (cursor->bo && (cursor->hash == hash) &&
+				(cursor->xhot == xhot) && (cursor->yhot == yhot) &&
+				!memcmp(cursor->image, image, CURSOR_SIZE(drmmode)))
+			return cursor;
+
+		if (!lru || (cursor->last_used < lru->last_used))
+			lru = cursor;
+	}
+
+	/* not found, so upload the image into the least recently used
+	 * slot.  The currently loaded cursor is always the most recently
+	 * used, so this never overwrites what is being scanned out.  The
+	 * new image is written off-screen and only becomes visible once
+	 * drmModeSetCursor switches to it:
+	 */
+	if (!lru->bo) {
+		MSMPtr pMsm = MSMPTR(crtc->scrn);
+		lru->bo = msm_bo_new(pMsm, CURSOR_SIZE(drmmode),
+				DRM_FREEDRENO_GEM_TYPE_KMEM);
+		lru->image = malloc(CURSOR_SIZE(drmmode));
+		if (!lru->bo || !lru->image) {
+			if (lru->bo)
+				fd_bo_del(lru->bo);
+			free(lru->image);
+			lru->bo = NULL;
+			lru->image = NULL;
+			return NULL;
 		}
 	}
+
+	memcpy(fd_bo_map(lru->bo), image, CURSOR_SIZE(drmmode));
+	memcpy(lru->image, image, CURSOR_SIZE(drmmode));
+	lru->hash = hash;
+	lru->xhot = xhot;
+	lru->yhot = yhot;
+
+	return lru;
+}
+
+static int
+drmmode_set_cursor(xf86CrtcPtr crtc, struct fd_bo *bo)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	uint32_t crtc_id = drmmode_crtc->mode_crtc->crtc_id;
+	uint32_t handle = bo ? fd_bo_handle(bo) : 0;
+	int ret;
+
+	/* with SetCursor2 the kernel knows the hotspot, which matters for
+	 * virtual hw and for cursor planes that can't go off the top/left
+	 * edge of the screen:
+	 */
+	if (drmmode->set_cursor2) {
+		drmmode_cursor_ptr cursor = drmmode_crtc->cursor;
+		int xhot = (bo && cursor) ? cursor->xhot : 0;
+		int yhot = (bo && cursor) ? cursor->yhot : 0;
+
+		ret = drmModeSetCursor2(drmmode->fd, crtc_id, handle,
+				drmmode->cursor_width, drmmode->cursor_height,
+				xhot, yhot);
+		if (ret != -EINVAL)
+			return ret;
+
+		drmmode->set_cursor2 = FALSE;
+	}
+
+	return drmModeSetCursor(drmmode->fd, crtc_id, handle,
+			drmmode->cursor_width, drmmode->cursor_height);
 }
 
 static Bool
-drmmode_output_set_property(xf86OutputPtr output, Atom property,
-		RRPropertyValuePtr value)
+drmmode_load_cursor_argb_check(xf86CrtcPtr crtc, CARD32 *image)
 {
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	int i, ret;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_cursor_ptr cursor;
+	int ret = 0;
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		drmmode_prop_ptr p = &drmmode_output->props[i];
+	cursor = drmmode_cursor_lookup(crtc, image);
+	if (!cursor)
+		return FALSE;
 
-		if (p->atoms[0] != property)
-			continue;
+	cursor->last_used = ++drmmode_crtc->cursor_serial;
 
-		if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
-			uint32_t val;
+	if (cursor == drmmode_crtc->cursor)
+		return TRUE;
 
-			if (value->type != XA_INTEGER || value->format != 32 ||
-					value->size != 1)
-				return FALSE;
-			val = *(uint32_t *)value->data;
+	drmmode_crtc->cursor = cursor;
 
-			ret = drmModeConnectorSetProperty(drmmode->fd, drmmode_output->output_id,
-					p->mode_prop->prop_id, (uint64_t)val);
+	if (drmmode_crtc->cursor_visible) {
+		ret = drmmode_set_cursor(crtc, cursor->bo);
+	}
 
-			if (ret)
-				return FALSE;
+	return ret == 0;
+}
 
-			return TRUE;
+static void
+drmmode_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
+{
+	drmmode_load_cursor_argb_check(crtc, image);
+}
 
-		} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
-			Atom	atom;
-			const char	*name;
-			int		j;
+static void
+drmmode_hide_cursor (xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-			if (value->type != XA_ATOM || value->format != 32 || value->size != 1)
-				return FALSE;
-			memcpy(&atom, value->data, 4);
-			name = NameForAtom(atom);
+	drmmode_set_cursor(crtc, NULL);
+	drmmode_crtc->cursor_visible = FALSE;
+}
 
-			/* search for matching name string, then set its value down */
-			for (j = 0; j < p->mode_prop->count_enums; j++) {
-				if (!strcmp(p->mode_prop->enums[j].name, name)) {
-					ret = drmModeConnectorSetProperty(drmmode->fd,
-							drmmode_output->output_id,
-							p->mode_prop->prop_id,
-							p->mode_prop->enums[j].value);
+static void
+drmmode_show_cursor (xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-					if (ret)
-						return FALSE;
+	if (!drmmode_crtc->cursor)
+		return;
 
-					return TRUE;
-				}
-			}
+	drmmode_set_cursor(crtc, drmmode_crtc->cursor->bo);
+	drmmode_crtc->cursor_visible = TRUE;
+}
+
+static void *
+drmmode_crtc_shadow_allocate(xf86CrtcPtr crtc, int width, int height)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	MSMPtr pMsm = MSMPTR(pScrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int ret, pitch, size;
+	void *ptr;
+
+	pitch = MSMAlignedStride(width, 32);
+	size = pitch * height;
+
+	drmmode_crtc->rotate_pitch = pitch;
+	drmmode_crtc->rotate_bo = msm_bo_new(pMsm, size,
+			DRM_FREEDRENO_GEM_TYPE_KMEM);
+	if (!drmmode_crtc->rotate_bo) {
+		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+				"Couldn't allocate shadow memory for rotated CRTC\n");
+		return NULL;
+	}
+
+	ptr = fd_bo_map(drmmode_crtc->rotate_bo);
+	if (!ptr) {
+		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+				"Couldn't get virtual address of shadow scanout\n");
+		fd_bo_del(drmmode_crtc->rotate_bo);
+		drmmode_crtc->rotate_bo = NULL;
+		return NULL;
+	}
+
+	ret = drmModeAddFB(drmmode->fd, width, height, crtc->scrn->depth,
+			crtc->scrn->bitsPerPixel, drmmode_crtc->rotate_pitch,
+			fd_bo_handle(drmmode_crtc->rotate_bo),
+			&drmmode_crtc->rotate_fb_id);
+	if (ret) {
+		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+				"Error adding FB for shadow scanout: %s\n",
+				strerror(-ret));
+		fd_bo_del(drmmode_crtc->rotate_bo);
+		drmmode_crtc->rotate_bo = NULL;
+		return NULL;
+	}
+
+	return ptr;
+}
+
+static PixmapPtr
+drmmode_crtc_shadow_create(xf86CrtcPtr crtc, void *data, int width, int height)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	PixmapPtr rotate_pixmap;
+
+	if (!data)
+		data = drmmode_crtc_shadow_allocate (crtc, width, height);
+
+	rotate_pixmap = drmmode_pixmap_wrap(pScrn->pScreen, width, height,
+			pScrn->depth, pScrn->bitsPerPixel,
+			drmmode_crtc->rotate_pitch,
+			drmmode_crtc->rotate_bo, data);
+
+	drmmode_crtc->rotate_pixmap = rotate_pixmap;
+	return drmmode_crtc->rotate_pixmap;
+}
+
+static void
+drmmode_crtc_shadow_destroy(xf86CrtcPtr crtc, PixmapPtr rotate_pixmap, void *data)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	if (rotate_pixmap)
+		FreeScratchPixmapHeader(rotate_pixmap);
+
+	if (data) {
+		drmModeRmFB(drmmode->fd, drmmode_crtc->rotate_fb_id);
+		drmmode_crtc->rotate_fb_id = 0;
+		fd_bo_del(drmmode_crtc->rotate_bo);
+		drmmode_crtc->rotate_bo = NULL;
+		drmmode_crtc->rotate_pixmap = NULL;
+	}
+}
+
+static void
+drmmode_gamma_set(xf86CrtcPtr crtc, CARD16 *red, CARD16 *green, CARD16 *blue,
+		int size)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int ret;
+
+	ret = drmModeCrtcSetGamma(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
+			size, red, green, blue);
+	if (ret != 0) {
+		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+				"failed to set gamma: %s\n", strerror(-ret));
+	}
+}
+
+static const xf86CrtcFuncsRec drmmode_crtc_funcs = {
+		.dpms = drmmode_crtc_dpms,
+		.set_mode_major = drmmode_set_mode_major,
+		.set_cursor_position = drmmode_set_cursor_position,
+		.show_cursor = drmmode_show_cursor,
+		.hide_cursor = drmmode_hide_cursor,
+#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1,15,99,902,0)
+		.load_cursor_argb_check = drmmode_load_cursor_argb_check,
+#endif
+		.load_cursor_argb = drmmode_load_cursor_argb,
+		.shadow_create = drmmode_crtc_shadow_create,
+		.shadow_allocate = drmmode_crtc_shadow_allocate,
+		.shadow_destroy = drmmode_crtc_shadow_destroy,
+		.gamma_set = drmmode_gamma_set,
+};
+
+
+static void
+drmmode_crtc_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int num)
+{
+	xf86CrtcPtr crtc;
+	drmmode_crtc_private_ptr drmmode_crtc;
+
+	crtc = xf86CrtcCreate(pScrn, &drmmode_crtc_funcs);
+	if (crtc == NULL)
+		return;
+
+	drmmode_crtc = xnfcalloc(sizeof(drmmode_crtc_private_rec), 1);
+	drmmode_crtc->mode_crtc = drmModeGetCrtc(drmmode->fd,
+			drmmode->mode_res->crtcs[num]);
+	drmmode_crtc->drmmode = drmmode;
+	drmmode_crtc->index = num;
+
+	crtc->driver_private = drmmode_crtc;
+
+	return;
+}
+
+/**
+ * Get a property's metadata.  Property ids are global, rather than per
+ * connector, so they are cached to avoid fetching the same properties
+ * over and over for each connector.  The returned property belongs to
+ * the cache.
+ */
+static drmModePropertyPtr
+drmmode_get_property(drmmode_ptr drmmode, uint32_t prop_id)
+{
+	drmModePropertyPtr prop, *props;
+	int i;
+
+	for (i = 0; i < drmmode->num_props; i++)
+		if (drmmode->props[i]->prop_id == prop_id)
+			return drmmode->props[i];
+
+	prop = drmModeGetProperty(drmmode->fd, prop_id);
+	if (!prop)
+		return NULL;
+
+	props = realloc(drmmode->props,
+			(drmmode->num_props + 1) * sizeof(*props));
+	if (!props) {
+		drmModeFreeProperty(prop);
+		return NULL;
+	}
+
+	props[drmmode->num_props++] = prop;
+	drmmode->props = props;
+
+	return prop;
+}
+
+/* Find the index of the named property of the connector, or -1: */
+static int
+drmmode_connector_prop_index(drmmode_ptr drmmode, drmModeConnectorPtr koutput,
+		const char *name)
+{
+	int i;
+
+	for (i = 0; i < koutput->count_props; i++) {
+		drmModePropertyPtr prop = drmmode_get_property(drmmode, koutput->props[i]);
+		if (prop && !strcmp(prop->name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Get the connector state.  If probe is set, the connector is always
+ * re-probed (which can mean slow EDID reads).  Otherwise it comes from
+ * the cache if there has been no hotplug since it was fetched, or else
+ * the kernel's current state is fetched.
+ */
+static drmModeConnectorPtr
+drmmode_output_connector(drmmode_output_private_ptr drmmode_output, Bool probe)
+{
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+
+	if (!probe && drmmode_output->mode_output && drmmode->connector_gen &&
+			(drmmode_output->gen == drmmode->connector_gen))
+		return drmmode_output->mode_output;
+
+	drmModeFreeConnector(drmmode_output->mode_output);
+
+#ifdef HAVE_DRM_GET_CONNECTOR_CURRENT
+	if (!probe)
+		drmmode_output->mode_output = drmModeGetConnectorCurrent(
+				drmmode->fd, drmmode_output->output_id);
+	else
+#endif
+	drmmode_output->mode_output =
+			drmModeGetConnector(drmmode->fd, drmmode_output->output_id);
+
+	drmmode_output->gen = drmmode->connector_gen;
+
+	return drmmode_output->mode_output;
+}
+
+static xf86OutputStatus
+drmmode_output_detect(xf86OutputPtr output)
+{
+	/* go to the hw and retrieve a new output struct */
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	xf86OutputStatus status;
+
+	/* re-probing a connector can mean reading EDID over a slow i2c
+	 * bus, so when responding to hotplug events only do that for the
+	 * connectors the events were for.  And the initial configuration
+	 * can use what drmmode_output_init() just probed, rather than
+	 * probing every connector twice at startup.  Any other detect is
+	 * an explicit probe (ie. xrandr), so it bypasses the cache:
+	 */
+	if (!drmmode_output->probed)
+		drmmode_output_connector(drmmode_output,
+				!drmmode->hotplug || drmmode_output->probe);
+	drmmode_output->probe = FALSE;
+	drmmode_output->probed = FALSE;
+
+	if (!drmmode_output->mode_output)
+		return XF86OutputStatusDisconnected;
+
+	switch (drmmode_output->mode_output->connection) {
+	case DRM_MODE_CONNECTED:
+		status = XF86OutputStatusConnected;
+		break;
+	case DRM_MODE_DISCONNECTED:
+		status = XF86OutputStatusDisconnected;
+		break;
+	default:
+	case DRM_MODE_UNKNOWNCONNECTION:
+		status = XF86OutputStatusUnknown;
+		break;
+	}
+	return status;
+}
+
+static Bool
+drmmode_output_mode_valid(xf86OutputPtr output, DisplayModePtr mode)
+{
+	if (mode->type & M_T_DEFAULT)
+		/* Default modes are harmful here. */
+		return MODE_BAD;
+
+	return MODE_OK;
+}
+
+static DisplayModePtr
+drmmode_output_get_modes(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmModeConnectorPtr koutput = drmmode_output->mode_output;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	int i;
+	DisplayModePtr Modes = NULL, Mode;
+	xf86MonPtr ddc_mon = NULL;
+
+	if (!koutput)
+		return NULL;
+
+	/* look for an EDID property.  The kernel creates a new blob
+	 * whenever the EDID changes, so it only needs to be fetched if
+	 * the blob id changed:
+	 */
+	i = drmmode_connector_prop_index(drmmode, koutput, "EDID");
+	if ((i >= 0) && (koutput->prop_values[i] != drmmode_output->edid_blob_id)) {
+		if (drmmode_output->edid_blob)
+			drmModeFreePropertyBlob(drmmode_output->edid_blob);
+		drmmode_output->edid_blob_id = koutput->prop_values[i];
+		drmmode_output->edid_blob = drmmode_output->edid_blob_id ?
+				drmModeGetPropertyBlob(drmmode->fd,
+						drmmode_output->edid_blob_id) : NULL;
+	}
+
+	if (drmmode_output->edid_blob) {
+		ddc_mon = xf86InterpretEDID(output->scrn->scrnIndex,
+				drmmode_output->edid_blob->data);
+		if (ddc_mon && drmmode_output->edid_blob->length > 128)
+			ddc_mon->flags |= MONITOR_EDID_COMPLETE_RAWDATA;
+	}
+	xf86OutputSetEDID(output, ddc_mon);
+
+	/* modes should already be available */
+	for (i = 0; i < koutput->count_modes; i++) {
+		Mode = xnfalloc(sizeof(DisplayModeRec));
+
+		drmmode_ConvertFromKMode(output->scrn, &koutput->modes[i],
+				Mode);
+		Modes = xf86ModesAdd(Modes, Mode);
+
+	}
+	return Modes;
+}
+
+static void
+drmmode_output_destroy(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(output->scrn);
+	int i;
+
+	if (drmmode_output->edid_blob)
+		drmModeFreePropertyBlob(drmmode_output->edid_blob);
+	for (i = 0; i < drmmode_output->num_props; i++)
+		free(drmmode_output->props[i].atoms);
+	free(drmmode_output->props);
+	drmModeFreeConnector(drmmode_output->mode_output);
+	free(drmmode_output);
+	output->driver_private = NULL;
+
+	/* the property metadata is shared by the outputs, so it goes with
+	 * the last one (which is still counted while being destroyed):
+	 */
+	if (config->num_output <= 1) {
+		for (i = 0; i < drmmode->num_props; i++)
+			drmModeFreeProperty(drmmode->props[i]);
+		free(drmmode->props);
+		drmmode->props = NULL;
+		drmmode->num_props = 0;
+	}
+}
+
+static void
+drmmode_output_dpms(xf86OutputPtr output, int mode)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmModeConnectorPtr koutput = drmmode_output->mode_output;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	int mode_id = -1, i;
+
+	/* the connector state can be gone, ie. if re-fetching it failed: */
+	if (!koutput)
+		return;
+
+	i = drmmode_connector_prop_index(drmmode, koutput, "DPMS");
+	if (i >= 0)
+		mode_id = koutput->props[i];
+
+	if (mode_id < 0)
+		return;
+
+	drmModeConnectorSetProperty(drmmode->fd, koutput->connector_id,
+			mode_id, mode);
+}
+
+static Bool
+drmmode_property_ignore(drmModePropertyPtr prop)
+{
+	if (!prop)
+		return TRUE;
+	/* ignore blob prop */
+	if (prop->flags & DRM_MODE_PROP_BLOB)
+		return TRUE;
+	/* ignore standard property */
+	if (!strcmp(prop->name, "EDID") ||
+			!strcmp(prop->name, "DPMS"))
+		return TRUE;
+
+	return FALSE;
+}
+
+static void
+drmmode_output_create_resources(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmModeConnectorPtr mode_output = drmmode_output->mode_output;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	drmModePropertyPtr drmmode_prop;
+	uint32_t value;
+	int i, j, err;
+
+	if (!mode_output)
+		return;
+
+	drmmode_output->props = calloc(mode_output->count_props, sizeof(drmmode_prop_rec));
+	if (!drmmode_output->props)
+		return;
+
+	drmmode_output->num_props = 0;
+	for (i = 0, j = 0; i < mode_output->count_props; i++) {
+		drmmode_prop = drmmode_get_property(drmmode, mode_output->props[i]);
+		if (drmmode_property_ignore(drmmode_prop))
+			continue;
+		drmmode_output->props[j].mode_prop = drmmode_prop;
+		drmmode_output->props[j].index = i;
+		drmmode_output->num_props++;
+		j++;
+	}
+
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		drmmode_prop_ptr p = &drmmode_output->props[i];
+		drmmode_prop = p->mode_prop;
+
+		value = drmmode_output->mode_output->prop_values[p->index];
+
+		if (drmmode_prop->flags & DRM_MODE_PROP_RANGE) {
+			INT32 range[2];
+
+			p->num_atoms = 1;
+			p->atoms = calloc(p->num_atoms, sizeof(Atom));
+			if (!p->atoms)
+				continue;
+			p->atoms[0] = MakeAtom(drmmode_prop->name, strlen(drmmode_prop->name), TRUE);
+			range[0] = drmmode_prop->values[0];
+			range[1] = drmmode_prop->values[1];
+			err = RRConfigureOutputProperty(output->randr_output, p->atoms[0],
+					FALSE, TRUE,
+					drmmode_prop->flags & DRM_MODE_PROP_IMMUTABLE ? TRUE : FALSE,
+							2, range);
+			if (err != 0) {
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRConfigureOutputProperty error, %d\n", err);
+			}
+			err = RRChangeOutputProperty(output->randr_output, p->atoms[0],
+					XA_INTEGER, 32, PropModeReplace, 1,
+					&value, FALSE, FALSE);
+			if (err != 0) {
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRChangeOutputProperty error, %d\n", err);
+			}
+		} else if (drmmode_prop->flags & DRM_MODE_PROP_ENUM) {
+			p->num_atoms = drmmode_prop->count_enums + 1;
+			p->atoms = calloc(p->num_atoms, sizeof(Atom));
+			if (!p->atoms)
+				continue;
+			p->atoms[0] = MakeAtom(drmmode_prop->name, strlen(drmmode_prop->name), TRUE);
+			for (j = 1; j <= drmmode_prop->count_enums; j++) {
+				struct drm_mode_property_enum *e = &drmmode_prop->enums[j-1];
+				p->atoms[j] = MakeAtom(e->name, strlen(e->name), TRUE);
+			}
+			err = RRConfigureOutputProperty(output->randr_output, p->atoms[0],
+					FALSE, FALSE,
+					drmmode_prop->flags & DRM_MODE_PROP_IMMUTABLE ? TRUE : FALSE,
+							p->num_atoms - 1, (INT32 *)&p->atoms[1]);
+			if (err != 0) {
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRConfigureOutputProperty error, %d\n", err);
+			}
+			for (j = 0; j < drmmode_prop->count_enums; j++)
+				if (drmmode_prop->enums[j].value == value)
+					break;
+			/* there's always a matching value */
+			err = RRChangeOutputProperty(output->randr_output, p->atoms[0],
+					XA_ATOM, 32, PropModeReplace, 1, &p->atoms[j+1], FALSE, FALSE);
+			if (err != 0) {
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRChangeOutputProperty error, %d\n", err);
+			}
+		}
+	}
+}
+
+static Bool
+drmmode_output_set_property(xf86OutputPtr output, Atom property,
+		RRPropertyValuePtr value)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	int i, ret;
+
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		drmmode_prop_ptr p = &drmmode_output->props[i];
+
+		if (p->atoms[0] != property)
+			continue;
+
+		if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
+			uint32_t val;
+
+			if (value->type != XA_INTEGER || value->format != 32 ||
+					value->size != 1)
+				return FALSE;
+			val = *(uint32_t *)value->data;
+
+			ret = drmModeConnectorSetProperty(drmmode->fd, drmmode_output->output_id,
+					p->mode_prop->prop_id, (uint64_t)val);
+
+			if (ret)
+				return FALSE;
+
+			/* the cached property values are stale now: */
+			drmmode_output->gen = 0;
+
+			return TRUE;
+
+		} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
+			Atom	atom;
+			const char	*name;
+			int		j;
+
+			if (value->type != XA_ATOM || value->format != 32 || value->size != 1)
+				return FALSE;
+			memcpy(&atom, value->data, 4);
+			name = NameForAtom(atom);
+
+			/* search for matching name string, then set its value down */
+			for (j = 0; j < p->mode_prop->count_enums; j++) {
+				if (!strcmp(p->mode_prop->enums[j].name, name)) {
+					ret = drmModeConnectorSetProperty(drmmode->fd,
+							drmmode_output->output_id,
+							p->mode_prop->prop_id,
+							p->mode_prop->enums[j].value);
+
+					if (ret)
+						return FALSE;
+
+					drmmode_output->gen = 0;
+
+					return TRUE;
+				}
+			}
+
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static Bool
+drmmode_output_get_property(xf86OutputPtr output, Atom property)
+{
+
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	uint32_t value;
+	int err, i;
+
+	/* property values don't need the connector to be re-probed: */
+	if (output->scrn->vtSema)
+		drmmode_output_connector(drmmode_output, FALSE);
+
+	if (!drmmode_output->mode_output)
+		return FALSE;
+
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		drmmode_prop_ptr p = &drmmode_output->props[i];
+		if (p->atoms[0] != property)
+			continue;
+
+		value = drmmode_output->mode_output->prop_values[p->index];
+
+		if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
+			err = RRChangeOutputProperty(output->randr_output,
+					property, XA_INTEGER, 32,
+					PropModeReplace, 1, &value,
+					FALSE, FALSE);
+
+			return !err;
+		} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
+			int		j;
+
+			/* search for matching name string, then set its value down */
+			for (j = 0; j < p->mode_prop->count_enums; j++) {
+				if (p->mode_prop->enums[j].value == value)
+					break;
+			}
+
+			err = RRChangeOutputProperty(output->randr_output, property,
+					XA_ATOM, 32, PropModeReplace, 1,
+					&p->atoms[j+1], FALSE, FALSE);
+
+			return !err;
+		}
+	}
+
+	return FALSE;
+}
+
+static const xf86OutputFuncsRec drmmode_output_funcs = {
+		.create_resources = drmmode_output_create_resources,
+		.dpms = drmmode_output_dpms,
+		.detect = drmmode_output_detect,
+		.mode_valid = drmmode_output_mode_valid,
+		.get_modes = drmmode_output_get_modes,
+		.set_property = drmmode_output_set_property,
+		.get_property = drmmode_output_get_property,
+		.destroy = drmmode_output_destroy
+};
+
+static int subpixel_conv_table[7] = {
+		0, SubPixelUnknown,
+		SubPixelHorizontalRGB,
+		SubPixelHorizontalBGR,
+		SubPixelVerticalRGB,
+		SubPixelVerticalBGR,
+		SubPixelNone };
+
+const char *output_names[] = {
+		"None",
+		"VGA",
+		"DVI-I",
+		"DVI-D",
+		"DVI-A",
+		"Composite",
+		"SVIDEO",
+		"LVDS",
+		"CTV",
+		"DIN",
+		"DP",
+		"HDMI",
+		"HDMI",
+		"TV",
+		"eDP",
+		"Virtual",
+		"DSI",
+};
+#define NUM_OUTPUT_NAMES (sizeof(output_names) / sizeof(output_names[0]))
+
+static void
+drmmode_output_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int num)
+{
+	xf86OutputPtr output;
+	drmModeConnectorPtr koutput;
+	drmModeEncoderPtr kencoder;
+	drmmode_output_private_ptr drmmode_output;
+	char name[32];
+
+	koutput = drmModeGetConnector(drmmode->fd,
+			drmmode->mode_res->connectors[num]);
+	if (!koutput)
+		return;
+
+	kencoder = drmModeGetEncoder(drmmode->fd, koutput->encoders[0]);
+	if (!kencoder) {
+		drmModeFreeConnector(koutput);
+		return;
+	}
+
+	if (koutput->connector_type >= NUM_OUTPUT_NAMES)
+		snprintf(name, 32, "Unknown%d-%d", koutput->connector_type,
+				koutput->connector_type_id);
+	else
+		snprintf(name, 32, "%s-%d",
+				output_names[koutput->connector_type],
+				koutput->connector_type_id);
+
+	output = xf86OutputCreate (pScrn, &drmmode_output_funcs, name);
+	if (!output) {
+		drmModeFreeEncoder(kencoder);
+		drmModeFreeConnector(koutput);
+		return;
+	}
+
+	drmmode_output = calloc(sizeof(drmmode_output_private_rec), 1);
+	if (!drmmode_output) {
+		xf86OutputDestroy(output);
+		drmModeFreeConnector(koutput);
+		drmModeFreeEncoder(kencoder);
+		return;
+	}
+
+	drmmode_output->output_id = drmmode->mode_res->connectors[num];
+	drmmode_output->mode_output = koutput;
+	drmmode_output->probed = TRUE;
+	drmmode_output->mode_encoder = kencoder;
+	drmmode_output->drmmode = drmmode;
+	output->mm_width = koutput->mmWidth;
+	output->mm_height = koutput->mmHeight;
+
+	output->subpixel_order = subpixel_conv_table[koutput->subpixel];
+	output->driver_private = drmmode_output;
+
+	output->possible_crtcs = kencoder->possible_crtcs;
+	output->possible_clones = kencoder->possible_clones;
+
+	output->interlaceAllowed = TRUE;
+	output->doubleScanAllowed = TRUE;
+}
+
+static Bool
+drmmode_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	ScreenPtr screen = xf86ScrnToScreen(pScrn);
+	MSMPtr pMsm = MSMPTR(pScrn);
+	drmmode_crtc_private_ptr drmmode_crtc = NULL;
+	drmmode_ptr drmmode = NULL;
+	uint32_t old_width, old_height, old_pitch;
+	drmmode_fb_ptr old_fb = NULL;
+	struct fd_bo *old_bo = NULL;
+	int ret, i, pitch, size;
+	PixmapPtr ppix;
+	void *ptr;
+
+	pitch = MSMAlignedStride(width, 32);
+	size = pitch * height;
+
+	if (xf86_config->num_crtc) {
+		drmmode_crtc = xf86_config->crtc[0]->driver_private;
+		drmmode = drmmode_crtc->drmmode;
+	}
+
+	DEBUG_MSG("resize called %d %d\n", width, height);
+
+	if ((pScrn->virtualX == width) &&
+			(pScrn->virtualY == height) &&
+			pMsm->scanout && drmmode->fb)
+		return TRUE;
+
+	old_width = pScrn->virtualX;
+	old_height = pScrn->virtualY;
+	old_pitch = pScrn->displayWidth;
+	if (drmmode)
+		old_fb = drmmode->fb;
+	old_bo = pMsm->scanout;
+
+	pMsm->scanout = msm_bo_new(pMsm, size,
+			DRM_FREEDRENO_GEM_TYPE_KMEM);
+
+	if (!pMsm->scanout)
+		goto fail;
+
+	pScrn->virtualX = width;
+	pScrn->virtualY = height;
+	pScrn->displayWidth = pitch / (pScrn->bitsPerPixel >> 3);
+
+	ptr = fd_bo_map(pMsm->scanout);
+
+	if (!old_fb) {
+		drmmode_fbcon_copy(screen);
+	} else {
+		drmmode_copy_scanout(screen, old_bo, old_width, old_height,
+				old_pitch * (pScrn->bitsPerPixel >> 3));
+	}
+
+	/* (with TearFree, this copies the new contents, so must come
+	 * after the copy above)
+	 */
+	if (drmmode) {
+		drmmode->fb = drmmode_scanout_fb_new(pScrn, drmmode);
+		if (!drmmode->fb)
+			goto fail;
+	}
+
+	/* NOTE do everything that could fail before this point,
+	 * otherwise you could end up w/ screen pixmap pointing
+	 * at the wrong scanout bo
+	 */
+	ppix = screen->GetScreenPixmap(screen);
+	if (ppix) {
+		screen->ModifyPixmapHeader(ppix, width, height, -1, -1, pitch, ptr);
+		msm_set_pixmap_bo(ppix, pMsm->scanout);
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 9
+		pScrn->pixmapPrivate.ptr = ppix->devPrivate.ptr;
+#endif
+	}
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+
+		if (!crtc->enabled)
+			continue;
+
+		drmmode_set_mode_major(crtc, &crtc->mode,
+				crtc->rotation, crtc->x, crtc->y);
+	}
+
+	if (old_fb)
+		drmmode_fb_release(pScrn, drmmode, old_fb);
+	if (old_bo)
+		fd_bo_del(old_bo);
+
+	return TRUE;
+
+ fail:
+	pMsm->scanout = old_bo;
+	pScrn->virtualX = old_width;
+	pScrn->virtualY = old_height;
+	pScrn->displayWidth = old_pitch;
+	if (drmmode)
+		drmmode->fb = old_fb;
+
+	return FALSE;
+}
+
+static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
+		drmmode_xf86crtc_resize
+};
+
+Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp)
+{
+	drmmode_ptr drmmode;
+	uint64_t value = 0;
+	int i;
+
+	drmmode = xnfcalloc(sizeof *drmmode, 1);
+	drmmode->fd = fd;
+	drmmode->fb = NULL;
+
+	if (!drmGetCap(fd, DRM_CAP_ASYNC_PAGE_FLIP, &value) && value)
+		drmmode->async_flip = TRUE;
+
+	drmmode->cursor_width = 64;
+	drmmode->cursor_height = 64;
+#ifdef DRM_CAP_CURSOR_WIDTH
+	if (!drmGetCap(fd, DRM_CAP_CURSOR_WIDTH, &value) && value)
+		drmmode->cursor_width = value;
+	if (!drmGetCap(fd, DRM_CAP_CURSOR_HEIGHT, &value) && value)
+		drmmode->cursor_height = value;
+#endif
+	drmmode->set_cursor2 = TRUE;
+
+#ifdef HAVE_DRM_ATOMIC
+	if (xf86ReturnOptValBool(MSMPTR(pScrn)->options, OPTION_ATOMIC, FALSE)) {
+		if (!drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1))
+			drmmode->atomic = TRUE;
+		else
+			WARNING_MSG("Atomic modeset not supported by kernel");
+	}
+#endif
+
+	xf86CrtcConfigInit(pScrn, &drmmode_xf86crtc_config_funcs);
+
+	drmmode->cpp = cpp;
+	drmmode->mode_res = drmModeGetResources(drmmode->fd);
+	if (!drmmode->mode_res)
+		return FALSE;
+
+	xf86CrtcSetSizeRange(pScrn, 320, 200, drmmode->mode_res->max_width,
+			drmmode->mode_res->max_height);
+
+	if (!xf86SetDepthBpp(pScrn, 0, 0, 0,
+			Support24bppFb | Support32bppFb |
+			SupportConvert32to24 | SupportConvert24to32)) {
+		ERROR_MSG("Unable to set bitdepth");
+		free(drmmode);
+		return FALSE;
+	}
+
+	if (!drmmode->mode_res->count_connectors ||
+			!drmmode->mode_res->count_crtcs) {
+		drmModeFreeResources(drmmode->mode_res);
+		free(drmmode);
+		goto done;
+	}
+
+	for (i = 0; i < drmmode->mode_res->count_crtcs; i++) {
+		if (!xf86IsEntityShared(pScrn->entityList[0]) ||
+				(pScrn->confScreen->device->screen == i))
+			drmmode_crtc_init(pScrn, drmmode, i);
+	}
+
+	MSMStartupPhase(pScrn, "kms resources");
+
+	for (i = 0; i < drmmode->mode_res->count_connectors; i++)
+		drmmode_output_init(pScrn, drmmode, i);
+
+	MSMStartupPhase(pScrn, "connector probe");
+
+#ifdef HAVE_DRM_ATOMIC
+	if (drmmode->atomic)
+		drmmode_atomic_init(pScrn, drmmode);
+#endif
+
+#ifdef HAVE_DRM_ATOMIC
+	/* async flips via an atomic commit are a separate capability
+	 * from legacy async page flips:
+	 */
+	if (drmmode->atomic) {
+		drmmode->async_flip = FALSE;
+#ifdef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+		if (!drmGetCap(fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &value) && value)
+			drmmode->async_flip = TRUE;
+#endif
+	}
+#endif
+
+	drmmode_planes_init(pScrn, drmmode);
+
+	MSMStartupPhase(pScrn, "planes");
+
+done:
+
+	xf86InitialConfiguration(pScrn, TRUE);
+
+	MSMStartupPhase(pScrn, "initial config");
+
+	return TRUE;
+}
+
+void
+drmmode_adjust_frame(ScrnInfoPtr scrn, int x, int y)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+	xf86OutputPtr output = config->output[config->compat_output];
+	xf86CrtcPtr crtc = output->crtc;
+
+	if (!crtc || !crtc->enabled)
+		return;
+
+	drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, x, y);
+}
+
+void
+drmmode_remove_fb(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	xf86CrtcPtr crtc = NULL;
+	drmmode_crtc_private_ptr drmmode_crtc;
+	drmmode_ptr drmmode;
+
+	if (config && config->num_crtc)
+		crtc = config->crtc[0];
+	if (!crtc)
+		return;
+
+	drmmode_crtc = crtc->driver_private;
+	drmmode = drmmode_crtc->drmmode;
+
+	if (drmmode->fb)
+		drmmode_fb_release(pScrn, drmmode, drmmode->fb);
+	drmmode->fb = NULL;
+}
+
+int
+drmmode_cursor_init(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	int flags = HARDWARE_CURSOR_TRUECOLOR_AT_8BPP |
+			HARDWARE_CURSOR_SOURCE_MASK_INTERLEAVE_32 |
+			HARDWARE_CURSOR_ARGB;
+
+	return xf86_cursors_init(pScreen, drmmode->cursor_width,
+			drmmode->cursor_height, flags);
+}
+
+static uint32_t
+drmmode_crtc_vblank_pipe(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	if (drmmode_crtc->index > 1)
+		return (drmmode_crtc->index << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+				DRM_VBLANK_HIGH_CRTC_MASK;
+	else if (drmmode_crtc->index > 0)
+		return DRM_VBLANK_SECONDARY;
+	return 0;
+}
+
+/* The kernel only gives us a 32bit vblank sequence #, extend it to the
+ * 64bit msc that Present (and eventually DRI2) deal in:
+ */
+static uint64_t
+drmmode_crtc_msc64(xf86CrtcPtr crtc, uint32_t sequence)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	int32_t delta = (int32_t)(sequence - drmmode_crtc->msc_prev);
+
+	/* events can be for an older frame than one already seen (ie. a flip
+	 * event for N arriving after get_ust_msc returned N+1), so only a
+	 * step forward can carry into the high bits:
+	 */
+	if ((delta < 0) && (drmmode_crtc->msc_high || drmmode_crtc->msc_prev))
+		return drmmode_crtc->msc_high + drmmode_crtc->msc_prev + delta;
+
+	if (sequence < drmmode_crtc->msc_prev)
+		drmmode_crtc->msc_high += 0x100000000ULL;
+	drmmode_crtc->msc_prev = sequence;
+
+	return drmmode_crtc->msc_high + sequence;
+}
+
+static int
+drmmode_crtc_coverage(xf86CrtcPtr crtc, BoxPtr box)
+{
+	int x1, y1, x2, y2;
+
+	if (!crtc->enabled)
+		return 0;
+
+	x1 = max(box->x1, crtc->x);
+	y1 = max(box->y1, crtc->y);
+	x2 = min(box->x2, crtc->x + crtc->mode.HDisplay);
+	y2 = min(box->y2, crtc->y + crtc->mode.VDisplay);
+
+	if ((x1 >= x2) || (y1 >= y2))
+		return 0;
+
+	return (x2 - x1) * (y2 - y1);
+}
+
+/**
+ * Find the crtc which covers the largest part of the specified box
+ * (in screen coordinates), or NULL if the box is not visible on any
+ * crtc.
+ */
+xf86CrtcPtr
+drmmode_covering_crtc(ScrnInfoPtr pScrn, BoxPtr box)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	xf86CrtcPtr best = NULL;
+	int i, coverage, best_coverage = 0;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+
+		coverage = drmmode_crtc_coverage(crtc, box);
+		if (coverage > best_coverage) {
+			best_coverage = coverage;
+			best = crtc;
+		}
+	}
+
+	return best;
+}
+
+Bool
+drmmode_crtc_get_ust_msc(xf86CrtcPtr crtc, uint64_t *ust, uint64_t *msc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmVBlank vbl = { .request = {
+		.type = DRM_VBLANK_RELATIVE | drmmode_crtc_vblank_pipe(crtc),
+		.sequence = 0,
+	} };
+
+	if (drmWaitVBlank(drmmode->fd, &vbl))
+		return FALSE;
+
+	*ust = ((uint64_t)vbl.reply.tval_sec * 1000000) + vbl.reply.tval_usec;
+	*msc = drmmode_crtc_msc64(crtc, vbl.reply.sequence);
+
+	return TRUE;
+}
+
+static Bool
+drmmode_queue_vblank_event(xf86CrtcPtr crtc, uint64_t msc,
+		drmmode_event_handler handler, void *event_data, Bool swap)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmmode_vblank_event_ptr event;
+	drmVBlank vbl;
+
+	event = calloc(1, sizeof(*event));
+	if (!event)
+		return FALSE;
+
+	event->crtc = crtc;
+	event->handler = handler;
+	event->event_data = event_data;
+	event->swap = swap;
+
+	vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT |
+			drmmode_crtc_vblank_pipe(crtc);
+	vbl.request.sequence = (uint32_t)msc;
+	vbl.request.signal = (unsigned long)event;
+
+	if (drmWaitVBlank(drmmode->fd, &vbl)) {
+		xf86DrvMsg(crtc->scrn->scrnIndex, X_WARNING,
+				"queue vblank failed: %s\n", strerror(errno));
+		free(event);
+		return FALSE;
+	}
+
+	if (swap)
+		MSMPTR(crtc->scrn)->pending_page_flips++;
+
+	return TRUE;
+}
+
+/**
+ * Request a callback when the specified crtc reaches the (absolute)
+ * msc.  The handler is called from the DRM event handler with the
+ * actual msc/ust of the vblank.
+ */
+Bool
+drmmode_queue_vblank(xf86CrtcPtr crtc, uint64_t msc,
+		drmmode_event_handler handler, void *event_data)
+{
+	return drmmode_queue_vblank_event(crtc, msc, handler, event_data, FALSE);
+}
+
+/**
+ * Pick an overlay plane to use for the crtc with the specified index.
+ * A plane which is already assigned to the crtc is preferred, so that
+ * successive updates don't move between planes, otherwise the first
+ * free plane which can be used with the crtc and format.  Returns the
+ * index into the planes table, or -1 if no plane is usable.
+ *
+ * NOTE: this only looks at the plane table, and doesn't call into X
+ * or the kernel, so the selection logic can be exercised on its own.
+ */
+static int
+drmmode_plane_select(const drmmode_plane_rec *planes, int num_planes,
+		int crtc_index)
+{
+	int i, free_plane = -1;
+
+	for (i = 0; i < num_planes; i++) {
+		const drmmode_plane_rec *plane = &planes[i];
 
-			return FALSE;
-		}
+		if (plane->crtc_index == crtc_index)
+			return i;
+
+		if ((free_plane < 0) && (plane->crtc_index < 0) &&
+				plane->format_ok &&
+				(plane->possible_crtcs & (1 << crtc_index)))
+			free_plane = i;
 	}
 
-	return TRUE;
+	return free_plane;
 }
 
-static Bool
-drmmode_output_get_property(xf86OutputPtr output, Atom property)
+static void
+drmmode_planes_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 {
+	drmModePlaneResPtr plane_res;
+	unsigned i, j;
 
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	uint32_t value;
-	int err, i;
+	/* only overlay planes are interesting here, but with atomic
+	 * enabled we also get the primary and cursor planes:
+	 */
+	plane_res = drmModeGetPlaneResources(drmmode->fd);
+	if (!plane_res)
+		return;
 
-	if (output->scrn->vtSema) {
-		drmModeFreeConnector(drmmode_output->mode_output);
-		drmmode_output->mode_output =
-				drmModeGetConnector(drmmode->fd, drmmode_output->output_id);
+	drmmode->planes = calloc(plane_res->count_planes, sizeof(*drmmode->planes));
+	if (!drmmode->planes) {
+		drmModeFreePlaneResources(plane_res);
+		return;
 	}
 
-	if (!drmmode_output->mode_output)
-		return FALSE;
+	for (i = 0; i < plane_res->count_planes; i++) {
+		drmModePlanePtr kplane = drmModeGetPlane(drmmode->fd,
+				plane_res->planes[i]);
+		drmmode_plane_ptr plane;
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		drmmode_prop_ptr p = &drmmode_output->props[i];
-		if (p->atoms[0] != property)
+		if (!kplane)
 			continue;
 
-		value = drmmode_output->mode_output->prop_values[p->index];
-
-		if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
-			err = RRChangeOutputProperty(output->randr_output,
-					property, XA_INTEGER, 32,
-					PropModeReplace, 1, &value,
-					FALSE, FALSE);
-
-			return !err;
-		} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
-			int		j;
+		if (drmmode_plane_type(drmmode->fd, kplane->plane_id) !=
+				DRM_PLANE_TYPE_OVERLAY) {
+			drmModeFreePlane(kplane);
+			continue;
+		}
 
-			/* search for matching name string, then set its value down */
-			for (j = 0; j < p->mode_prop->count_enums; j++) {
-				if (p->mode_prop->enums[j].value == value)
-					break;
-			}
+		plane = &drmmode->planes[drmmode->num_planes++];
+		plane->plane_id = kplane->plane_id;
+		plane->possible_crtcs = kplane->possible_crtcs;
+		plane->crtc_index = -1;
 
-			err = RRChangeOutputProperty(output->randr_output, property,
-					XA_ATOM, 32, PropModeReplace, 1,
-					&p->atoms[j+1], FALSE, FALSE);
+		for (j = 0; j < kplane->count_formats; j++)
+			if (kplane->formats[j] == DRM_FORMAT_XRGB8888)
+				plane->format_ok = TRUE;
 
-			return !err;
-		}
+		drmModeFreePlane(kplane);
 	}
 
-	return FALSE;
+	drmModeFreePlaneResources(plane_res);
+
+	INFO_MSG("%d overlay planes", drmmode->num_planes);
 }
 
-static const xf86OutputFuncsRec drmmode_output_funcs = {
-		.create_resources = drmmode_output_create_resources,
-		.dpms = drmmode_output_dpms,
-		.detect = drmmode_output_detect,
-		.mode_valid = drmmode_output_mode_valid,
-		.get_modes = drmmode_output_get_modes,
-		.set_property = drmmode_output_set_property,
-		.get_property = drmmode_output_get_property,
-		.destroy = drmmode_output_destroy
-};
+/**
+ * Check if there is an overlay plane available for the crtc, which
+ * can be used with drmmode_plane_show().
+ */
+Bool
+drmmode_plane_available(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
 
-static int subpixel_conv_table[7] = {
-		0, SubPixelUnknown,
-		SubPixelHorizontalRGB,
-		SubPixelHorizontalBGR,
-		SubPixelVerticalRGB,
-		SubPixelVerticalBGR,
-		SubPixelNone };
+	if (!crtc->enabled || drmmode_crtc->rotate_fb_id)
+		return FALSE;
 
-const char *output_names[] = {
-		"None",
-		"VGA",
-		"DVI-I",
-		"DVI-D",
-		"DVI-A",
-		"Composite",
-		"SVIDEO",
-		"LVDS",
-		"CTV",
-		"DIN",
-		"DP",
-		"HDMI",
-		"HDMI",
-		"TV",
-		"eDP",
-		"Virtual",
-		"DSI",
-};
-#define NUM_OUTPUT_NAMES (sizeof(output_names) / sizeof(output_names[0]))
+	return drmmode_plane_select(drmmode->planes, drmmode->num_planes,
+			drmmode_crtc->index) >= 0;
+}
 
-static void
-drmmode_output_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int num)
+/**
+ * Show a pixmap fullscreen on the crtc, using an overlay plane (and
+ * the hw scaler, if the pixmap size doesn't match the mode).  The
+ * handler is called on the vblank after the update, similar to a
+ * page flip.
+ */
+Bool
+drmmode_plane_show(xf86CrtcPtr crtc, PixmapPtr pix,
+		drmmode_event_handler handler, void *data)
 {
-	xf86OutputPtr output;
-	drmModeConnectorPtr koutput;
-	drmModeEncoderPtr kencoder;
-	drmmode_output_private_ptr drmmode_output;
-	char name[32];
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	struct fd_bo *bo = msm_get_pixmap_bo(pix);
+	drmmode_plane_ptr plane;
+	uint32_t fb_id;
+	uint64_t ust, msc;
+	int idx, ret;
 
-	koutput = drmModeGetConnector(drmmode->fd,
-			drmmode->mode_res->connectors[num]);
-	if (!koutput)
-		return;
+	if (!bo || (pix->drawable.bitsPerPixel != 32))
+		return FALSE;
 
-	kencoder = drmModeGetEncoder(drmmode->fd, koutput->encoders[0]);
-	if (!kencoder) {
-		drmModeFreeConnector(koutput);
-		return;
-	}
+	idx = drmmode_plane_select(drmmode->planes, drmmode->num_planes,
+			drmmode_crtc->index);
+	if (idx < 0)
+		return FALSE;
 
-	if (koutput->connector_type >= NUM_OUTPUT_NAMES)
-		snprintf(name, 32, "Unknown%d-%d", koutput->connector_type,
-				koutput->connector_type_id);
-	else
-		snprintf(name, 32, "%s-%d",
-				output_names[koutput->connector_type],
-				koutput->connector_type_id);
+	plane = &drmmode->planes[idx];
 
-	output = xf86OutputCreate (pScrn, &drmmode_output_funcs, name);
-	if (!output) {
-		drmModeFreeEncoder(kencoder);
-		drmModeFreeConnector(koutput);
-		return;
+	ret = drmModeAddFB(drmmode->fd, pix->drawable.width,
+			pix->drawable.height, 24, 32, exaGetPixmapPitch(pix),
+			fd_bo_handle(bo), &fb_id);
+	if (ret) {
+		WARNING_MSG("add plane fb failed: %s", strerror(errno));
+		return FALSE;
 	}
 
-	drmmode_output = calloc(sizeof(drmmode_output_private_rec), 1);
-	if (!drmmode_output) {
-		xf86OutputDestroy(output);
-		drmModeFreeConnector(koutput);
-		drmModeFreeEncoder(kencoder);
-		return;
+	ret = drmModeSetPlane(drmmode->fd, plane->plane_id,
+			drmmode_crtc->mode_crtc->crtc_id, fb_id, 0,
+			0, 0, crtc->mode.HDisplay, crtc->mode.VDisplay,
+			0, 0, pix->drawable.width << 16, pix->drawable.height << 16);
+	if (ret) {
+		WARNING_MSG("set plane failed: %s", strerror(errno));
+		drmModeRmFB(drmmode->fd, fb_id);
+		return FALSE;
 	}
 
-	drmmode_output->output_id = drmmode->mode_res->connectors[num];
-	drmmode_output->mode_output = koutput;
-	drmmode_output->mode_encoder = kencoder;
-	drmmode_output->drmmode = drmmode;
-	output->mm_width = koutput->mmWidth;
-	output->mm_height = koutput->mmHeight;
-
-	output->subpixel_order = subpixel_conv_table[koutput->subpixel];
-	output->driver_private = drmmode_output;
-
-	output->possible_crtcs = kencoder->possible_crtcs;
-	output->possible_clones = kencoder->possible_clones;
+	/* the previous fb is no longer referenced by the plane, so the
+	 * kernel takes care of keeping it around until the update lands:
+	 */
+	if (plane->fb_id)
+		drmModeRmFB(drmmode->fd, plane->fb_id);
+
+	plane->fb_id = fb_id;
+	plane->crtc_index = drmmode_crtc->index;
+
+	/* counted like a flip, so that MSMDRI2CloseScreen() waits for it: */
+	if (!drmmode_crtc_get_ust_msc(crtc, &ust, &msc) ||
+			!drmmode_queue_vblank_event(crtc, msc + 1, handler, data,
+					TRUE)) {
+		/* no vblank event, so just complete it now: */
+		handler(0, 0, data);
+	}
 
-	output->interlaceAllowed = TRUE;
-	output->doubleScanAllowed = TRUE;
+	return TRUE;
 }
 
-static Bool
-drmmode_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
+/**
+ * Stop using the overlay plane (if any) assigned to the crtc.
+ */
+void
+drmmode_plane_hide(xf86CrtcPtr crtc)
 {
-	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
-	ScreenPtr screen = xf86ScrnToScreen(pScrn);
-	MSMPtr pMsm = MSMPTR(pScrn);
-	drmmode_crtc_private_ptr drmmode_crtc = NULL;
-	drmmode_ptr drmmode = NULL;
-	uint32_t old_width, old_height, old_pitch, old_fb_id = 0;
-	struct fd_bo *old_bo = NULL;
-	int ret, i, pitch, size;
-	PixmapPtr ppix;
-	void *ptr;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmmode_plane_ptr plane;
+	int idx;
 
-	pitch = MSMAlignedStride(width, 32);
-	size = pitch * height;
+	idx = drmmode_plane_select(drmmode->planes, drmmode->num_planes,
+			drmmode_crtc->index);
+	if (idx < 0)
+		return;
 
-	if (xf86_config->num_crtc) {
-		drmmode_crtc = xf86_config->crtc[0]->driver_private;
-		drmmode = drmmode_crtc->drmmode;
-	}
+	plane = &drmmode->planes[idx];
+	if (plane->crtc_index != drmmode_crtc->index)
+		return;
 
-	DEBUG_MSG("resize called %d %d\n", width, height);
+	drmModeSetPlane(drmmode->fd, plane->plane_id, 0, 0, 0,
+			0, 0, 0, 0, 0, 0, 0, 0);
+	drmModeRmFB(drmmode->fd, plane->fb_id);
 
-	if ((pScrn->virtualX == width) &&
-			(pScrn->virtualY == height) &&
-			pMsm->scanout && drmmode->fb_id)
-		return TRUE;
+	plane->fb_id = 0;
+	plane->crtc_index = -1;
+}
 
-	old_width = pScrn->virtualX;
-	old_height = pScrn->virtualY;
-	old_pitch = pScrn->displayWidth;
-	if (drmmode)
-		old_fb_id = drmmode->fb_id;
-	old_bo = pMsm->scanout;
+Bool
+drmmode_can_async_flip(ScrnInfoPtr pScrn)
+{
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	return drmmode && drmmode->async_flip;
+}
 
-	pMsm->scanout = fd_bo_new(pMsm->dev, size,
-			DRM_FREEDRENO_GEM_TYPE_KMEM);
+/**
+ * Check that the scanout can currently be flipped, ie. there is at
+ * least one enabled crtc and none of them are using a rotation shadow.
+ * With TearFree, the scanout buffers belong to us, so clients can't
+ * flip.
+ */
+Bool
+drmmode_can_flip(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	int i, enabled = 0;
 
-	if (!pMsm->scanout)
-		goto fail;
+	if (!pScrn->vtSema || drmmode->tearfree.enabled)
+		return FALSE;
 
-	pScrn->virtualX = width;
-	pScrn->virtualY = height;
-	pScrn->displayWidth = pitch / (pScrn->bitsPerPixel >> 3);
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-	ptr = fd_bo_map(pMsm->scanout);
+		if (!crtc->enabled)
+			continue;
 
-	if (drmmode) {
-		ret = drmModeAddFB(drmmode->fd, width, height, pScrn->depth,
-				pScrn->bitsPerPixel, pitch, fd_bo_handle(pMsm->scanout),
-				&drmmode->fb_id);
-		if (ret)
-			goto fail;
+		if (drmmode_crtc->rotate_fb_id)
+			return FALSE;
+
+		enabled++;
 	}
 
-	if (!old_fb_id) {
-		drmmode_fbcon_copy(screen);
-	} else {
-		memset(ptr, 0x00, fd_bo_size(pMsm->scanout));
+	return enabled > 0;
+}
+
+static void
+drmmode_flip_event(drmmode_flipdata_ptr flipdata, Bool dispatch,
+		uint64_t msc, uint64_t ust)
+{
+	if (dispatch) {
+		flipdata->msc = msc;
+		flipdata->ust = ust;
 	}
 
-	/* NOTE do everything that could fail before this point,
-	 * otherwise you could end up w/ screen pixmap pointing
-	 * at the wrong scanout bo
+	/* The caller is only told once the last crtc has flipped (or
+	 * given up on the flip), since until then the previous fb may
+	 * still be scanned out:
 	 */
-	ppix = screen->GetScreenPixmap(screen);
-	if (ppix) {
-		screen->ModifyPixmapHeader(ppix, width, height, -1, -1, pitch, ptr);
-		msm_set_pixmap_bo(ppix, pMsm->scanout);
-#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 9
-		pScrn->pixmapPrivate.ptr = ppix->devPrivate.ptr;
-#endif
-	}
+	flipdata->flip_count--;
+	if (flipdata->flip_count > 0)
+		return;
 
-	for (i = 0; i < xf86_config->num_crtc; i++) {
-		xf86CrtcPtr crtc = xf86_config->crtc[i];
+	MSMPTR(flipdata->pScrn)->pending_page_flips--;
 
-		if (!crtc->enabled)
-			continue;
+	if (flipdata->handler)
+		flipdata->handler(flipdata->msc, flipdata->ust,
+				flipdata->event_data);
 
-		drmmode_set_mode_major(crtc, &crtc->mode,
-				crtc->rotation, crtc->x, crtc->y);
-	}
+	free(flipdata);
+}
 
-	if (old_fb_id)
-		drmModeRmFB(drmmode->fd, old_fb_id);
-	if (old_bo)
-		fd_bo_del(old_bo);
+/**
+ * A crtc failed to flip after others already did, so the flip can no
+ * longer be failed as a whole: switch it to the fb with a modeset
+ * instead (which may tear once), so it doesn't keep scanning out the
+ * previous fb, which goes back to the client.
+ */
+static Bool
+drmmode_crtc_set_fb(xf86CrtcPtr crtc, drmmode_fb_ptr fb)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmModeModeInfo kmode;
+	uint32_t *output_ids;
+	int output_count, ret;
 
-	return TRUE;
+	output_ids = drmmode_crtc_output_ids(crtc, &output_count);
+	if (!output_ids)
+		return FALSE;
+
+	drmmode_ConvertToKMode(pScrn, &kmode, &crtc->mode);
+	ret = drmModeSetCrtc(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
+			fb->fb_id, crtc->x, crtc->y, output_ids, output_count,
+			&kmode);
+	free(output_ids);
+
+	if (ret) {
+		ERROR_MSG("flip fallback modeset failed: %s", strerror(-ret));
+		return FALSE;
+	}
 
- fail:
-	pMsm->scanout = old_bo;
-	pScrn->virtualX = old_width;
-	pScrn->virtualY = old_height;
-	pScrn->displayWidth = old_pitch;
-	if (drmmode)
-		drmmode->fb_id = old_fb_id;
+	drmmode_fb_unref(drmmode, drmmode_crtc->scanout_fb);
+	drmmode_crtc->scanout_fb = drmmode_fb_ref(fb);
 
-	return FALSE;
+	return TRUE;
 }
 
-static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
-		drmmode_xf86crtc_resize
-};
-
-Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp)
+/**
+ * Flip the crtcs to the fb.  With atomic this is a single commit,
+ * otherwise the crtcs are flipped one at a time.  Returns the number of
+ * flip events to expect, which is zero if the first crtc failed to
+ * flip.  Later crtcs which fail to flip are switched to the fb with a
+ * modeset, and have no event.
+ */
+static int
+drmmode_flip_commit(xf86CrtcPtr *crtcs, int num, drmmode_fb_ptr fb,
+		uint32_t flags, drmmode_flipdata_ptr flipdata,
+		xf86CrtcPtr ref_crtc)
 {
-	drmmode_ptr drmmode;
-	int i;
-
-	drmmode = xnfalloc(sizeof *drmmode);
-	drmmode->fd = fd;
-	drmmode->fb_id = 0;
+	ScrnInfoPtr pScrn = crtcs[0]->scrn;
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	drmmode_flipevtcarrier_ptr flipcarrier;
+	drmmode_crtc_private_ptr drmmode_crtc;
+	int i, flipped = 0, ret;
 
-	xf86CrtcConfigInit(pScrn, &drmmode_xf86crtc_config_funcs);
+#ifdef HAVE_DRM_ATOMIC
+	if (drmmode->atomic) {
+		/* one commit, and one carrier, for all of the crtcs: */
+		flipcarrier = calloc(1, sizeof(drmmode_flipevtcarrier_rec));
+		if (!flipcarrier) {
+			WARNING_MSG("flip queue: carrier alloc failed.");
+			return 0;
+		}
 
-	drmmode->cpp = cpp;
-	drmmode->mode_res = drmModeGetResources(drmmode->fd);
-	if (!drmmode->mode_res)
-		return FALSE;
+		flipcarrier->flipdata = flipdata;
+		flipcarrier->ref_crtc = ref_crtc;
+		flipcarrier->count = num;
 
-	xf86CrtcSetSizeRange(pScrn, 320, 200, drmmode->mode_res->max_width,
-			drmmode->mode_res->max_height);
+		ret = drmmode_atomic_page_flip(crtcs, num, fb->fb_id,
+				flags, flipcarrier);
+		if (ret) {
+			WARNING_MSG("flip queue failed: %s", strerror(-ret));
+			free(flipcarrier);
+			return 0;
+		}
 
-	if (!xf86SetDepthBpp(pScrn, 0, 0, 0,
-			Support24bppFb | Support32bppFb |
-			SupportConvert32to24 | SupportConvert24to32)) {
-		ERROR_MSG("Unable to set bitdepth");
-		free(drmmode);
-		return FALSE;
-	}
+		for (i = 0; i < num; i++) {
+			drmmode_crtc = crtcs[i]->driver_private;
+			drmmode_crtc->flip_fb = drmmode_fb_ref(fb);
+		}
 
-	if (!drmmode->mode_res->count_connectors ||
-			!drmmode->mode_res->count_crtcs) {
-		drmModeFreeResources(drmmode->mode_res);
-		free(drmmode);
-		goto done;
+		return num;
 	}
+#endif
 
-	for (i = 0; i < drmmode->mode_res->count_crtcs; i++) {
-		if (!xf86IsEntityShared(pScrn->entityList[0]) ||
-				(pScrn->confScreen->device->screen == i))
-			drmmode_crtc_init(pScrn, drmmode, i);
-	}
+	for (i = 0; i < num; i++) {
+		drmmode_crtc = crtcs[i]->driver_private;
 
-	for (i = 0; i < drmmode->mode_res->count_connectors; i++)
-		drmmode_output_init(pScrn, drmmode, i);
+		flipcarrier = calloc(1, sizeof(drmmode_flipevtcarrier_rec));
+		if (flipcarrier) {
+			flipcarrier->flipdata = flipdata;
+			flipcarrier->crtc = crtcs[i];
+			flipcarrier->ref_crtc = ref_crtc;
+			flipcarrier->count = 1;
+
+			ret = drmModePageFlip(drmmode->fd,
+					drmmode_crtc->mode_crtc->crtc_id,
+					fb->fb_id, flags, flipcarrier);
+		} else {
+			ret = -ENOMEM;
+		}
 
-done:
+		if (ret) {
+			WARNING_MSG("flip queue failed: %s", strerror(-ret));
+			free(flipcarrier);
+			if (i == 0)
+				break;
+			drmmode_crtc_set_fb(crtcs[i], fb);
+			continue;
+		}
 
-	xf86InitialConfiguration(pScrn, TRUE);
+		drmmode_crtc->flip_fb = drmmode_fb_ref(fb);
+		flipped++;
+	}
 
-	return TRUE;
+	return flipped;
 }
 
-void
-drmmode_adjust_frame(ScrnInfoPtr scrn, int x, int y)
+/**
+ * Flip all enabled (unrotated) crtcs to the fb, together.  The handler
+ * is called, with the msc/ust of the reference crtc, once every crtc
+ * has moved off the previous fb.  Fails if a crtc still has a flip in
+ * flight (only possible after a modeset, since callers wait for the
+ * handler before flipping again), so the caller falls back to a copy.
+ *
+ * All the crtcs scan out slices of the same screen sized fb, so a
+ * client is paced by the slowest head it is flipped on.  Presenting on
+ * each head at its own rate would take driver owned per-crtc scanouts,
+ * and a copy into them per head and frame.
+ */
+static Bool
+drmmode_flip_crtcs(ScrnInfoPtr pScrn, xf86CrtcPtr ref_crtc,
+		drmmode_fb_ptr fb, uint32_t flags,
+		drmmode_event_handler handler, void *priv)
 {
-	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
-	xf86OutputPtr output = config->output[config->compat_output];
-	xf86CrtcPtr crtc = output->crtc;
+	MSMPtr pMsm = MSMPTR(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_flipdata_ptr flipdata;
+	xf86CrtcPtr *crtcs;
+	int i, num = 0;
 
-	if (!crtc || !crtc->enabled)
-		return;
+	flipdata = calloc(1, sizeof(drmmode_flipdata_rec));
+	crtcs = calloc(config->num_crtc, sizeof(*crtcs));
+	if (!flipdata || !crtcs) {
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+				"flip queue: data alloc failed.\n");
+		free(flipdata);
+		free(crtcs);
+		return FALSE;
+	}
 
-	drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, x, y);
-}
+	flipdata->handler = handler;
+	flipdata->event_data = priv;
+	flipdata->pScrn = pScrn;
 
-void
-drmmode_remove_fb(ScrnInfoPtr pScrn)
-{
-	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
-	xf86CrtcPtr crtc = NULL;
-	drmmode_crtc_private_ptr drmmode_crtc;
-	drmmode_ptr drmmode;
+	/* the reference crtc goes first, so if it fails to flip there is
+	 * nothing to undo:
+	 */
+	for (i = -1; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = (i < 0) ? ref_crtc : config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-	if (config && config->num_crtc)
-		crtc = config->crtc[0];
-	if (!crtc)
-		return;
+		if ((i >= 0) && ((crtc == ref_crtc) || !crtc->enabled ||
+				drmmode_crtc->rotate_fb_id))
+			continue;
 
-	drmmode_crtc = crtc->driver_private;
-	drmmode = drmmode_crtc->drmmode;
+		if (drmmode_crtc->flip_fb) {
+			free(crtcs);
+			free(flipdata);
+			return FALSE;
+		}
 
-	if (drmmode->fb_id)
-		drmModeRmFB(drmmode->fd, drmmode->fb_id);
-	drmmode->fb_id = 0;
-}
+		crtcs[num++] = crtc;
+	}
 
-int
-drmmode_cursor_init(ScreenPtr pScreen)
-{
-	int flags = HARDWARE_CURSOR_TRUECOLOR_AT_8BPP |
-			HARDWARE_CURSOR_SOURCE_MASK_INTERLEAVE_32 |
-			HARDWARE_CURSOR_ARGB;
+	flipdata->flip_count = drmmode_flip_commit(crtcs, num, fb, flags,
+			flipdata, ref_crtc);
+
+	free(crtcs);
+
+	if (!flipdata->flip_count) {
+		free(flipdata);
+		return FALSE;
+	}
 
-	return xf86_cursors_init(pScreen, 64, 64, flags);
+	pMsm->pending_page_flips++;
+
+	return TRUE;
 }
 
+/**
+ * Flip the scanout to the back pixmap.  The crtc which the drawable is
+ * (mostly) on is the one which paces the caller.
+ */
 Bool
-drmmode_page_flip(DrawablePtr draw, PixmapPtr back, void *priv)
+drmmode_page_flip(DrawablePtr draw, PixmapPtr back, Bool async,
+		drmmode_event_handler handler, void *priv)
 {
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(draw->pScreen);
 	MSMPtr pMsm = MSMPTR(pScrn);
 	struct fd_bo *back_bo = msm_get_pixmap_bo(back);
-	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
-	drmmode_crtc_private_ptr crtc = config->crtc[0]->driver_private;
-	drmmode_ptr mode = crtc->drmmode;
-	drmmode_flipdata_ptr flipdata;
-	drmmode_flipevtcarrier_ptr flipcarrier;
-	unsigned int ref_crtc_hw_id = 0;
-	int ret, i, old_fb_id, emitted = 0;
+	drmmode_ptr mode = drmmode_from_scrn(pScrn);
+	drmmode_fb_ptr fb;
+	xf86CrtcPtr ref_crtc;
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT;
+	BoxRec box;
+
+	if (mode->tearfree.enabled)
+		return FALSE;
+
+	if (async && mode->async_flip)
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+
+	box.x1 = draw->x;
+	box.y1 = draw->y;
+	box.x2 = box.x1 + draw->width;
+	box.y2 = box.y1 + draw->height;
 
-	old_fb_id = mode->fb_id;
-	ret = drmModeAddFB(mode->fd, pScrn->virtualX, pScrn->virtualY,
+	ref_crtc = drmmode_covering_crtc(pScrn, &box);
+	if (!ref_crtc)
+		return FALSE;
+
+	fb = drmmode_fb_new(mode, pScrn->virtualX, pScrn->virtualY,
 			pScrn->depth, pScrn->bitsPerPixel,
-			pScrn->displayWidth * pScrn->bitsPerPixel / 8,
-			fd_bo_handle(back_bo), &mode->fb_id);
-	if (ret) {
+			pScrn->displayWidth * pScrn->bitsPerPixel / 8, back_bo);
+	if (!fb) {
 		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
 				"add fb failed: %s\n", strerror(errno));
 		return FALSE;
 	}
 
-	flipdata = calloc(1, sizeof(drmmode_flipdata_rec));
-	if (!flipdata) {
-		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
-				"flip queue: data alloc failed.\n");
-		goto error_undo;
+	if (!drmmode_flip_crtcs(pScrn, ref_crtc, fb, flags, handler, priv)) {
+		drmmode_fb_unref(mode, fb);
+		return FALSE;
 	}
 
-	flipdata->event_data = priv;
-	flipdata->drmmode = mode;
+	drmmode_fb_unref(mode, mode->fb);
+	mode->fb = fb;
 
-	for (i = 0; i < config->num_crtc; i++) {
-		crtc = config->crtc[i]->driver_private;
+	pMsm->scanout = back_bo;
 
-		if (!config->crtc[i]->enabled)
-			continue;
+	return TRUE;
+}
 
-		if (ref_crtc_hw_id == 0)
-			ref_crtc_hw_id = (1 << i);
+static void
+drmmode_tearfree_flip_done(uint64_t msc, uint64_t ust, void *data)
+{
+	drmmode_ptr drmmode = data;
+	drmmode->tearfree.flip_pending = FALSE;
+}
 
-		flipdata->flip_count++;
+/**
+ * TearFree: copy whatever changed on the screen pixmap since the last
+ * frame to the back scanout buffer, and flip to it.  Called from the
+ * BlockHandler, but a new frame isn't started until the flip of the
+ * previous one completes, so this happens (at most) once per vblank.
+ */
+void
+drmmode_tearfree_update(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	PixmapPtr screen_pix = pScreen->GetScreenPixmap(pScreen);
+	int cpp = pScrn->bitsPerPixel / 8;
+	xf86CrtcPtr ref_crtc = NULL;
+	RegionRec region, screen_region;
+	BoxRec box = { 0, 0, pScrn->virtualX, pScrn->virtualY };
+	BoxPtr boxes;
+	int i, n, back;
+
+	if (!drmmode->tearfree.enabled || !drmmode->tearfree.pix[0])
+		return;
 
-		flipcarrier = calloc(1, sizeof(drmmode_flipevtcarrier_rec));
-		if (!flipcarrier) {
-			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
-					"flip queue: carrier alloc failed.\n");
-			if (emitted == 0)
-				free(flipdata);
-			goto error_undo;
-		}
+	if (!drmmode->tearfree.damage) {
+		drmmode->tearfree.damage = DamageCreate(NULL, NULL,
+				DamageReportNone, TRUE, pScreen, NULL);
+		if (!drmmode->tearfree.damage)
+			return;
+		DamageRegister(&screen_pix->drawable, drmmode->tearfree.damage);
+	}
 
-		/* Only the reference crtc will finally deliver its page flip
-		 * completion event. All other crtc's events will be discarded.
-		 */
-		flipcarrier->dispatch_me = ((1 << i) == ref_crtc_hw_id);
-		flipcarrier->flipdata = flipdata;
+	if (drmmode->tearfree.flip_pending ||
+			!RegionNotEmpty(DamageRegion(drmmode->tearfree.damage)))
+		return;
 
-		ret = drmModePageFlip(mode->fd, crtc->mode_crtc->crtc_id,
-				mode->fb_id, DRM_MODE_PAGE_FLIP_EVENT,
-				flipcarrier);
-		if (ret) {
-			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
-					"flip queue failed: %s\n", strerror(errno));
+	/* crtcs with a rotation shadow scan that out instead: */
+	ref_crtc = drmmode_covering_crtc(pScrn, &box);
+	if (ref_crtc && ((drmmode_crtc_private_ptr)ref_crtc->driver_private)->rotate_fb_id)
+		ref_crtc = NULL;
+	for (i = 0; !ref_crtc && (i < config->num_crtc); i++) {
+		drmmode_crtc_private_ptr drmmode_crtc = config->crtc[i]->driver_private;
+		if (config->crtc[i]->enabled && !drmmode_crtc->rotate_fb_id)
+			ref_crtc = config->crtc[i];
+	}
+	if (!ref_crtc)
+		return;
 
-			free(flipcarrier);
-			if (emitted == 0)
-				free(flipdata);
-			goto error_undo;
-		}
+	back = drmmode->tearfree.back;
 
-		emitted++;
+	/* the back buffer was last updated two frames ago, so it is
+	 * missing the previous frame's damage as well as this one's:
+	 */
+	RegionInit(&screen_region, &box, 1);
+	RegionNull(&region);
+	RegionUnion(&region, DamageRegion(drmmode->tearfree.damage),
+			&drmmode->tearfree.prev);
+	RegionIntersect(&region, &region, &screen_region);
+	RegionUninit(&screen_region);
+
+	drmmode_tearfree_copy(pScreen, screen_pix,
+			drmmode->tearfree.pix[back], &region);
+	MSMFlushAccel(pScreen);
+
+	if (!drmmode_flip_crtcs(pScrn, ref_crtc, drmmode->tearfree.fb[back],
+			DRM_MODE_PAGE_FLIP_EVENT, drmmode_tearfree_flip_done,
+			drmmode)) {
+		/* keep the damage, and try again next time around: */
+		RegionUninit(&region);
+		return;
 	}
 
-	/* Will release old fb after all crtc's completed flip. */
-	flipdata->old_fb_id = old_fb_id;
+	drmmode->tearfree.flip_pending = TRUE;
 
-	pMsm->scanout = back_bo;
+	boxes = RegionRects(&region);
+	n = RegionNumRects(&region);
+	for (i = 0; i < n; i++) {
+		drmmode->tearfree.copied += (uint64_t)cpp *
+				(boxes[i].x2 - boxes[i].x1) *
+				(boxes[i].y2 - boxes[i].y1);
+	}
+	drmmode->tearfree.full += (uint64_t)cpp * box.x2 * box.y2;
+	drmmode->tearfree.frames++;
 
-	return TRUE;
+	RegionCopy(&drmmode->tearfree.prev, DamageRegion(drmmode->tearfree.damage));
+	DamageEmpty(drmmode->tearfree.damage);
+	RegionUninit(&region);
 
-error_undo:
-	drmModeRmFB(mode->fd, mode->fb_id);
-	mode->fb_id = old_fb_id;
-	return FALSE;
+	drmmode_fb_unref(drmmode, drmmode->fb);
+	drmmode->fb = drmmode_fb_ref(drmmode->tearfree.fb[back]);
+	drmmode->tearfree.back = !back;
 }
 
 #ifdef HAVE_LIBUDEV
+/* how long to wait for a burst of hotplug events to settle (ms): */
+#define HOTPLUG_DEBOUNCE_MS 100
+
+static CARD32
+drmmode_hotplug_timer(OsTimerPtr timer, CARD32 time, pointer arg)
+{
+	ScrnInfoPtr scrn = arg;
+	drmmode_ptr drmmode = drmmode_from_scrn(scrn);
+
+	/* only the connectors flagged by the uevents get re-probed, the
+	 * rest just report their current state:
+	 */
+	drmmode->hotplug = TRUE;
+	RRGetInfo(xf86ScrnToScreen(scrn), TRUE);
+	drmmode->hotplug = FALSE;
+
+	return 0;
+}
+
 static void
 drmmode_handle_uevents(ScrnInfoPtr scrn)
 {
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
 	drmmode_ptr drmmode = drmmode_from_scrn(scrn);
 	struct udev_device *dev;
+	const char *hotplug, *connector;
+	uint32_t connector_id = 0;
+	struct stat st;
+	int i;
 
 	dev = udev_monitor_receive_device(drmmode->uevent_monitor);
 	if (!dev)
 		return;
 
-	RRGetInfo(xf86ScrnToScreen(scrn), TRUE);
+	/* ignore anything that isn't a hotplug event for our device: */
+	hotplug = udev_device_get_property_value(dev, "HOTPLUG");
+	if (!hotplug || strcmp(hotplug, "1") || fstat(drmmode->fd, &st) ||
+			(udev_device_get_devnum(dev) != st.st_rdev)) {
+		udev_device_unref(dev);
+		return;
+	}
+
+	/* newer kernels tell us which connector changed (and for property
+	 * changes, such as link-status, which property), otherwise all of
+	 * the connectors need to be re-probed:
+	 */
+	connector = udev_device_get_property_value(dev, "CONNECTOR");
+	if (connector)
+		connector_id = strtoul(connector, NULL, 10);
+
+	/* any cached connector state may be stale now: */
+	if (!++drmmode->connector_gen)
+		drmmode->connector_gen = 1;
+
+	for (i = 0; i < config->num_output; i++) {
+		drmmode_output_private_ptr drmmode_output =
+				config->output[i]->driver_private;
+		if (!connector_id || (drmmode_output->output_id == connector_id))
+			drmmode_output->probe = TRUE;
+	}
+
 	udev_device_unref(dev);
+
+	/* hotplug events tend to come in bursts (especially with flaky
+	 * cables), so wait for things to settle before re-probing:
+	 */
+	drmmode->hotplug_timer = TimerSet(drmmode->hotplug_timer, 0,
+			HOTPLUG_DEBOUNCE_MS, drmmode_hotplug_timer, scrn);
 }
 #endif
 
@@ -1409,6 +3217,9 @@ drmmode_uevent_init(ScrnInfoPtr scrn)
 
 	AddGeneralSocket(udev_monitor_get_fd(mon));
 	drmmode->uevent_monitor = mon;
+
+	/* now that we find out about hotplug, connector state can be cached: */
+	drmmode->connector_gen = 1;
 #endif
 }
 
@@ -1421,6 +3232,9 @@ drmmode_uevent_fini(ScrnInfoPtr scrn)
 	if (drmmode->uevent_monitor) {
 		struct udev *u = udev_monitor_get_udev(drmmode->uevent_monitor);
 
+		TimerFree(drmmode->hotplug_timer);
+		drmmode->hotplug_timer = NULL;
+
 		RemoveGeneralSocket(udev_monitor_get_fd(drmmode->uevent_monitor));
 		udev_monitor_unref(drmmode->uevent_monitor);
 		udev_unref(u);
@@ -1428,38 +3242,92 @@ drmmode_uevent_fini(ScrnInfoPtr scrn)
 #endif
 }
 
+/**
+ * A crtc has completed its flip: the fb it was scanning out is no longer
+ * needed by it.
+ */
+static void
+drmmode_crtc_flip_done(xf86CrtcPtr crtc, drmmode_flipevtcarrier_ptr flipcarrier,
+		unsigned int frame, unsigned int tv_sec, unsigned int tv_usec)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	MSM_PROBE3(flip_handler__entry, crtc, frame,
+			((uint64_t)tv_sec * 1000000) + tv_usec);
+
+	/* the crtc has moved on to the new fb, so it is done with the
+	 * previous one.  Unless a modeset happened in the meantime, in
+	 * which case it is scanning out whatever that set up:
+	 */
+	if (drmmode_crtc->flip_superseded) {
+		drmmode_fb_unref(drmmode, drmmode_crtc->flip_fb);
+		drmmode_crtc->flip_superseded = FALSE;
+	} else {
+		drmmode_fb_unref(drmmode, drmmode_crtc->scanout_fb);
+		drmmode_crtc->scanout_fb = drmmode_crtc->flip_fb;
+	}
+	drmmode_crtc->flip_fb = NULL;
+
+	drmmode_flip_event(flipcarrier->flipdata, crtc == flipcarrier->ref_crtc,
+			drmmode_crtc_msc64(crtc, frame),
+			((uint64_t)tv_sec * 1000000) + tv_usec);
+
+	MSM_PROBE(flip_handler__return);
+}
+
 static void
 drmmode_flip_handler(int fd, unsigned int frame, unsigned int tv_sec,
 		unsigned int tv_usec, void *event_data)
 {
 	drmmode_flipevtcarrier_ptr flipcarrier = event_data;
-	drmmode_flipdata_ptr flipdata = flipcarrier->flipdata;
-	drmmode_ptr drmmode = flipdata->drmmode;
 
-	/* Is this the event whose info shall be delivered to higher level? */
-	if (flipcarrier->dispatch_me) {
-		/* Yes: Cache msc, ust for later delivery. */
-		flipdata->fe_frame = frame;
-		flipdata->fe_tv_sec = tv_sec;
-		flipdata->fe_tv_usec = tv_usec;
-	}
+	drmmode_crtc_flip_done(flipcarrier->crtc, flipcarrier,
+			frame, tv_sec, tv_usec);
+
 	free(flipcarrier);
+}
 
-	/* Last crtc completed flip? */
-	flipdata->flip_count--;
-	if (flipdata->flip_count > 0)
-		return;
+#ifdef HAVE_DRM_ATOMIC
+/* With atomic, a carrier is shared by all of the crtcs in the commit,
+ * so the crtc has to be looked up from the event.  Only installed with
+ * atomic, but a legacy flip's carrier still knows its crtc:
+ */
+static void
+drmmode_flip_handler2(int fd, unsigned int frame, unsigned int tv_sec,
+		unsigned int tv_usec, unsigned int crtc_id, void *event_data)
+{
+	drmmode_flipevtcarrier_ptr flipcarrier = event_data;
+	ScrnInfoPtr pScrn = flipcarrier->flipdata->pScrn;
+	xf86CrtcPtr crtc = flipcarrier->crtc;
 
-	/* Release framebuffer */
-	drmModeRmFB(drmmode->fd, flipdata->old_fb_id);
+	if (!crtc)
+		crtc = drmmode_crtc_from_id(pScrn, crtc_id);
 
-	if (flipdata->event_data) {
-		/* Deliver cached msc, ust from reference crtc to flip event handler */
-		MSMDRI2SwapComplete(flipdata->event_data, flipdata->fe_frame,
-				flipdata->fe_tv_sec, flipdata->fe_tv_usec);
-	}
+	if (crtc)
+		drmmode_crtc_flip_done(crtc, flipcarrier, frame, tv_sec, tv_usec);
+	else
+		drmmode_flip_event(flipcarrier->flipdata, FALSE, 0, 0);
 
-	free(flipdata);
+	if (--flipcarrier->count == 0)
+		free(flipcarrier);
+}
+#endif
+
+static void
+drmmode_vblank_handler(int fd, unsigned int frame, unsigned int tv_sec,
+		unsigned int tv_usec, void *event_data)
+{
+	drmmode_vblank_event_ptr event = event_data;
+
+	if (event->swap)
+		MSMPTR(event->crtc->scrn)->pending_page_flips--;
+
+	event->handler(drmmode_crtc_msc64(event->crtc, frame),
+			((uint64_t)tv_sec * 1000000) + tv_usec,
+			event->event_data);
+
+	free(event);
 }
 
 static void
@@ -1504,7 +3372,7 @@ drmmode_screen_init(ScreenPtr pScreen)
 	DEBUG_MSG("initial scanout buffer: %dx%d@%d (size=%d, pitch=%d)",
 		pScrn->virtualX, pScrn->virtualY, pScrn->bitsPerPixel,
 		size, pitch);
-	pMsm->scanout = fd_bo_new(pMsm->dev, size,
+	pMsm->scanout = msm_bo_new(pMsm, size,
 			DRM_FREEDRENO_GEM_TYPE_KMEM);
 	if (!pMsm->scanout) {
 		ERROR_MSG("Error allocating scanout buffer");
@@ -1513,9 +3381,22 @@ drmmode_screen_init(ScreenPtr pScreen)
 
 	drmmode_uevent_init(pScrn);
 
+	RegionNull(&drmmode->tearfree.prev);
+	drmmode->tearfree.enabled = pMsm->TearFree;
+	if (drmmode->tearfree.enabled)
+		INFO_MSG("TearFree enabled");
+
 	/* Plug in a pageflip completion event handler */
 	drmmode->event_context.version = DRM_EVENT_CONTEXT_VERSION;
 	drmmode->event_context.page_flip_handler = drmmode_flip_handler;
+#ifdef HAVE_DRM_ATOMIC
+	/* libdrm prefers it, for legacy flips too, which (before linux
+	 * 4.12) don't say which crtc they are for:
+	 */
+	if (drmmode->atomic)
+		drmmode->event_context.page_flip_handler2 = drmmode_flip_handler2;
+#endif
+	drmmode->event_context.vblank_handler = drmmode_vblank_handler;
 
 	AddGeneralSocket(drmmode->fd);
 
@@ -1526,6 +3407,57 @@ drmmode_screen_init(ScreenPtr pScreen)
 	return TRUE;
 }
 
+/**
+ * Get the TearFree counters (frames flipped, bytes copied, and bytes that
+ * full screen copies would have been), for the runtime stats.  Returns
+ * FALSE if TearFree isn't enabled.
+ */
+Bool
+drmmode_tearfree_stats(ScrnInfoPtr pScrn, uint64_t *frames,
+		uint64_t *copied, uint64_t *full)
+{
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+
+	if (!drmmode || !drmmode->tearfree.enabled)
+		return FALSE;
+
+	*frames = drmmode->tearfree.frames;
+	*copied = drmmode->tearfree.copied;
+	*full = drmmode->tearfree.full;
+
+	return TRUE;
+}
+
+/**
+ * Tear down TearFree, and report what it cost.  This needs to happen
+ * before accel is torn down, as the scanout buffers are wrapped in
+ * pixmaps.
+ */
+void
+drmmode_tearfree_fini(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+
+	if (drmmode->tearfree.frames) {
+		INFO_MSG("TearFree: %llu frames, %llu KiB copied "
+				"(%llu KiB/frame, %llu%% of full screen copies)",
+				(unsigned long long)drmmode->tearfree.frames,
+				(unsigned long long)drmmode->tearfree.copied / 1024,
+				(unsigned long long)(drmmode->tearfree.copied /
+						drmmode->tearfree.frames / 1024),
+				(unsigned long long)(drmmode->tearfree.copied * 100 /
+						drmmode->tearfree.full));
+	}
+
+	drmmode_tearfree_free(pScreen, drmmode);
+	RegionUninit(&drmmode->tearfree.prev);
+
+	/* the damage goes away along with the screen pixmap: */
+	drmmode->tearfree.damage = NULL;
+	drmmode->tearfree.enabled = FALSE;
+}
+
 void
 drmmode_screen_fini(ScreenPtr pScreen)
 {
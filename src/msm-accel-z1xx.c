@@ -34,99 +34,95 @@
 #include "msm-accel.h"
 #include "msm-accel-z1xx.h"
 
-/* matching buffer info:
-                len:            00001000
-                gpuaddr:        66142000
+/*
+ * The context state.  For the 2D pipe, libdrm reserves the first
+ * STATE_SIZE dwords of each ring for it, and submits them along with
+ * the cmds (the kernel patches the leading packet), so it is part of
+ * every submit.  Until the state is better understood, this reproduces
+ * (dword for dword) what libC2D2 emits, which mostly just clears
+ * registers, and points the gpu at its context buffers.  Registers
+ * without a name in freedreno_z1xx.h are unknown.
+ */
 
-                len:            00009000
-                gpuaddr:        66276000
+/* like REGM(), but for what seems to be another register space: */
+#define REGM_VG(reg, count) ((0x7b << 24) | ((count) << 8) | (reg))
 
-                len:            00081000
-                gpuaddr:        66280000
- */
-static const uint32_t initial_state[] = {
-		 0x7c000275, 0x00000000, 0x00050005, 0x7c000129,
-		 0x00000000, 0x7c00012a, 0x00000000, 0x7c00012b,
-		 0x00000000, 0x7c00010f, 0x00000000, 0x7c000108,
-		 0x00000000, 0x7c000109, 0x00000000, 0x7c000100,
-		 0x00000000, 0x7c000101, 0x00000000, 0x7c000110,
-		 0x00000000, 0x7c0001d0, 0x00000000, 0x7c0001d4,
-		 0x00000000, 0x7c00010c, 0x00000000, 0x7c00010e,
-		 0x00000000, 0x7c00010d, 0x00000000, 0x7c00010b,
-		 0x00000000, 0x7c00010a, 0x00000000, 0x7c000111,
-		 0x00000000, 0x7c000114, 0x00000000, 0x7c000115,
-		 0x00000000, 0x7c000116, 0x00000000, 0x7c000117,
-		 0x00000000, 0x7c000118, 0x00000000, 0x7c000119,
-		 0x00000000, 0x7c00011a, 0x00000000, 0x7c00011b,
-		 0x00000000, 0x7c00011c, 0x00000000, 0x7c00011d,
-		 0x00000000, 0x7c00011e, 0x00000000, 0x7c00011f,
-		 0x00000000, 0x7c000124, 0x00000000, 0x7c000125,
-		 0x00000000, 0x7c000127, 0x00000000, 0x7c000128,
-		 0x00000000, 0x7b00015e, 0x00000000, 0x7b000161,
-		 0x00000000, 0x7b000165, 0x00000000, 0x7b000166,
-		 0x00000000, 0x7b00016e, 0x00000000, 0x7c00016f,
-		 0x00000000, 0x7b000165, 0x00000000, 0x7b000154,
-		 0x00000000, 0x7b000155, 0x00000000, 0x7b000153,
-		 0x00000000, 0x7b000168, 0x00000000, 0x7b000160,
-		 0x00000000, 0x7b000150, 0x00000000, 0x7b000156,
-		 0x00000000, 0x7b000157, 0x00000000, 0x7b000158,
-		 0x00000000, 0x7b000159, 0x00000000, 0x7b000152,
-		 0x00000000, 0x7b000151, 0x00000000, 0x7b000156,
-		 0x00000000, 0x7c00017f, 0x00000000, 0x7c00017f,
-		 0x00000000, 0x7c00017f, 0x00000000, 0x7c00017f,
-		 0x00000000, 0x7f000000, 0x7f000000, 0x7c000129,
-/**/	 0x66142000, 0x7c00012a, 0x66276000, 0x7c00012b,
-/**/	 0x66280000, 0x7c0001e2, 0x00000000, 0x7c0001e3,
-		 0x00000000, 0x7c0001e4, 0x00000000, 0x7c0001e5,
-		 0x00000000, 0x7c0001e6, 0x00000000, 0x7c0001e7,
-		 0x00000000, 0x7c0001c0, 0x00000000, 0x7c0001c1,
-		 0x00000000, 0x7c0001c2, 0x00000000, 0x7c0001c3,
-		 0x00000000, 0x7c0001c4, 0x00000000, 0x7c0001c5,
-		 0x00000000, 0x7c0001c6, 0x00000000, 0x7c0001c7,
-		 0x00000000, 0x7c0001c8, 0x00000000, 0x7c0001c9,
-		 0x00000000, 0x7c0001ca, 0x00000000, 0x7c0001d1,
-		 0x00000000, 0x7c0001d2, 0x00000000, 0x7c0001d4,
-		 0x00000000, 0x7c0001d3, 0x00000000, 0x7c0001d5,
-		 0x00000000, 0x7c0001d0, 0x00000000, 0x7c0001e0,
-		 0x00000000, 0x7c0001e1, 0x00000000, 0x7c0001e2,
-		 0x00000000, 0x7c0001e3, 0x00000000, 0x7c0001e4,
-		 0x00000000, 0x7c0001e5, 0x00000000, 0x7c0001e6,
-		 0x00000000, 0x7c0001e7, 0x00000000, 0x7c0001c0,
-		 0x00000000, 0x7c0001c1, 0x00000000, 0x7c0001c2,
-		 0x00000000, 0x7c0001c3, 0x00000000, 0x7c0001c4,
-		 0x00000000, 0x7c0001c5, 0x00000000, 0x7c0001c6,
-		 0x00000000, 0x7c0001c7, 0x00000000, 0x7c0001c8,
-		 0x00000000, 0x7c0001c9, 0x00000000, 0x7c0001ca,
-		 0x00000000, 0x7c0001d1, 0x00000000, 0x7c0001d2,
-		 0x00000000, 0x7c0001d4, 0x00000000, 0x7c0001d3,
-		 0x00000000, 0x7c0001d5, 0x00000000, 0x7c0001d0,
-		 0x00000000, 0x7c0001e0, 0x00000000, 0x7c0001e1,
-		 0x00000000, 0x7c0001e2, 0x00000000, 0x7c0001e3,
-		 0x00000000, 0x7c0001e4, 0x00000000, 0x7c0001e5,
-		 0x00000000, 0x7c0001e6, 0x00000000, 0x7c0001e7,
-		 0x00000000, 0x7c0001c0, 0x00000000, 0x7c0001c1,
-		 0x00000000, 0x7c0001c2, 0x00000000, 0x7c0001c3,
-		 0x00000000, 0x7c0001c4, 0x00000000, 0x7c0001c5,
-		 0x00000000, 0x7c0001c6, 0x00000000, 0x7c0001c7,
-		 0x00000000, 0x7c0001c8, 0x00000000, 0x7c0001c9,
-		 0x00000000, 0x7c0001ca, 0x00000000, 0x7c0001d1,
-		 0x00000000, 0x7c0001d2, 0x00000000, 0x7c0001d4,
-		 0x00000000, 0x7c0001d3, 0x00000000, 0x7c0001d5,
-		 0x00000000, 0x7c0001d0, 0x00000000, 0x7c0001e0,
-		 0x00000000, 0x7c0001e1, 0x00000000, 0x7c0001e2,
-		 0x00000000, 0x7c0001e3, 0x00000000, 0x7c0001e4,
-		 0x00000000, 0x7c0001e5, 0x00000000, 0x7c0001e6,
-		 0x00000000, 0x7c0001e7, 0x00000000, 0x7c0001c0,
-		 0x00000000, 0x7c0001c1, 0x00000000, 0x7c0001c2,
-		 0x00000000, 0x7c0001c3, 0x00000000, 0x7c0001c4,
-		 0x00000000, 0x7c0001c5, 0x00000000, 0x7c0001c6,
-		 0x00000000, 0x7c0001c7, 0x00000000, 0x7c0001c8,
-		 0x00000000, 0x7c0001c9, 0x00000000, 0x7c0001ca,
-		 0x00000000, 0x7c0001d1, 0x00000000, 0x7c0001d2,
-		 0x00000000, 0x7c0001d4, 0x00000000, 0x7c0001d3,
-		 0x00000000, 0x7c0001d5, 0x00000000, 0x7f000000,
+static const uint8_t g2d_clear[] = {
+		VGV1_DIRTYBASE, VGV1_CBASE1, VGV1_UBASE2, G2D_INPUT,
+		G2D_SCISSORX, G2D_SCISSORY, G2D_BASE0, G2D_CFG0, G2D_MASK,
+		G2D_GRADIENT, 0xd4, G2D_ALPHABLEND, G2D_CONFIG, G2D_ROP,
+		G2D_BACKGROUND, G2D_FOREGROUND, G2D_BLENDERCFG,
+		G2D_BLEND_A0, G2D_BLEND_A1, G2D_BLEND_A2, G2D_BLEND_A3,
+		G2D_BLEND_C0, G2D_BLEND_C1, G2D_BLEND_C2, G2D_BLEND_C3,
+		G2D_BLEND_C4, G2D_BLEND_C5, G2D_BLEND_C6, G2D_BLEND_C7,
+		0x24, 0x25, 0x27, 0x28,
+};
+
+/* REGM_VG() registers, except 0x6f which is a plain REGM(): */
+static const uint8_t vg_clear[] = {
+		0x5e, 0x61, 0x65, 0x66, 0x6e, 0x6f, 0x65, 0x54, 0x55, 0x53,
+		0x68, 0x60, 0x50, 0x56, 0x57, 0x58, 0x59, 0x52, 0x51, 0x56,
+};
+
+static const uint8_t gradw_clear[] = {
+		GRADW_CONST0, GRADW_CONST1, GRADW_CONST2, GRADW_CONST3,
+		GRADW_CONST4, GRADW_CONST5, GRADW_CONST6, GRADW_CONST7,
+		GRADW_CONST8, GRADW_CONST9, GRADW_CONSTA, GRADW_TEXCFG,
+		GRADW_TEXSIZE, 0xd4, GRADW_TEXBASE, GRADW_TEXCFG2, G2D_GRADIENT,
+		GRADW_INST0, GRADW_INST1, GRADW_INST2, GRADW_INST3,
+		GRADW_INST4, GRADW_INST5, GRADW_INST6, GRADW_INST7,
 };
 
+static void
+ring_state(MSMPtr pMsm, struct fd_ringbuffer *ring)
+{
+	unsigned i;
+
+	ring->cur = ring->start;
+
+	OUT_RING (ring, REGM(VGV3_NEXTADDR, 2));
+	OUT_RING (ring, 0x00000000);	/* VGV3_NEXTADDR */
+	OUT_RING (ring, 0x00050005);	/* VGV3_NEXTCMD */
+
+	for (i = 0; i < ARRAY_SIZE(g2d_clear); i++) {
+		OUT_RING (ring, REGM(g2d_clear[i], 1));
+		OUT_RING (ring, 0x00000000);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(vg_clear); i++) {
+		if (vg_clear[i] == 0x6f)
+			OUT_RING (ring, REGM(vg_clear[i], 1));
+		else
+			OUT_RING (ring, REGM_VG(vg_clear[i], 1));
+		OUT_RING (ring, 0x00000000);
+	}
+
+	for (i = 0; i < 4; i++) {
+		OUT_RING (ring, REGM(VGV3_LAST, 1));
+		OUT_RING (ring, 0x00000000);
+	}
+	OUT_RING (ring, REG(VGV3_LAST) | 0x0);
+	OUT_RING (ring, REG(VGV3_LAST) | 0x0);
+
+	OUT_RING  (ring, REGM(VGV1_DIRTYBASE, 1));
+	OUT_RELOC (ring, pMsm->ring.context_bos[0], TRUE);
+	OUT_RING  (ring, REGM(VGV1_CBASE1, 1));
+	OUT_RELOC (ring, pMsm->ring.context_bos[1], TRUE);
+	OUT_RING  (ring, REGM(VGV1_UBASE2, 1));
+	OUT_RELOC (ring, pMsm->ring.context_bos[2], TRUE);
+
+	/* the rest clears the gradient registers over and over (starting
+	 * part way through the sequence), up to the final VGV3_LAST:
+	 */
+	for (i = 19; (ring->cur - ring->start) < (STATE_SIZE - 1); i++) {
+		OUT_RING (ring, REGM(gradw_clear[i % ARRAY_SIZE(gradw_clear)], 1));
+		OUT_RING (ring, 0x00000000);
+	}
+	OUT_RING (ring, REG(VGV3_LAST) | 0x0);
+
+	fd_ringbuffer_reset(ring);
+}
+
 void
 ring_pre(struct fd_ringbuffer *ring)
 {
@@ -154,32 +150,134 @@ ring_post(struct fd_ringbuffer *ring)
 	OUT_RING(ring, REG(VGV3_LAST) | 0x0);
 }
 
+static struct fd_ringbuffer *
+ring_new(MSMPtr pMsm)
+{
+	struct fd_ringbuffer *ring;
+
+	ring = fd_ringbuffer_new(pMsm->pipe,
+			pMsm->ring.size + STATE_SIZE * sizeof(uint32_t));
+	if (!ring && (pMsm->ring.size > MSM_RING_SIZE)) {
+		/* no memory for a bigger one right now, so start over from the
+		 * default size (the rings can still grow again later):
+		 */
+		pMsm->ring.size = MSM_RING_SIZE;
+		ring = fd_ringbuffer_new(pMsm->pipe,
+				pMsm->ring.size + STATE_SIZE * sizeof(uint32_t));
+	}
+	if (!ring) {
+		/* memory is tight, so give back what we can: */
+		pMsm->ring.pressure = TRUE;
+		return NULL;
+	}
+
+	ring_state(pMsm, ring);
+
+	return ring;
+}
+
+static void
+ring_del(struct fd_ringbuffer *ring)
+{
+	if (msm_trace_active)
+		msm_trace_ring_del(ring);
+	fd_ringbuffer_del(ring);
+}
+
+/*
+ * Cycle to the next ringbuffer.  The rings adapt to the load: one which
+ * filled up before it was flushed (see BEGIN_RING) means they are too
+ * small, and having to wait for the gpu to be done with the next one
+ * (see FIRE_RING) means there are too few.  So the size of new rings is
+ * doubled, or a ring is added, up to Option "MaxRingSize"/"MaxRings".
+ * Rings which are too small get replaced when they come up for reuse.
+ * When a bo or ring allocation fails, memory is tight, so all the rings
+ * are dropped (once idle), and their number and size are halved.  The
+ * last ring is only dropped once there is a new one to replace it, and
+ * when no new ring can be allocated, an old one is kept in use, so that
+ * there always is a current ring.
+ */
 void
 next_ring(MSMPtr pMsm)
 {
-	struct fd_ringbuffer *ring;
-	int idx = pMsm->ring.idx++ % ARRAY_SIZE(pMsm->ring.rings);
+	struct fd_ringbuffer *ring, *old = NULL;
+	int i, idx;
 
-	if (pMsm->ring.rings[idx]) {
-		ring = pMsm->ring.ring = pMsm->ring.rings[idx];
-		fd_ringbuffer_reset(ring);
-		return;
+	if (pMsm->ring.pressure) {
+		msm_pipe_wait(pMsm, pMsm->ring.timestamp);
+		for (i = 0; i < pMsm->ring.nrings; i++) {
+			ring = pMsm->ring.rings[i];
+			if (ring == pMsm->ring.ring)
+				old = ring;
+			else if (ring)
+				ring_del(ring);
+			pMsm->ring.rings[i] = NULL;
+		}
+
+		pMsm->ring.nrings = max(pMsm->ring.nrings / 2, MSM_MIN_RINGS);
+		pMsm->ring.size = max(pMsm->ring.size / 2,
+				min(MSM_RING_SIZE, pMsm->ring.max_size));
+		pMsm->ring.idx = 0;
+
+		pMsm->ring.pressure = pMsm->ring.full = pMsm->ring.blocked = FALSE;
+		pMsm->stats.ring_shrinks++;
 	}
 
-	ring = pMsm->ring.ring = pMsm->ring.rings[idx] =
-			fd_ringbuffer_new(pMsm->pipe,
-					0x4000 + STATE_SIZE * sizeof(uint32_t));
+	if (pMsm->ring.full) {
+		pMsm->ring.size = min(2 * pMsm->ring.size, pMsm->ring.max_size);
+		pMsm->ring.full = FALSE;
+	}
 
-	/* for now, until state packet is understood, just use a pre-canned
-	 * state captured from libC2D2 test, and fix up the gpu addresses
-	 */
-	memcpy(ring->start, initial_state, STATE_SIZE * sizeof(uint32_t));
-	ring->cur = &ring->start[120];
-	OUT_RELOC(ring, pMsm->ring.context_bos[0], TRUE);
-	ring->cur = &ring->start[122];
-	OUT_RELOC(ring, pMsm->ring.context_bos[1], TRUE);
-	ring->cur = &ring->start[124];
-	OUT_RELOC(ring, pMsm->ring.context_bos[2], TRUE);
+	idx = pMsm->ring.idx;
 
-	fd_ringbuffer_reset(ring);
+	if (pMsm->ring.blocked) {
+		/* add a ring in front of the one still busy: */
+		if (pMsm->ring.nrings < pMsm->ring.max_rings) {
+			struct fd_ringbuffer **rings = pMsm->ring.rings;
+			memmove(&rings[idx + 1], &rings[idx],
+					(pMsm->ring.nrings - idx) * sizeof(rings[0]));
+			rings[idx] = NULL;
+			pMsm->ring.nrings++;
+		}
+		pMsm->ring.blocked = FALSE;
+	}
+
+	pMsm->ring.idx = (idx + 1) % pMsm->ring.nrings;
+
+	ring = pMsm->ring.rings[idx];
+	if (!ring || (ring->size < (pMsm->ring.size +
+			STATE_SIZE * sizeof(uint32_t)))) {
+		struct fd_ringbuffer *new_ring = ring_new(pMsm);
+
+		if (new_ring) {
+			if (ring) {
+				msm_pipe_wait(pMsm, fd_ringbuffer_timestamp(ring));
+				ring_del(ring);
+			}
+			if (old)
+				ring_del(old);
+			ring = pMsm->ring.rings[idx] = new_ring;
+		} else if (!ring) {
+			/* keep using the last ring (FIRE_RING() waits for it),
+			 * back in the slots if the shrink dropped it.  Otherwise
+			 * it is still in its own slot, so drop the empty one (ie.
+			 * the one just added for being blocked):
+			 */
+			ring = pMsm->ring.ring;
+			if (old) {
+				pMsm->ring.rings[idx] = old;
+			} else if (ring) {
+				struct fd_ringbuffer **rings = pMsm->ring.rings;
+				memmove(&rings[idx], &rings[idx + 1],
+						(pMsm->ring.nrings - idx - 1) * sizeof(rings[0]));
+				rings[--pMsm->ring.nrings] = NULL;
+				pMsm->ring.idx = idx % pMsm->ring.nrings;
+			}
+		}
+	}
+
+	if (ring)
+		fd_ringbuffer_reset(ring);
+
+	pMsm->ring.ring = ring;
 }
@@ -27,32 +27,38 @@
 #include "msm.h"
 #include "freedreno_ringbuffer.h"
 #include "freedreno_z1xx.h"
-
-#define LOG_DWORDS 0
+#include "msm-trace.h"
 
 #define STATE_SIZE  0x140
 
+/* waits on the next ring longer than this mean there are too few: */
+#define RING_BLOCKED_US  100
+
 void ring_pre(struct fd_ringbuffer *ring);
 void ring_post(struct fd_ringbuffer *ring);
 void next_ring(MSMPtr pMsm);
 
+/* msm-trace.c, active if Option "TraceFile" or "CaptureFile" is set: */
+extern Bool msm_trace_active;
+void msm_trace_init(ScrnInfoPtr pScrn, const char *path);
+void msm_capture_init(ScrnInfoPtr pScrn, const char *path);
+void msm_capture_cpu_write(struct fd_bo *bo);
+void msm_trace_reloc(struct fd_ringbuffer *ring, struct fd_bo *bo, Bool write);
+void msm_trace_capture(struct fd_ringbuffer *ring);
+void msm_trace_submit(struct fd_ringbuffer *ring);
+void msm_trace_ring_del(struct fd_ringbuffer *ring);
+
 static inline void
 OUT_RING(struct fd_ringbuffer *ring, unsigned data)
 {
-	if (LOG_DWORDS) {
-		ErrorF("ring[%p]: OUT_RING   %04x:  %08x\n", ring,
-				(uint32_t)(ring->cur - ring->last_start), data);
-	}
 	fd_ringbuffer_emit(ring, data);
 }
 
 static inline void
 OUT_RELOC(struct fd_ringbuffer *ring, struct fd_bo *bo, Bool write)
 {
-	if (LOG_DWORDS) {
-		ErrorF("ring[%p]: OUT_RELOC  %04x:  %p\n", ring,
-				(uint32_t)(ring->cur - ring->last_start), bo);
-	}
+	if (msm_trace_active)
+		msm_trace_reloc(ring, bo, write);
 	fd_ringbuffer_reloc(ring, &(struct fd_reloc){
 		.bo = bo,
 		.flags = FD_RELOC_READ | (write ? FD_RELOC_WRITE : 0),
@@ -64,8 +70,18 @@ FIRE_RING(MSMPtr pMsm)
 {
 	struct fd_ringbuffer *ring = pMsm->ring.ring;
 	if (pMsm->ring.fire) {
+		MSM_PROBE(fire_ring__entry);
+
 		ring_post(ring);
+
+		if (msm_trace_active)
+			msm_trace_capture(ring);
+
 		fd_ringbuffer_flush(ring);
+		pMsm->stats.flushes++;
+
+		if (msm_trace_active)
+			msm_trace_submit(ring);
 
 		/* grab the timestamp off the current ringbuffer: */
 		pMsm->ring.timestamp = fd_ringbuffer_timestamp(pMsm->ring.ring);
@@ -75,17 +91,20 @@ FIRE_RING(MSMPtr pMsm)
 
 		/* if blits haven't finished on the previous usage of the next
 		 * ringbuffer, we need to wait to avoid overwriting cmds that
-		 * the gpu is still processing..  ideally we don't hit this too
-		 * much, otherwise we should create more ringbuffers..
-		 *
-		 * TODO maybe we want to time this to make sure we aren't actually
-		 * blocking..
+		 * the gpu is still processing..  if that actually blocks, the
+		 * next next_ring() adds a ringbuffer:
 		 */
-		fd_pipe_wait(pMsm->pipe, fd_ringbuffer_timestamp(pMsm->ring.ring));
+		if (msm_pipe_wait(pMsm, fd_ringbuffer_timestamp(pMsm->ring.ring)) >
+				RING_BLOCKED_US) {
+			pMsm->ring.blocked = TRUE;
+			pMsm->stats.ring_blocked++;
+		}
 
 		ring_pre(pMsm->ring.ring);
 
 		pMsm->ring.fire = FALSE;
+
+		MSM_PROBE1(fire_ring__return, pMsm->ring.timestamp);
 	}
 }
 
@@ -94,24 +113,20 @@ BEGIN_RING(MSMPtr pMsm, int size)
 {
 	struct fd_ringbuffer *ring = pMsm->ring.ring;
 
-	if (LOG_DWORDS) {
-		ErrorF("ring[%p]: BEGIN_RING %d\n", ring, size);
-	}
-
 	/* current kernel side just expects one cmd packet per ISSUEIBCMDS: */
 	size += 11;       /* common header/footer */
 
-	if ((ring->cur + size) > ring->end)
+	if ((ring->cur + size) > ring->end) {
+		/* flushing early, so the next next_ring() grows the rings: */
+		pMsm->ring.full = TRUE;
+		pMsm->stats.ring_full++;
 		FIRE_RING(pMsm);
+	}
 }
 
 static inline void
 END_RING(MSMPtr pMsm)
 {
-	struct fd_ringbuffer *ring = pMsm->ring.ring;
-	if (LOG_DWORDS) {
-		ErrorF("ring[%p]: END_RING\n", ring);
-	}
 	pMsm->ring.fire = TRUE;
 }
 
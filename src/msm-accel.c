@@ -99,6 +99,14 @@ out:
 	ret = MSMSetupExa(pScreen, softexa);
 	if (ret) {
 		pMsm->dri = MSMDRI2ScreenInit(pScreen);
+#ifdef HAVE_PRESENT
+		if (!pMsm->NoKMS)
+			pMsm->present = MSMPresentScreenInit(pScreen);
+#endif
+#ifdef HAVE_DRI3
+		if (!pMsm->NoKMS)
+			pMsm->dri3 = MSMDRI3ScreenInit(pScreen);
+#endif
 	}
 	return ret;
 }
@@ -35,8 +35,22 @@
             ErrorF("EXA: " fmt"\n", ##__VA_ARGS__);                 \
     } while (0)
 
+/* each EXA_FAIL_IF() site counts how often it was hit, see msm-stats.c: */
+struct msm_fallback {
+	const char *func, *cond;
+	CARD64 count;
+	struct msm_fallback *next;
+};
+
+void msm_stats_fallback(struct msm_fallback *fallback);
+
 #define EXA_FAIL_IF(cond) do {                                      \
         if (cond) {                                                 \
+            static struct msm_fallback fallback = {                 \
+                .func = __func__, .cond = #cond,                    \
+            };                                                      \
+            msm_stats_fallback(&fallback);                          \
+            MSM_PROBE2(exa_fallback, __func__, #cond);              \
             if (ENABLE_SW_FALLBACK_REPORTS) {                       \
                 ErrorF("FALLBACK: " #cond"\n");                     \
             }                                                       \
@@ -29,9 +29,12 @@
 
 #include "xf86drmMode.h"
 #include "dri2.h"
+#include "list.h"
 
 #include <errno.h>
 
+typedef struct _MSMDRISwapCmd MSMDRISwapCmd;
+
 typedef struct {
 	DRI2BufferRec base;
 
@@ -57,6 +60,8 @@ typedef struct {
 #define DRIBUF(p)	((DRI2BufferPtr)(&(p)->base))
 
 static void MSMDRI2DestroyBuffer(DrawablePtr pDraw, DRI2BufferPtr buffer);
+static void MSMDRI2SwapComplete(MSMDRISwapCmd *cmd, uint32_t frame,
+		uint32_t tv_sec, uint32_t tv_usec);
 
 #define DRI2BufferThirdLeft       (DRI2BufferBackLeft | 0x00008000)
 
@@ -68,6 +73,7 @@ static RESTYPE                    MSMDRI2DrawableRes;
 
 typedef struct {
 	DrawablePtr pDraw;
+	ScreenPtr pScreen;
 
 	/* keep track of the third buffer, if created:
 	 */
@@ -87,6 +93,19 @@ typedef struct {
 	 */
 	uint32_t frame, tv_sec, tv_usec;
 
+	/* if the drawable is currently being scanned out on an overlay
+	 * plane, the crtc it is on:
+	 */
+	xf86CrtcPtr plane_crtc;
+	struct xorg_list plane_link;
+
+	/* swap stats, and the msc/ust of the last flip and the frame period
+	 * seen between back-to-back flips, for counting missed vblanks:
+	 */
+	struct msm_swap_stats stats;
+	uint32_t flip_msc;
+	CARD64 flip_ust, frame_us;
+
 } MSMDRI2DrawableRec, *MSMDRI2DrawablePtr;
 
 static int
@@ -94,6 +113,13 @@ MSMDRI2DrawableGone(pointer p, XID id)
 {
 	MSMDRI2DrawablePtr pPriv = p;
 
+	msm_stats_swap_del(MSMPTR_FROM_SCREEN(pPriv->pScreen), &pPriv->stats);
+
+	if (pPriv->plane_crtc) {
+		drmmode_plane_hide(pPriv->plane_crtc);
+		xorg_list_del(&pPriv->plane_link);
+	}
+
 	if (pPriv->pThirdBuffer)
 		MSMDRI2DestroyBuffer(NULL, pPriv->pThirdBuffer);
 
@@ -118,6 +144,9 @@ MSMDRI2GetDrawable(DrawablePtr pDraw)
 	if (!pPriv) {
 		pPriv = calloc(1, sizeof(*pPriv));
 		pPriv->pDraw = pDraw;
+		pPriv->pScreen = pDraw->pScreen;
+		msm_stats_swap_add(MSMPTR_FROM_SCREEN(pDraw->pScreen),
+				&pPriv->stats, pDraw->id);
 
 		if (pDraw->type == DRAWABLE_WINDOW) {
 			dixSetPrivate(&((WindowPtr)pDraw)->devPrivates,
@@ -164,6 +193,12 @@ canexchange(DrawablePtr pDraw, DRI2BufferPtr a, DRI2BufferPtr b)
 	DrawablePtr da = dri2draw(pDraw, a);
 	DrawablePtr db = dri2draw(pDraw, b);
 
+	/* with TearFree, the front buffer contents need to go through
+	 * damage to make it to the screen:
+	 */
+	if (MSMPTR_FROM_SCREEN(pDraw->pScreen)->TearFree)
+		return FALSE;
+
 	return DRI2CanFlip(pDraw) &&
 			(da->width == db->width) &&
 			(da->height == db->height) &&
@@ -186,10 +221,137 @@ exchangebufs(DrawablePtr pDraw, DRI2BufferPtr a, DRI2BufferPtr b)
 	return TRUE;
 }
 
+/*
+ * Pool of recently released back buffer pixmaps.  Buffers get destroyed
+ * and re-created every time a window is resized (or the drawable is
+ * otherwise invalidated), so rather than thrashing bo allocation (and
+ * flink name export) keep released pixmaps around for a short while
+ * to be reused by the next buffer of the same size.  Pixmaps are only
+ * handed back to the same client which released them, so the previous
+ * contents don't leak across clients.
+ */
+
+#define POOL_MAX_SIZE   8     /* max # of pixmaps in the pool */
+#define POOL_MAX_AGE    1000  /* max time (ms) a pixmap sits in the pool */
+
+struct dri2_pool_entry {
+	struct xorg_list link;
+	PixmapPtr pPixmap;
+	int client;
+	CARD32 time;
+};
+
+struct dri2_state {
+	struct xorg_list pool;
+	int npool;
+	OsTimerPtr timer;
+
+	/* drawables currently on an overlay plane: */
+	struct xorg_list planes;
+
+	/* blit swaps waiting for the blit to land (see MSMDRI2BlitPoll()): */
+	struct xorg_list blits;
+};
+
+static void
+poolremove(ScreenPtr pScreen, struct dri2_pool_entry *entry)
+{
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(pScreen);
+	xorg_list_del(&entry->link);
+	pMsm->dri2->npool--;
+	free(entry);
+}
+
+static void
+poolevict(ScreenPtr pScreen, CARD32 now, Bool all)
+{
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(pScreen);
+	struct dri2_pool_entry *entry, *tmp;
+
+	/* oldest entries are at the head: */
+	xorg_list_for_each_entry_safe(entry, tmp, &pMsm->dri2->pool, link) {
+		if (!all && (pMsm->dri2->npool <= POOL_MAX_SIZE) &&
+				((now - entry->time) < POOL_MAX_AGE))
+			break;
+		pScreen->DestroyPixmap(entry->pPixmap);
+		poolremove(pScreen, entry);
+	}
+}
+
+static CARD32
+MSMDRI2PoolTimer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	ScreenPtr pScreen = arg;
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(pScreen);
+
+	poolevict(pScreen, now, FALSE);
+
+	return pMsm->dri2->npool ? POOL_MAX_AGE : 0;
+}
+
+static void
+poolput(DrawablePtr pDraw, PixmapPtr pPixmap)
+{
+	ScreenPtr pScreen = pPixmap->drawable.pScreen;
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(pScreen);
+	struct dri2_pool_entry *entry;
+	CARD32 now = GetTimeInMillis();
+
+	/* if the drawable is already gone, we don't know who the pixmap
+	 * belonged to, or if someone else still has a reference, then
+	 * don't pool it.  Nor once the pool itself is gone (buffers can
+	 * outlive MSMDRI2CloseScreen()):
+	 */
+	if (!pDraw || !pMsm->dri2 || (pPixmap->refcnt > 1) ||
+			!(entry = calloc(1, sizeof(*entry)))) {
+		pScreen->DestroyPixmap(pPixmap);
+		return;
+	}
+
+	entry->pPixmap = pPixmap;
+	entry->client = CLIENT_ID(pDraw->id);
+	entry->time = now;
+
+	xorg_list_append(&entry->link, &pMsm->dri2->pool);
+	pMsm->dri2->npool++;
+
+	poolevict(pScreen, now, FALSE);
+
+	/* make sure whatever is left gets cleaned up eventually: */
+	if (pMsm->dri2->npool) {
+		pMsm->dri2->timer = TimerSet(pMsm->dri2->timer, 0, POOL_MAX_AGE,
+				MSMDRI2PoolTimer, pScreen);
+	}
+}
+
+static PixmapPtr
+poolget(DrawablePtr pDraw)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(pScreen);
+	struct dri2_pool_entry *entry;
+
+	xorg_list_for_each_entry(entry, &pMsm->dri2->pool, link) {
+		PixmapPtr pPixmap = entry->pPixmap;
+		if ((pPixmap->drawable.width == pDraw->width) &&
+				(pPixmap->drawable.height == pDraw->height) &&
+				(pPixmap->drawable.depth == pDraw->depth) &&
+				(entry->client == CLIENT_ID(pDraw->id))) {
+			poolremove(pScreen, entry);
+			return pPixmap;
+		}
+	}
+
+	return NULL;
+}
+
 static PixmapPtr
 createpix(DrawablePtr pDraw)
 {
 	ScreenPtr pScreen = pDraw->pScreen;
+	PixmapPtr pPixmap = poolget(pDraw);
+	if (pPixmap)
+		return pPixmap;
 	return pScreen->CreatePixmap(pScreen,
 			pDraw->width, pDraw->height, pDraw->depth,
 			CREATE_PIXMAP_USAGE_DRI2);
@@ -266,7 +428,10 @@ MSMDRI2DestroyBuffer(DrawablePtr pDraw, DRI2BufferPtr buffer)
 		}
 	}
 
-	pScreen->DestroyPixmap(buf->pPixmap);
+	if (buffer->attachment == DRI2BufferFrontLeft)
+		pScreen->DestroyPixmap(buf->pPixmap);
+	else
+		poolput(pDraw, buf->pPixmap);
 
 	free(buf);
 }
@@ -290,30 +455,40 @@ MSMDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
 	DrawablePtr pSrcDraw = dri2draw(pDraw, pSrcBuffer);
 	DrawablePtr pDstDraw = dri2draw(pDraw, pDstBuffer);
 	RegionPtr pCopyClip;
+	BoxRec extents;
 	GCPtr pGC;
 
 	DEBUG_MSG("pDraw=%p, pDstBuffer=%p (%p), pSrcBuffer=%p (%p)",
 			pDraw, pDstBuffer, pSrcDraw, pSrcBuffer, pDstDraw);
 
-	/* hack.. since we don't have proper fencing / kernel synchronization
-	 * we can get in a scenario where we get many frames ahead of the gpu,
-	 * with queued up cmd sequence like: render -> blit -> render -> blit ..
-	 * This hack makes sure the previous blit has completed.
+	/* only copy what the client asked for, and if the destination is
+	 * a window only the part of that which is actually visible:
 	 */
-	{
-	MSMPtr pMsm = MSMPTR(pScrn);
-	MSMDRI2BufferPtr buf = MSMBUF(pDstBuffer);
-	pMsm->pExa->PrepareAccess(buf->pPixmap, 0);
-	pMsm->pExa->FinishAccess(buf->pPixmap, 0);
+	pCopyClip = REGION_CREATE(pScreen, NULL, 0);
+	RegionCopy(pCopyClip, pRegion);
+	if (pDstDraw->type == DRAWABLE_WINDOW) {
+		RegionRec visible;
+		RegionNull(&visible);
+		RegionCopy(&visible, &((WindowPtr)pDstDraw)->clipList);
+		RegionTranslate(&visible, -pDstDraw->x, -pDstDraw->y);
+		RegionIntersect(pCopyClip, pCopyClip, &visible);
+		RegionUninit(&visible);
+	}
+
+	if (!RegionNotEmpty(pCopyClip)) {
+		DEBUG_MSG("nothing to copy");
+		RegionDestroy(pCopyClip);
+		return;
 	}
 
+	extents = *RegionExtents(pCopyClip);
+
 	pGC = GetScratchGC(pDstDraw->depth, pScreen);
 	if (!pGC) {
+		RegionDestroy(pCopyClip);
 		return;
 	}
 
-	pCopyClip = REGION_CREATE(pScreen, NULL, 0);
-	RegionCopy(pCopyClip, pRegion);
 	(*pGC->funcs->ChangeClip) (pGC, CT_REGION, pCopyClip, 0);
 	ValidateGC(pDstDraw, pGC);
 
@@ -326,7 +501,9 @@ MSMDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
 	 */
 
 	pGC->ops->CopyArea(pSrcDraw, pDstDraw, pGC,
-			0, 0, pDraw->width, pDraw->height, 0, 0);
+			extents.x1, extents.y1,
+			extents.x2 - extents.x1, extents.y2 - extents.y1,
+			extents.x1, extents.y1);
 
 	FreeScratchGC(pGC);
 
@@ -382,6 +559,18 @@ struct _MSMDRISwapCmd {
 	DRI2BufferPtr pSrcBuffer;
 	DRI2SwapEventPtr func;
 	void *data;
+
+	/* for blits, the destination bo and the timer used to poll for
+	 * the blit to complete before the client is told the swap is done
+	 * (while it is armed, the cmd is in the screen's blits list):
+	 */
+	struct fd_bo *bo;
+	OsTimerPtr timer;
+	struct xorg_list link;
+
+	/* for the swap stats: */
+	CARD64 request_us;
+	Bool plane;
 };
 
 static const char *swap_names[] = {
@@ -390,6 +579,180 @@ static const char *swap_names[] = {
 		[DRI2_FLIP_COMPLETE] = "flip,"
 };
 
+static void
+MSMDRI2FlipComplete(uint64_t msc, uint64_t ust, void *data)
+{
+	MSMDRI2SwapComplete(data, msc, ust / 1000000, ust % 1000000);
+}
+
+/* Since we don't have fences, we can get in a scenario where the client
+ * gets many frames ahead of the gpu, with queued up cmd sequence like:
+ * render -> blit -> render -> blit ..  So for blits, hold off on the
+ * swap complete event (which is what throttles the client) until the
+ * blit has actually landed.  Rather than stalling the server waiting
+ * for that, poll the bo from a timer:
+ */
+#define BLIT_POLL_MS 1
+
+static Bool
+blitbusy(MSMDRISwapCmd *cmd)
+{
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(cmd->pScreen);
+
+	if (fd_bo_cpu_prep(cmd->bo, pMsm->pipe,
+			DRM_FREEDRENO_PREP_READ | DRM_FREEDRENO_PREP_NOSYNC))
+		return TRUE;
+
+	fd_bo_cpu_fini(cmd->bo);
+
+	return FALSE;
+}
+
+static CARD32
+MSMDRI2BlitPoll(OsTimerPtr timer, CARD32 time, pointer arg)
+{
+	MSMDRISwapCmd *cmd = arg;
+
+	if (blitbusy(cmd))
+		return BLIT_POLL_MS;
+
+	MSMDRI2SwapComplete(cmd, 0, 0, 0);
+
+	return 0;
+}
+
+static void
+MSMDRI2BlitComplete(DrawablePtr pDraw, MSMDRISwapCmd *cmd)
+{
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(cmd->pScreen);
+	struct fd_bo *bo;
+
+	bo = msm_get_pixmap_bo(draw2pix(dri2draw(pDraw, cmd->pDstBuffer)));
+	if (bo && pMsm->pipe) {
+		cmd->bo = fd_bo_ref(bo);
+		if (blitbusy(cmd)) {
+			cmd->timer = TimerSet(NULL, 0, BLIT_POLL_MS,
+					MSMDRI2BlitPoll, cmd);
+			if (cmd->timer) {
+				xorg_list_append(&cmd->link, &pMsm->dri2->blits);
+				return;
+			}
+		}
+	}
+
+	MSMDRI2SwapComplete(cmd, 0, 0, 0);
+}
+
+/*
+ * Swaps of a window which exactly covers a single crtc (but not the
+ * whole screen, so it can't be page flipped, ie. fullscreen on one
+ * head of a multi-head setup) can be done by putting the back buffer
+ * on an overlay plane, rather than blitting it to the front buffer.
+ *
+ * While the window is on a plane, the front buffer underneath is not
+ * updated, so if the window gets obscured/moved/etc (checked from the
+ * block handler), or a swap is done some other way, we need to stop
+ * using the plane, copying its contents back to the front buffer first
+ * if needed.
+ */
+static xf86CrtcPtr
+canplane(DrawablePtr pDraw)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	MSMPtr pMsm = MSMPTR(pScrn);
+	WindowPtr pWin = (WindowPtr)pDraw;
+	xf86CrtcPtr crtc;
+	BoxRec box;
+
+	if ((pDraw->type != DRAWABLE_WINDOW) || (pDraw->bitsPerPixel != 32))
+		return NULL;
+
+	/* a sw cursor would end up underneath the plane: */
+	if (!pMsm->HWCursor)
+		return NULL;
+
+	/* redirected (composited) windows don't get scanned out: */
+	if (draw2pix(pDraw) != pScreen->GetScreenPixmap(pScreen))
+		return NULL;
+
+	box.x1 = pDraw->x;
+	box.y1 = pDraw->y;
+	box.x2 = box.x1 + pDraw->width;
+	box.y2 = box.y1 + pDraw->height;
+
+	/* the window must be unobscured: */
+	if ((RegionNumRects(&pWin->clipList) != 1) ||
+			memcmp(RegionExtents(&pWin->clipList), &box, sizeof(box)))
+		return NULL;
+
+	crtc = drmmode_covering_crtc(pScrn, &box);
+	if (!crtc || (crtc->rotation != RR_Rotate_0) ||
+			(crtc->x != box.x1) || (crtc->y != box.y1) ||
+			(crtc->mode.HDisplay != pDraw->width) ||
+			(crtc->mode.VDisplay != pDraw->height))
+		return NULL;
+
+	if (!drmmode_plane_available(crtc))
+		return NULL;
+
+	return crtc;
+}
+
+static void
+planestop(DrawablePtr pDraw, MSMDRI2DrawablePtr pPriv, Bool restore)
+{
+	if (restore && pPriv->pThirdBuffer) {
+		ScreenPtr pScreen = pDraw->pScreen;
+		DrawablePtr pSrcDraw = dri2draw(pDraw, pPriv->pThirdBuffer);
+		GCPtr pGC = GetScratchGC(pDraw->depth, pScreen);
+		if (pGC) {
+			ValidateGC(pDraw, pGC);
+			pGC->ops->CopyArea(pSrcDraw, pDraw, pGC, 0, 0,
+					pDraw->width, pDraw->height, 0, 0);
+			FreeScratchGC(pGC);
+			MSMFlushAccel(pScreen);
+		}
+	}
+
+	drmmode_plane_hide(pPriv->plane_crtc);
+	pPriv->plane_crtc = NULL;
+	xorg_list_del(&pPriv->plane_link);
+}
+
+static Bool
+planeswap(DrawablePtr pDraw, MSMDRISwapCmd *cmd, xf86CrtcPtr crtc)
+{
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(pDraw->pScreen);
+	MSMDRI2DrawablePtr pPriv = MSMDRI2GetDrawable(pDraw);
+
+	/* we need a 3rd buffer to hold what is on the plane, since the
+	 * back buffer goes back to the client:
+	 */
+	if (!pPriv->pThirdBuffer) {
+		pPriv->pThirdBuffer = MSMDRI2CreateBuffer(pDraw,
+				DRI2BufferThirdLeft, cmd->pSrcBuffer->format);
+		if (!pPriv->pThirdBuffer)
+			return FALSE;
+	}
+
+	if (pPriv->plane_crtc && (pPriv->plane_crtc != crtc))
+		planestop(pDraw, pPriv, FALSE);
+
+	if (!drmmode_plane_show(crtc, MSMBUF(cmd->pSrcBuffer)->pPixmap,
+			MSMDRI2FlipComplete, cmd))
+		return FALSE;
+
+	if (!pPriv->plane_crtc) {
+		pPriv->plane_crtc = crtc;
+		xorg_list_add(&pPriv->plane_link, &pMsm->dri2->planes);
+	}
+
+	exchangebufs(pDraw, cmd->pSrcBuffer, pPriv->pThirdBuffer);
+
+	return TRUE;
+}
+
 static void
 MSMDRI2SwapDispatch(DrawablePtr pDraw, MSMDRISwapCmd *cmd)
 {
@@ -397,17 +760,26 @@ MSMDRI2SwapDispatch(DrawablePtr pDraw, MSMDRISwapCmd *cmd)
 	ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
 	MSMDRI2DrawablePtr pPriv = MSMDRI2GetDrawable(pDraw);
 	MSMDRI2BufferPtr src = MSMBUF(cmd->pSrcBuffer);
+	xf86CrtcPtr crtc;
+	Bool plane = FALSE;
 
 	/* if we can flip, do so: */
 	if (canflip(pDraw) &&
-			drmmode_page_flip(pDraw, src->pPixmap, cmd)) {
-		MSMPTR(pScrn)->pending_page_flips++;
+			drmmode_page_flip(pDraw, src->pPixmap, FALSE,
+					MSMDRI2FlipComplete, cmd)) {
 		cmd->type = DRI2_FLIP_COMPLETE;
 	} else if (canexchange(pDraw, cmd->pSrcBuffer, cmd->pDstBuffer)) {
 		/* we can get away w/ pointer swap.. yah! */
 		cmd->type = DRI2_EXCHANGE_COMPLETE;
+	} else if ((crtc = canplane(pDraw)) && planeswap(pDraw, cmd, crtc)) {
+		/* as far as the client is concerned, this is a flip: */
+		cmd->type = DRI2_FLIP_COMPLETE;
+		plane = TRUE;
 	} else {
-		/* fallback to blit: */
+		/* fallback to blit.  DRI2 SwapBuffers doesn't tell us what
+		 * the client actually changed, so the whole drawable is
+		 * copied, but CopyRegion will trim that to what is visible:
+		 */
 		BoxRec box = {
 				.x1 = 0,
 				.y1 = 0,
@@ -425,20 +797,30 @@ MSMDRI2SwapDispatch(DrawablePtr pDraw, MSMDRISwapCmd *cmd)
 	DEBUG_MSG("%s dispatched: %d -> %d", swap_names[cmd->type],
 			cmd->pSrcBuffer->attachment, cmd->pDstBuffer->attachment);
 
+	cmd->plane = plane;
+
+	/* if the swap didn't go to the plane, the front buffer has been
+	 * updated, so we can just stop using the plane:
+	 */
+	if (!plane && pPriv->plane_crtc)
+		planestop(pDraw, pPriv, FALSE);
+
 	/* for flip/exchange, cycle buffers now, so no next DRI2GetBuffers
-	 * gets the new buffer names:
+	 * gets the new buffer names (plane swaps already did this):
 	 */
-	switch (cmd->type) {
-	case DRI2_FLIP_COMPLETE:
-		/* allocate 3rd buffer if needed: */
-		if (!pPriv->pThirdBuffer) {
-			pPriv->pThirdBuffer = MSMDRI2CreateBuffer(pDraw,
-					DRI2BufferThirdLeft, cmd->pSrcBuffer->format);
+	if (!plane) {
+		switch (cmd->type) {
+		case DRI2_FLIP_COMPLETE:
+			/* allocate 3rd buffer if needed: */
+			if (!pPriv->pThirdBuffer) {
+				pPriv->pThirdBuffer = MSMDRI2CreateBuffer(pDraw,
+						DRI2BufferThirdLeft, cmd->pSrcBuffer->format);
+			}
+			exchangebufs(pDraw, cmd->pDstBuffer, pPriv->pThirdBuffer);
+			/* fallthrough */
+		case DRI2_EXCHANGE_COMPLETE:
+			exchangebufs(pDraw, cmd->pSrcBuffer, cmd->pDstBuffer);
 		}
-		exchangebufs(pDraw, cmd->pDstBuffer, pPriv->pThirdBuffer);
-		/* fallthrough */
-	case DRI2_EXCHANGE_COMPLETE:
-		exchangebufs(pDraw, cmd->pSrcBuffer, cmd->pDstBuffer);
 	}
 
 	/* if we are triple buffering, send event back to client
@@ -451,33 +833,92 @@ MSMDRI2SwapDispatch(DrawablePtr pDraw, MSMDRISwapCmd *cmd)
 				cmd->type, cmd->func, cmd->data);
 	}
 
-	/* for exchange/blit, there is no page_flip event to wait for:
+	/* for exchange, there is no page_flip event to wait for, and for
+	 * blit we just need to wait for the gpu:
 	 */
-	if (cmd->type != DRI2_FLIP_COMPLETE) {
+	if (cmd->type == DRI2_BLIT_COMPLETE) {
+		MSMDRI2BlitComplete(pDraw, cmd);
+	} else if (cmd->type != DRI2_FLIP_COMPLETE) {
 		MSMDRI2SwapComplete(cmd, 0, 0, 0);
 	}
 }
 
-void
+/* A flip should land on the first vblank after it was requested (or
+ * right after the previous flip, if it was requested while that one was
+ * still pending), anything later is a missed vblank.  The frame period
+ * is taken from back-to-back flips, so until there have been some it is
+ * unknown (-1), and a request racing with a vblank can be counted as a
+ * miss:
+ */
+static int
+missedvblanks(MSMDRI2DrawablePtr pPriv, MSMDRISwapCmd *cmd,
+		uint32_t frame, CARD64 ust)
+{
+	uint32_t expected;
+	int missed = -1;
+
+	if (pPriv->flip_ust && (frame != pPriv->flip_msc)) {
+		if ((frame - pPriv->flip_msc) == 1)
+			pPriv->frame_us = ust - pPriv->flip_ust;
+
+		expected = pPriv->flip_msc + 1;
+		if ((cmd->request_us > pPriv->flip_ust) && pPriv->frame_us) {
+			expected += (cmd->request_us - pPriv->flip_ust) /
+					pPriv->frame_us;
+		}
+
+		if ((cmd->request_us <= pPriv->flip_ust) || pPriv->frame_us) {
+			missed = (int32_t)(frame - expected);
+			if (missed < 0)
+				missed = 0;
+		}
+	}
+
+	pPriv->flip_msc = frame;
+	pPriv->flip_ust = ust;
+
+	return missed;
+}
+
+static void
 MSMDRI2SwapComplete(MSMDRISwapCmd *cmd, uint32_t frame,
 		uint32_t tv_sec, uint32_t tv_usec)
 {
 	ScreenPtr pScreen = cmd->pScreen;
 	ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+	MSMPtr pMsm = MSMPTR(pScrn);
 	DrawablePtr pDraw = NULL;
-	int status;
+	CARD64 latency = GetTimeInMicros() - cmd->request_us;
+	enum msm_swap_type type;
+	int status, missed = -1;
+
+	MSM_PROBE4(dri2_swap_complete, cmd->draw_id, cmd, cmd->type, frame);
 
 	DEBUG_MSG("%s complete: %d -> %d", swap_names[cmd->type],
 			cmd->pSrcBuffer->attachment, cmd->pDstBuffer->attachment);
 
-	if (cmd->type == DRI2_FLIP_COMPLETE)
-		MSMPTR(pScrn)->pending_page_flips--;
+	switch (cmd->type) {
+	case DRI2_FLIP_COMPLETE:
+		type = cmd->plane ? MSM_SWAP_PLANE : MSM_SWAP_FLIP;
+		break;
+	case DRI2_EXCHANGE_COMPLETE:
+		type = MSM_SWAP_EXCHANGE;
+		break;
+	default:
+		type = MSM_SWAP_BLIT;
+		break;
+	}
 
 	status = dixLookupDrawable(&pDraw, cmd->draw_id, serverClient,
 			M_ANY, DixWriteAccess);
 
 	if (status == Success) {
 		MSMDRI2DrawablePtr pPriv = MSMDRI2GetDrawable(pDraw);
+		if (cmd->type == DRI2_FLIP_COMPLETE) {
+			missed = missedvblanks(pPriv, cmd, frame,
+					((CARD64)tv_sec * 1000000) + tv_usec);
+		}
+		msm_stats_swap(pMsm, &pPriv->stats, type, latency, missed);
 		if (pPriv->pThirdBuffer) {
 			pPriv->frame = frame;
 			pPriv->tv_sec = tv_sec;
@@ -494,6 +935,8 @@ MSMDRI2SwapComplete(MSMDRISwapCmd *cmd, uint32_t frame,
 			MSMDRI2SwapDispatch(pDraw, next_cmd);
 		}
 		pPriv->pending_swaps--;
+	} else {
+		msm_stats_swap(pMsm, NULL, type, latency, -1);
 	}
 
 	/* drop extra refcnt we obtained prior to swap:
@@ -501,6 +944,13 @@ MSMDRI2SwapComplete(MSMDRISwapCmd *cmd, uint32_t frame,
 	MSMDRI2DestroyBuffer(pDraw, cmd->pSrcBuffer);
 	MSMDRI2DestroyBuffer(pDraw, cmd->pDstBuffer);
 
+	if (cmd->timer) {
+		xorg_list_del(&cmd->link);
+		TimerFree(cmd->timer);
+	}
+	if (cmd->bo)
+		fd_bo_del(cmd->bo);
+
 	free(cmd);
 }
 
@@ -527,8 +977,11 @@ MSMDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	MSMDRI2DrawablePtr pPriv = MSMDRI2GetDrawable(pDraw);
 	MSMDRISwapCmd *cmd = calloc(1, sizeof(*cmd));
 
+	MSM_PROBE2(dri2_swap_schedule__entry, pDraw->id, cmd);
+
 	cmd->client = client;
 	cmd->pScreen = pScreen;
+	cmd->request_us = GetTimeInMicros();
 	cmd->draw_id = pDraw->id;
 	cmd->pSrcBuffer = pSrcBuffer;
 	cmd->pDstBuffer = pDstBuffer;
@@ -551,6 +1004,7 @@ MSMDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 			ERROR_MSG("already pending a flip!");
 			pPriv->pending_swaps--;
 			free(cmd);
+			MSM_PROBE1(dri2_swap_schedule__return, FALSE);
 			return FALSE;
 		}
 		pPriv->cmd = cmd;
@@ -558,6 +1012,8 @@ MSMDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 		MSMDRI2SwapDispatch(pDraw, cmd);
 	}
 
+	MSM_PROBE1(dri2_swap_schedule__return, TRUE);
+
 	return TRUE;
 }
 
@@ -576,6 +1032,23 @@ MSMDRI2ScheduleWaitMSC(ClientPtr client, DrawablePtr pDraw, CARD64 target_msc,
 	return TRUE;
 }
 
+/**
+ * Called from the BlockHandler, to stop using overlay planes for windows
+ * which can no longer be shown on the plane, eg. because they got moved
+ * or obscured by other windows.
+ */
+void
+MSMDRI2BlockHandler(ScreenPtr pScreen)
+{
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(pScreen);
+	MSMDRI2DrawablePtr pPriv, tmp;
+
+	xorg_list_for_each_entry_safe(pPriv, tmp, &pMsm->dri2->planes, plane_link) {
+		if (canplane(pPriv->pDraw) != pPriv->plane_crtc)
+			planestop(pPriv->pDraw, pPriv, TRUE);
+	}
+}
+
 /**
  * The DRI2 ScreenInit() function.. register our handler fxns w/ DRI2 core
  */
@@ -625,7 +1098,21 @@ MSMDRI2ScreenInit(ScreenPtr pScreen)
 	if (!dixRegisterPrivateKey(&MSMDRI2PixmapPrivateKeyRec, PRIVATE_PIXMAP, 0))
 		return FALSE;
 
-	return DRI2ScreenInit(pScreen, &info);
+	pMsm->dri2 = calloc(1, sizeof(*pMsm->dri2));
+	if (!pMsm->dri2)
+		return FALSE;
+
+	xorg_list_init(&pMsm->dri2->pool);
+	xorg_list_init(&pMsm->dri2->planes);
+	xorg_list_init(&pMsm->dri2->blits);
+
+	if (!DRI2ScreenInit(pScreen, &info)) {
+		free(pMsm->dri2);
+		pMsm->dri2 = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 /**
@@ -636,9 +1123,31 @@ MSMDRI2CloseScreen(ScreenPtr pScreen)
 {
 	ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
 	MSMPtr pMsm = MSMPTR(pScrn);
-	while (pMsm->pending_page_flips > 0) {
-		DEBUG_MSG("waiting..");
-		drmmode_wait_for_event(pScrn);
+	MSMDRISwapCmd *cmd;
+
+	/* complete the swaps still in flight, rather than have their
+	 * events or timers fire once the screen is gone.  Completing one
+	 * can dispatch the next swap queued up on the drawable:
+	 */
+	for (;;) {
+		if (!xorg_list_is_empty(&pMsm->dri2->blits)) {
+			cmd = xorg_list_first_entry(&pMsm->dri2->blits,
+					MSMDRISwapCmd, link);
+			fd_bo_cpu_prep(cmd->bo, pMsm->pipe, DRM_FREEDRENO_PREP_READ);
+			fd_bo_cpu_fini(cmd->bo);
+			MSMDRI2SwapComplete(cmd, 0, 0, 0);
+		} else if (pMsm->pending_page_flips > 0) {
+			DEBUG_MSG("waiting..");
+			drmmode_wait_for_event(pScrn);
+		} else {
+			break;
+		}
 	}
 	DRI2CloseScreen(pScreen);
+
+	if (pMsm->dri2->timer)
+		TimerFree(pMsm->dri2->timer);
+	poolevict(pScreen, 0, TRUE);
+	free(pMsm->dri2);
+	pMsm->dri2 = NULL;
 }
@@ -0,0 +1,177 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "msm.h"
+
+#include "xf86drm.h"
+#include "dri3.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * DRI3 support.  Unlike DRI2, buffers are shared with the client as
+ * dma-buf fd's rather than global flink names, and the client
+ * allocates its own back buffers, so all we need to do here is hand
+ * out a device fd and import/export pixmaps.
+ */
+
+static int
+MSMDRI3Open(ScreenPtr pScreen, RRProviderPtr provider, int *out)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	MSMPtr pMsm = MSMPTR(pScrn);
+	drm_magic_t magic;
+	int fd;
+
+	fd = open(pMsm->deviceName, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return BadAlloc;
+
+	/* if this is a render node, there is nothing to authenticate,
+	 * otherwise authenticate the new fd on the client's behalf:
+	 */
+	if (drmGetMagic(fd, &magic) < 0) {
+		if (errno == EACCES) {
+			*out = fd;
+			return Success;
+		}
+		close(fd);
+		return BadMatch;
+	}
+
+	if (drmAuthMagic(pMsm->drmFD, magic) < 0) {
+		close(fd);
+		return BadMatch;
+	}
+
+	*out = fd;
+	return Success;
+}
+
+static PixmapPtr
+MSMDRI3PixmapFromFd(ScreenPtr pScreen, int fd, CARD16 width, CARD16 height,
+		CARD16 stride, CARD8 depth, CARD8 bpp)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	MSMPtr pMsm = MSMPTR(pScrn);
+	PixmapPtr pixmap;
+	struct fd_bo *bo;
+
+	if ((depth < 8) || (bpp != 16 && bpp != 32))
+		return NULL;
+
+	if ((width == 0) || (height == 0) ||
+			(stride < MSMAlignedStride(width, bpp)))
+		return NULL;
+
+	bo = fd_bo_from_dmabuf(pMsm->dev, fd);
+	if (!bo) {
+		DEBUG_MSG("could not import dmabuf fd %d", fd);
+		return NULL;
+	}
+
+	if (fd_bo_size(bo) < (stride * height)) {
+		DEBUG_MSG("dmabuf too small: %u < %u",
+				fd_bo_size(bo), stride * height);
+		fd_bo_del(bo);
+		return NULL;
+	}
+
+	pixmap = pScreen->CreatePixmap(pScreen, 0, 0, depth, 0);
+	if (!pixmap) {
+		fd_bo_del(bo);
+		return NULL;
+	}
+
+	pScreen->ModifyPixmapHeader(pixmap, width, height, 0, 0, stride, NULL);
+	msm_set_pixmap_bo(pixmap, bo);
+
+	/* the pixmap holds its own reference now: */
+	fd_bo_del(bo);
+
+	if (!msm_get_pixmap_bo(pixmap)) {
+		pScreen->DestroyPixmap(pixmap);
+		return NULL;
+	}
+
+	return pixmap;
+}
+
+static int
+MSMDRI3FdFromPixmap(ScreenPtr pScreen, PixmapPtr pixmap,
+		CARD16 *stride, CARD32 *size)
+{
+	struct fd_bo *bo = msm_get_pixmap_bo(pixmap);
+	unsigned int pitch;
+
+	if (!bo)
+		return -1;
+
+	pitch = exaGetPixmapPitch(pixmap);
+	if (pitch > UINT16_MAX)
+		return -1;
+
+	*stride = pitch;
+	*size = fd_bo_size(bo);
+
+	return fd_bo_dmabuf(bo);
+}
+
+static dri3_screen_info_rec msm_dri3_screen_info = {
+		.version = 0,
+
+		.open = MSMDRI3Open,
+		.pixmap_from_fd = MSMDRI3PixmapFromFd,
+		.fd_from_pixmap = MSMDRI3FdFromPixmap,
+};
+
+/**
+ * The DRI3 ScreenInit() function.. register our handler fxns w/ DRI3 core
+ */
+Bool
+MSMDRI3ScreenInit(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	MSMPtr pMsm = MSMPTR(pScrn);
+
+	if (!pMsm->deviceName) {
+		WARNING_MSG("DRI3 requires a device name");
+		return FALSE;
+	}
+
+	if (!dri3_screen_init(pScreen, &msm_dri3_screen_info)) {
+		WARNING_MSG("DRI3 initialization failed");
+		return FALSE;
+	}
+
+	INFO_MSG("DRI3 enabled");
+
+	return TRUE;
+}
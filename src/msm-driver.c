@@ -81,6 +81,13 @@ static const OptionInfoRec MSMOptions[] = {
 		{OPTION_SWREFRESHER, "SWRefresher", OPTV_BOOLEAN, {0}, FALSE},
 		{OPTION_VSYNC, "DefaultVsync", OPTV_INTEGER, {0}, FALSE},
 		{OPTION_DEBUG, "Debug", OPTV_BOOLEAN, {0}, FALSE},
+		{OPTION_ATOMIC, "Atomic", OPTV_BOOLEAN, {0}, FALSE},
+		{OPTION_TEARFREE, "TearFree", OPTV_BOOLEAN, {0}, FALSE},
+		{OPTION_STATS, "Stats", OPTV_BOOLEAN, {0}, FALSE},
+		{OPTION_TRACEFILE, "TraceFile", OPTV_STRING, {0}, FALSE},
+		{OPTION_CAPTUREFILE, "CaptureFile", OPTV_STRING, {0}, FALSE},
+		{OPTION_MAXRINGS, "MaxRings", OPTV_INTEGER, {0}, FALSE},
+		{OPTION_MAXRINGSIZE, "MaxRingSize", OPTV_INTEGER, {0}, FALSE},
 		{-1, NULL, OPTV_NONE, {0}, FALSE}
 };
 
@@ -101,8 +108,14 @@ MSMBlockHandler (BLOCKHANDLER_ARGS_DECL)
 	(*pScreen->BlockHandler) (BLOCKHANDLER_ARGS);
 	pScreen->BlockHandler = MSMBlockHandler;
 
-	if (pScrn->vtSema)
+	if (pScrn->vtSema) {
+		if (pMsm->dri2)
+			MSMDRI2BlockHandler(pScreen);
+		if (pMsm->TearFree)
+			drmmode_tearfree_update(pScreen);
 		MSMFlushAccel(pScreen);
+		MSMStatsUpdate(pScreen);
+	}
 }
 
 /*
@@ -141,6 +154,29 @@ free_msm(MSMPtr pMsm)
 	free(pMsm);
 }
 
+/**
+ * Log the time spent in a phase of server startup (since the previous
+ * phase), to see where the time to first frame goes.  Only the first
+ * server generation is timed, since that is the one that counts.
+ */
+void
+MSMStartupPhase(ScrnInfoPtr pScrn, const char *phase)
+{
+	MSMPtr pMsm = MSMPTR(pScrn);
+	CARD64 now;
+
+	if (serverGeneration > 1)
+		return;
+
+	now = GetTimeInMicros();
+	if (!pMsm->startup_begin)
+		pMsm->startup_begin = now;
+	else
+		INFO_MSG("startup: %-16s %8llu us", phase,
+				(unsigned long long)(now - pMsm->startup_phase));
+	pMsm->startup_phase = now;
+}
+
 static Bool
 MSMInitDRM(ScrnInfoPtr pScrn)
 {
@@ -227,23 +263,16 @@ MSMPreInit(ScrnInfoPtr pScrn, int flags)
 
 	pMsm->pEnt = xf86GetEntityInfo(pScrn->entityList[0]);
 
+	MSMStartupPhase(pScrn, NULL);
+
 	if (!MSMInitDRM(pScrn)) {
 		ERROR_MSG("Unable to open DRM");
 		return FALSE;
 	}
 
-	if (pMsm->NoKMS) {
-		if (!fbmode_pre_init(pScrn)) {
-			ERROR_MSG("fbdev modesetting failed to initialize");
-			return FALSE;
-		}
-	} else {
-		if (!drmmode_pre_init(pScrn, pMsm->drmFD, pScrn->bitsPerPixel >> 3)) {
-			ERROR_MSG("Kernel modesetting failed to initialize");
-			return FALSE;
-		}
-	}
+	MSMStartupPhase(pScrn, "drm open");
 
+	/* the options are needed by drmmode_pre_init(): */
 	xf86CollectOptions(pScrn, NULL);
 
 	pMsm->options = malloc(sizeof(MSMOptions));
@@ -256,6 +285,18 @@ MSMPreInit(ScrnInfoPtr pScrn, int flags)
 	memcpy(pMsm->options, MSMOptions, sizeof(MSMOptions));
 	xf86ProcessOptions(pScrn->scrnIndex, pScrn->options, pMsm->options);
 
+	if (pMsm->NoKMS) {
+		if (!fbmode_pre_init(pScrn)) {
+			ERROR_MSG("fbdev modesetting failed to initialize");
+			return FALSE;
+		}
+	} else {
+		if (!drmmode_pre_init(pScrn, pMsm->drmFD, pScrn->bitsPerPixel >> 3)) {
+			ERROR_MSG("Kernel modesetting failed to initialize");
+			return FALSE;
+		}
+	}
+
 	/* Determine if the user wants debug messages turned on: */
 	msmDebug = xf86ReturnOptValBool(pMsm->options, OPTION_DEBUG, FALSE);
 
@@ -268,11 +309,39 @@ MSMPreInit(ScrnInfoPtr pScrn, int flags)
 	/* SWRefresher - default TRUE */
 	pMsm->SWRefresher = xf86ReturnOptValBool(pMsm->options, OPTION_SWREFRESHER, TRUE);
 
+	/* TearFree - default FALSE */
+	pMsm->TearFree = !pMsm->NoKMS &&
+			xf86ReturnOptValBool(pMsm->options, OPTION_TEARFREE, FALSE);
+
+	/* Stats - default FALSE */
+	pMsm->Stats = xf86ReturnOptValBool(pMsm->options, OPTION_STATS, FALSE);
+
+	/* TraceFile - default none */
+	pMsm->TraceFile = xf86GetOptValString(pMsm->options, OPTION_TRACEFILE);
+
+	/* CaptureFile - default none */
+	pMsm->CaptureFile = xf86GetOptValString(pMsm->options, OPTION_CAPTUREFILE);
+
 	if (xf86GetOptValULong(pMsm->options, OPTION_EXAMASK, &val))
 		pMsm->examask = val;
 	else
 		pMsm->examask = ACCEL_DEFAULT;
 
+	/* MaxRings - default MSM_MAX_RINGS */
+	if (xf86GetOptValULong(pMsm->options, OPTION_MAXRINGS, &val))
+		pMsm->ring.max_rings = max(MSM_MIN_RINGS, min(val, MSM_MAX_RINGS));
+	else
+		pMsm->ring.max_rings = MSM_MAX_RINGS;
+
+	/* MaxRingSize (in KiB) - default MSM_MAX_RING_SIZE */
+	if (xf86GetOptValULong(pMsm->options, OPTION_MAXRINGSIZE, &val))
+		pMsm->ring.max_size = max(4, min(val, 4096)) * 1024;
+	else
+		pMsm->ring.max_size = MSM_MAX_RING_SIZE;
+
+	pMsm->ring.nrings = min(MSM_RINGS, pMsm->ring.max_rings);
+	pMsm->ring.size = min(MSM_RING_SIZE, pMsm->ring.max_size);
+
 	INFO_MSG("Option Summary:");
 	INFO_MSG("  NoAccel:     %d", pMsm->NoAccel);
 	INFO_MSG("  HWCursor:    %d", pMsm->HWCursor);
@@ -281,6 +350,8 @@ MSMPreInit(ScrnInfoPtr pScrn, int flags)
 		const char *fb = xf86GetOptValString(pMsm->options, OPTION_FB);
 		INFO_MSG("  fb:          %s", fb);
 		INFO_MSG("  SWRefresher: %d", pMsm->SWRefresher);
+	} else {
+		INFO_MSG("  TearFree:    %d", pMsm->TearFree);
 	}
 	INFO_MSG("  Debug:       %d", msmDebug);
 
@@ -310,6 +381,8 @@ MSMPreInit(ScrnInfoPtr pScrn, int flags)
 	INFO_MSG("MSM Options:");
 	INFO_MSG(" HW Cursor: %s", pMsm->HWCursor ? "Enabled" : "Disabled");
 
+	MSMStartupPhase(pScrn, "pre-init");
+
 	return TRUE;
 }
 
@@ -332,9 +405,17 @@ MSMCreateScreenResources(ScreenPtr pScreen)
 		return FALSE;
 	pScreen->CreateScreenResources = MSMCreateScreenResources;
 
+	MSMStartupPhase(pScrn, "screen resources");
+
 	if (!MSMEnterVT(VT_FUNC_ARGS(0)))
 		return FALSE;
 
+	MSMStartupPhase(pScrn, "modeset");
+	if (serverGeneration == 1)
+		INFO_MSG("startup: total            %8llu us",
+				(unsigned long long)(pMsm->startup_phase -
+						pMsm->startup_begin));
+
 	ppix = pScreen->GetScreenPixmap(pScreen);
 	if (ppix) {
 		int pitch = MSMAlignedStride(ppix->drawable.width,
@@ -356,7 +437,11 @@ MSMCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 
 	DEBUG_MSG("close screen");
 
+	if (pMsm->TearFree)
+		drmmode_tearfree_fini(pScreen);
+
 	MSMAccelFini(pScreen);
+	MSMStatsFini(pScreen);
 
 	if (pScrn->vtSema) {
 		MSMLeaveVT(VT_FUNC_ARGS(0));
@@ -384,6 +469,13 @@ MSMScreenInit(SCREEN_INIT_ARGS_DECL)
 
 	DEBUG_MSG("screen-init");
 
+	/* (includes whatever the server does between PreInit and here) */
+	MSMStartupPhase(pScrn, "server");
+
+	/* the root window (and the stats properties on it) is new: */
+	pMsm->stats.published = 0;
+	xorg_list_init(&pMsm->stats.swap_drawables);
+
 	/* Set up the X visuals */
 	miClearVisualTypes();
 
@@ -440,6 +532,8 @@ MSMScreenInit(SCREEN_INIT_ARGS_DECL)
 		return FALSE;
 	}
 
+	MSMStartupPhase(pScrn, "fb init");
+
 	/* Set default colors */
 	xf86SetBlackWhitePixels(pScreen);
 
@@ -452,6 +546,8 @@ MSMScreenInit(SCREEN_INIT_ARGS_DECL)
 	if (!MSMAccelInit(pScreen))
 		ERROR_MSG("Unable to setup EXA");
 
+	MSMStartupPhase(pScrn, "accel init");
+
 	/* Set up the software cursor */
 	miDCInitialize(pScreen, xf86GetPointerScreenFuncs());
 
@@ -501,6 +597,8 @@ MSMScreenInit(SCREEN_INIT_ARGS_DECL)
 		}
 	}
 
+	MSMStartupPhase(pScrn, "screen init");
+
 	return TRUE;
 }
 
@@ -84,12 +84,15 @@ XAPrepareSolid(PixmapPtr pPixmap, int alu, Pixel planemask, Pixel fg)
 {
 	MSM_LOCALS(pPixmap);
 	struct xa_surface *dst = msm_get_pixmap_surf(pPixmap);
+	MSM_STAT_OP(pMsm, PREPARE_SOLID);
+	MSM_PROBE1(prepare_solid__entry, pPixmap);
 	EXA_FAIL_IF(!(pMsm->examask & ACCEL_SOLID));
 	EXA_FAIL_IF(planemask != FB_ALLONES);
 	EXA_FAIL_IF(alu != GXcopy);
-	if (!dst)
-		return FALSE;
-	return xa_solid_prepare(exa->ctx, dst, fg) == XA_ERR_NONE;
+	EXA_FAIL_IF(!dst);
+	EXA_FAIL_IF(xa_solid_prepare(exa->ctx, dst, fg) != XA_ERR_NONE);
+	MSM_PROBE(prepare_solid__return);
+	return TRUE;
 }
 
 /**
@@ -115,7 +118,10 @@ static void
 XASolid(PixmapPtr pPixmap, int x1, int y1, int x2, int y2)
 {
 	MSM_LOCALS(pPixmap);
+	MSM_STAT_OP(pMsm, SOLID);
+	MSM_PROBE4(solid__entry, x1, y1, x2, y2);
 	xa_solid(exa->ctx, x1, y1, x2 - x1, y2 - y1);
+	MSM_PROBE(solid__return);
 }
 
 /**
@@ -175,10 +181,13 @@ XAPrepareCopy(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int dx, int dy,
 	MSM_LOCALS(pDstPixmap);
 	struct xa_surface *src = msm_get_pixmap_surf(pSrcPixmap);
 	struct xa_surface *dst = msm_get_pixmap_surf(pDstPixmap);
+	MSM_STAT_OP(pMsm, PREPARE_COPY);
+	MSM_PROBE1(prepare_copy__entry, pDstPixmap);
 	EXA_FAIL_IF(!(pMsm->examask & ACCEL_COPY));
-	if (!(src && dst))
-		return FALSE;
-	return xa_copy_prepare(exa->ctx, dst, src) == XA_ERR_NONE;
+	EXA_FAIL_IF(!(src && dst));
+	EXA_FAIL_IF(xa_copy_prepare(exa->ctx, dst, src) != XA_ERR_NONE);
+	MSM_PROBE(prepare_copy__return);
+	return TRUE;
 }
 
 /**
@@ -210,7 +219,10 @@ XACopy(PixmapPtr pDstPixmap, int srcX, int srcY, int dstX, int dstY,
 		int width, int height)
 {
 	MSM_LOCALS(pDstPixmap);
+	MSM_STAT_OP(pMsm, COPY);
+	MSM_PROBE2(copy__entry, width, height);
 	xa_copy(exa->ctx, dstX, dstY, srcX, srcY, width, height);
+	MSM_PROBE(copy__return);
 }
 
 /**
@@ -465,6 +477,7 @@ XACheckComposite(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
 		PicturePtr pDstPicture)
 {
 	MSM_LOCALS(pDstPicture->pDrawable);
+	MSM_STAT_OP(pMsm, CHECK_COMPOSITE);
 	EXA_FAIL_IF(!(pMsm->examask & ACCEL_COMPOSITE));
 	if (!xa_setup_composite(exa, op, pSrcPicture, pMaskPicture, pDstPicture))
 		return FALSE;
@@ -533,10 +546,13 @@ XAPrepareComposite(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
 		PicturePtr pDstPicture, PixmapPtr pSrc, PixmapPtr pMask, PixmapPtr pDst)
 {
 	MSM_LOCALS(pDst);
+	MSM_STAT_OP(pMsm, PREPARE_COMPOSITE);
+	MSM_PROBE1(prepare_composite__entry, pDst);
 	EXA_FAIL_IF(!(pMsm->examask & ACCEL_COMPOSITE));
 	if (!xa_update_composite(&exa->comp, pSrc, pMask, pDst))
 		return FALSE;
 	EXA_FAIL_IF(xa_composite_prepare(exa->ctx, &exa->comp) != XA_ERR_NONE);
+	MSM_PROBE(prepare_composite__return);
 	return TRUE;
 }
 
@@ -569,8 +585,11 @@ XAComposite(PixmapPtr pDstPixmap, int srcX, int srcY, int maskX, int maskY,
 		int dstX, int dstY, int width, int height)
 {
 	MSM_LOCALS(pDstPixmap);
+	MSM_STAT_OP(pMsm, COMPOSITE);
+	MSM_PROBE2(composite__entry, width, height);
 	xa_composite_rect(exa->ctx, srcX, srcY, maskX, maskY,
 			dstX, dstY, width, height);
+	MSM_PROBE(composite__return);
 }
 
 /**
@@ -676,6 +695,9 @@ XAPrepareAccess(PixmapPtr pPixmap, int index)
 	};
 	MSM_LOCALS(pPixmap);
 
+	MSM_STAT_OP(pMsm, PREPARE_ACCESS);
+	MSM_PROBE2(prepare_access__entry, pPixmap, index);
+
 	if (pPixmap->devPrivate.ptr)
 		XAFinishAccess(pPixmap, 0);
 
@@ -683,8 +705,12 @@ XAPrepareAccess(PixmapPtr pPixmap, int index)
 		struct xa_surface *surf = msm_get_pixmap_surf(pPixmap);
 		void *ptr;
 		if (surf) {
+			/* mapping waits for the gpu: */
+			CARD64 begin = GetTimeInMicros();
 			xa_context_flush(exa->ctx);
+			pMsm->stats.flushes++;
 			ptr = xa_surface_map(exa->ctx, surf, usage[index]);
+			msm_stats_wait(pMsm, begin);
 		} else {
 			struct msm_pixmap_priv *priv =
 				exaGetPixmapDriverPrivate(pPixmap);
@@ -695,9 +721,12 @@ XAPrepareAccess(PixmapPtr pPixmap, int index)
 
 	if (!pPixmap->devPrivate.ptr) {
 		ERROR_MSG("PrepareAccess failed!!");
+		MSM_PROBE1(prepare_access__return, FALSE);
 		return FALSE;
 	}
 
+	MSM_PROBE1(prepare_access__return, TRUE);
+
 	return TRUE;
 }
 
@@ -725,6 +754,8 @@ XACreatePixmap2(ScreenPtr pScreen, int width, int height,
 	MSMPtr pMsm = MSMPTR(pScrn);
 	unsigned int flags = XA_FLAG_RENDER_TARGET;
 
+	MSM_STAT_OP(pMsm, CREATE_PIXMAP);
+
 	priv = calloc(1, sizeof(struct msm_pixmap_priv));
 
 	if (priv == NULL)
@@ -743,9 +774,9 @@ XACreatePixmap2(ScreenPtr pScreen, int width, int height,
 
 	if (priv->surf) {
 		uint32_t handle, stride;
+		/* the fd_bo is only created on demand, by msm_get_pixmap_bo(): */
 		xa_surface_handle(priv->surf, xa_handle_type_kms,
 				&handle, &stride);
-		priv->bo = fd_bo_from_handle(pMsm->dev, handle, 0);
 		*new_fb_pitch = stride;
 		return priv;
 	}
@@ -777,6 +808,9 @@ XADestroyPixmap(ScreenPtr pScreen, void *dpriv)
 	if (!priv)
 		return;
 
+	if (priv->bo)
+		fd_bo_del(priv->bo);
+
 	if (priv->surf)
 		xa_surface_unref(priv->surf);
 
@@ -793,6 +827,7 @@ void
 MSMFlushXA(MSMPtr pMsm)
 {
 	xa_context_flush(pMsm->exa->ctx);
+	pMsm->stats.flushes++;
 }
 
 Bool
@@ -39,6 +39,7 @@
 #include "msm-accel.h"
 
 #include "freedreno_z1xx.h"
+#include "msm-z1xx-blend.h"
 
 #define xFixedtoDouble(_f) (double) ((_f)/(double) xFixed1)
 
@@ -74,64 +75,6 @@ static uint32_t idis(struct exa_state *exa, uint32_t enable)
 	return exa->input;
 }
 
-/* NOTE ARGB and A8 seem to be treated the same when it comes to the
- * composite-op dwords:
- */
-static const uint32_t composite_op_dwords[4][PictOpAdd+1][4] = {
-	{ /* xRGB->xRGB */         /*           G2D_BLEND_A0            G2D_BLEND_C0 */
-		[PictOpSrc]          = { 0x7c000114, 0x10002010, 0x00000000, 0x18012210 },
-		[PictOpIn]           = { 0x7c000114, 0xb0100004, 0x00000000, 0x18110a04 },
-		[PictOpOut]          = { 0x7c000114, 0xb0102004, 0x00000000, 0x18112a04 },
-		[PictOpOver]         = { 0x7c000114, 0xd080a004, 0x7c000118, 0x8081aa04 },
-		[PictOpOutReverse]   = { 0x7c000114, 0x80808040, 0x7c000118, 0x80808840 },
-		[PictOpAdd]          = { 0x7c000114, 0x5080a004, 0x7c000118, 0x20818204 },
-		[PictOpOverReverse]  = { 0x7c000114, 0x7090a004, 0x7c000118, 0x2091a204 },
-		[PictOpInReverse]    = { 0x7c000114, 0x80800040, 0x7c000118, 0x80800840 },
-		[PictOpAtop]         = { 0x7c000114, 0xf0908004, 0x7c000118, 0xa0918a04 },
-		[PictOpAtopReverse]  = { 0x7c000114, 0xf0902004, 0x7c000118, 0xa0912a04 },
-		[PictOpXor]          = { 0x7c000114, 0xf090a004, 0x7c000118, 0xa091aa04 },
-	},
-	{ /* xRGB->ARGB, xRGB->A8 */
-		[PictOpSrc]          = { 0x7c000114, 0x10002010, 0x00000000, 0x18012210 },
-		[PictOpIn]           = { 0x7c000114, 0x90100004, 0x00000000, 0x18110a04 },
-		[PictOpOut]          = { 0x7c000114, 0x90102004, 0x00000000, 0x18112a04 },
-		[PictOpOver]         = { 0x7c000114, 0x9080a004, 0x7c000118, 0x8081aa04 },
-		[PictOpOutReverse]   = { 0x7c000114, 0x80808040, 0x7c000118, 0x80808840 },
-		[PictOpAdd]          = { 0x7c000114, 0x1080a004, 0x7c000118, 0x20818204 },
-		[PictOpOverReverse]  = { 0x7c000114, 0x1090a004, 0x00000000, 0x1891a204 },
-		[PictOpInReverse]    = { 0x7c000114, 0x80800040, 0x7c000118, 0x80800840 },
-		[PictOpAtop]         = { 0x7c000114, 0x90908004, 0x7c000118, 0x80918a04 },
-		[PictOpAtopReverse]  = { 0x7c000114, 0x90902004, 0x7c000118, 0x80912a04 },
-		[PictOpXor]          = { 0x7c000114, 0x9090a004, 0x7c000118, 0x8091aa04 },
-	},
-	{ /* ARGB->xRGB, A8->xRGB */
-		[PictOpSrc]          = { 0x00000000, 0x14012010, 0x00000000, 0x18012210 },
-		[PictOpIn]           = { 0x7c000114, 0x20110004, 0x00000000, 0x18110a04 },
-		[PictOpOut]          = { 0x7c000114, 0x20112004, 0x00000000, 0x18112a04 },
-		[PictOpOver]         = { 0x7c000114, 0x4281a004, 0x7c000118, 0x0281aa04 },
-		[PictOpOutReverse]   = { 0x7c000114, 0x02808040, 0x7c000118, 0x02808840 },
-		[PictOpAdd]          = { 0x7c000114, 0x4081a004, 0x00000000, 0x18898204 },
-		[PictOpOverReverse]  = { 0x7c000114, 0x6091a004, 0x7c000118, 0x2091a204 },
-		[PictOpInReverse]    = { 0x7c000114, 0x02800040, 0x7c000118, 0x02800840 },
-		[PictOpAtop]         = { 0x7c000114, 0x62918004, 0x7c000118, 0x22918a04 },
-		[PictOpAtopReverse]  = { 0x7c000114, 0x62912004, 0x7c000118, 0x22912a04 },
-		[PictOpXor]          = { 0x7c000114, 0x6291a004, 0x7c000118, 0x2291aa04 },
-	},
-	{ /* ARGB->ARGB, A8->A8 */
-		[PictOpSrc]          = { 0x00000000, 0x14012010, 0x00000000, 0x18012210 },
-		[PictOpIn]           = { 0x00000000, 0x14110004, 0x00000000, 0x18110a04 },
-		[PictOpOut]          = { 0x00000000, 0x14112004, 0x00000000, 0x18112a04 },
-		[PictOpOver]         = { 0x7c000114, 0x0281a004, 0x7c000118, 0x0281aa04 },
-		[PictOpOutReverse]   = { 0x7c000114, 0x02808040, 0x7c000118, 0x02808840 },
-		[PictOpAdd]          = { 0x00000000, 0x1481a004, 0x00000000, 0x18898204 },
-		[PictOpOverReverse]  = { 0x00000000, 0x1491a004, 0x00000000, 0x1891a204 },
-		[PictOpInReverse]    = { 0x7c000114, 0x02800040, 0x7c000118, 0x02800840 },
-		[PictOpAtop]         = { 0x7c000114, 0x02918004, 0x7c000118, 0x02918a04 },
-		[PictOpAtopReverse]  = { 0x7c000114, 0x02912004, 0x7c000118, 0x02912a04 },
-		[PictOpXor]          = { 0x7c000114, 0x0291a004, 0x7c000118, 0x0291aa04 },
-	},
-};
-
 static inline enum g2d_format
 pixfmt(PixmapPtr pix)
 {
@@ -231,6 +174,9 @@ MSMPrepareSolid(PixmapPtr pPixmap, int alu, Pixel planemask, Pixel fg)
 {
 	MSM_LOCALS(pPixmap);
 
+	MSM_STAT_OP(pMsm, PREPARE_SOLID);
+	MSM_PROBE1(prepare_solid__entry, pPixmap);
+
 	EXA_FAIL_IF(!(pMsm->examask & ACCEL_SOLID));
 	EXA_FAIL_IF(planemask != FB_ALLONES);
 	EXA_FAIL_IF(alu != GXcopy);
@@ -249,6 +195,8 @@ MSMPrepareSolid(PixmapPtr pPixmap, int alu, Pixel planemask, Pixel fg)
 
 	 */
 
+	MSM_PROBE(prepare_solid__return);
+
 	return TRUE;
 }
 
@@ -276,6 +224,9 @@ MSMSolid(PixmapPtr pPixmap, int x1, int y1, int x2, int y2)
 {
 	MSM_LOCALS(pPixmap);
 
+	MSM_STAT_OP(pMsm, SOLID);
+	MSM_PROBE4(solid__entry, x1, y1, x2, y2);
+
 	TRACE_EXA("SOLID: x1=%d\ty1=%d\tx2=%d\ty2=%d\tfill=%08x",
 			x1, y1, x2, y2, exa->fill);
 
@@ -294,6 +245,8 @@ MSMSolid(PixmapPtr pPixmap, int x1, int y1, int x2, int y2)
 	OUT_RING  (ring, REGM(G2D_COLOR, 1));
 	OUT_RING  (ring, exa->fill);
 	END_RING  (pMsm);
+
+	MSM_PROBE(solid__return);
 }
 
 /**
@@ -351,6 +304,9 @@ MSMPrepareCopy(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int dx, int dy,
 {
 	MSM_LOCALS(pDstPixmap);
 
+	MSM_STAT_OP(pMsm, PREPARE_COPY);
+	MSM_PROBE1(prepare_copy__entry, pDstPixmap);
+
 	EXA_FAIL_IF(!(pMsm->examask & ACCEL_COPY));
 	EXA_FAIL_IF(planemask != FB_ALLONES);
 	EXA_FAIL_IF(alu != GXcopy);
@@ -361,6 +317,8 @@ MSMPrepareCopy(PixmapPtr pSrcPixmap, PixmapPtr pDstPixmap, int dx, int dy,
 
 	exa->src = pSrcPixmap;
 
+	MSM_PROBE(prepare_copy__return);
+
 	return TRUE;
 }
 
@@ -395,6 +353,9 @@ MSMCopy(PixmapPtr pDstPixmap, int srcX, int srcY, int dstX, int dstY,
 	MSM_LOCALS(pDstPixmap);
 	PixmapPtr pSrcPixmap = exa->src;
 
+	MSM_STAT_OP(pMsm, COPY);
+	MSM_PROBE2(copy__entry, width, height);
+
 	TRACE_EXA("COPY: srcX=%d\tsrcY=%d\tdstX=%d\tdstY=%d\twidth=%d\theight=%d",
 			srcX, srcY, dstX, dstY, width, height);
 
@@ -432,6 +393,8 @@ MSMCopy(PixmapPtr pDstPixmap, int srcX, int srcY, int dstX, int dstY,
 	OUT_RING  (ring, REG(G2D_GRADIENT) | 0x0);
 	OUT_RING  (ring, REG(G2D_GRADIENT) | 0x0);
 	END_RING  (pMsm);
+
+	MSM_PROBE(copy__return);
 }
 
 /**
@@ -484,6 +447,8 @@ MSMCheckComposite(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
 	MSM_LOCALS(pDstPicture->pDrawable);
 	int idx = 0;
 
+	MSM_STAT_OP(pMsm, CHECK_COMPOSITE);
+
 	EXA_FAIL_IF(!(pMsm->examask & ACCEL_COMPOSITE));
 
 	// TODO proper handling for RGB vs BGR!
@@ -517,9 +482,9 @@ MSMCheckComposite(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
 	EXA_FAIL_IF(pSrcPicture->transform);
 
 	if (PICT_FORMAT_A(pSrcPicture->format))
-		idx += 2;
+		idx |= COMPOSITE_SRC_ALPHA;
 	if (PICT_FORMAT_A(pDstPicture->format))
-		idx += 1;
+		idx |= COMPOSITE_DST_ALPHA;
 
 	/* check for unsupported op: */
 	EXA_FAIL_IF((op >= ARRAY_SIZE(composite_op_dwords[idx])) ||
@@ -595,6 +560,9 @@ MSMPrepareComposite(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
 {
 	MSM_LOCALS(pDst);
 
+	MSM_STAT_OP(pMsm, PREPARE_COMPOSITE);
+	MSM_PROBE1(prepare_composite__entry, pDst);
+
 	EXA_FAIL_IF(!(pMsm->examask & ACCEL_COMPOSITE));
 
 	// TODO, maybe we can support this.. pSrcPicture could be telling
@@ -607,6 +575,8 @@ MSMPrepareComposite(int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
 	exa->src  = pSrc;
 	exa->mask = pMask;
 
+	MSM_PROBE(prepare_composite__return);
+
 	return TRUE;
 }
 
@@ -642,6 +612,9 @@ MSMComposite(PixmapPtr pDstPixmap, int srcX, int srcY, int maskX, int maskY,
 	PixmapPtr pSrcPixmap = exa->src;
 	PixmapPtr pMaskPixmap = exa->mask;
 
+	MSM_STAT_OP(pMsm, COMPOSITE);
+	MSM_PROBE2(composite__entry, width, height);
+
 	TRACE_EXA("COMPOSITE: srcX=%d\tsrcY=%d\tmaskX=%d\tmaskY=%d\t"
 			"dstX=%d\tdstY=%d\twidth=%d\theight=%d\t"
 			"srcformat=%08x\tdstformat=%08x",
@@ -741,6 +714,8 @@ MSMComposite(PixmapPtr pDstPixmap, int srcX, int srcY, int maskX, int maskY,
 	OUT_RING  (ring, REG(G2D_GRADIENT) | 0x0);
 	OUT_RING  (ring, REG(G2D_GRADIENT) | 0x0);
 	END_RING  (pMsm);
+
+	MSM_PROBE(composite__return);
 }
 
 /**
@@ -805,7 +780,7 @@ MSMWaitMarker(ScreenPtr pScreen, int marker)
 	if (pMsm->pipe) {
 		FIRE_RING(pMsm);
 		TRACE_EXA("WAIT: %d", pMsm->ring.timestamp);
-		fd_pipe_wait(pMsm->pipe, pMsm->ring.timestamp);
+		msm_pipe_wait(pMsm, pMsm->ring.timestamp);
 	}
 }
 
@@ -841,17 +816,24 @@ MSMPrepareAccess(PixmapPtr pPixmap, int index)
 	MSM_LOCALS(pPixmap);
 	struct msm_pixmap_priv *priv;
 
+	MSM_STAT_OP(pMsm, PREPARE_ACCESS);
+	MSM_PROBE2(prepare_access__entry, pPixmap, index);
+
 	priv = exaGetPixmapDriverPrivate(pPixmap);
 
-	if (!priv)
+	if (!priv) {
+		MSM_PROBE1(prepare_access__return, FALSE);
 		return FALSE;
+	}
 
-	if (!priv->bo)
-		return TRUE;
-
-	fd_bo_cpu_prep(priv->bo, pMsm->pipe, usage[index]);
+	if (priv->bo) {
+		msm_bo_cpu_prep(pMsm, priv->bo, usage[index]);
+		pPixmap->devPrivate.ptr = fd_bo_map(priv->bo);
+		if (msm_trace_active && (usage[index] & DRM_FREEDRENO_PREP_WRITE))
+			msm_capture_cpu_write(priv->bo);
+	}
 
-	pPixmap->devPrivate.ptr = fd_bo_map(priv->bo);
+	MSM_PROBE1(prepare_access__return, TRUE);
 
 	return TRUE;
 }
@@ -878,8 +860,11 @@ MSMCreatePixmap2(ScreenPtr pScreen, int width, int height,
 	struct msm_pixmap_priv *priv;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	MSMPtr pMsm = MSMPTR(pScrn);
+	uint32_t flags;
 	int pitch, size;
 
+	MSM_STAT_OP(pMsm, CREATE_PIXMAP);
+
 	pitch = MSMAlignedStride(width, bpp);
 	size = pitch * height;
 
@@ -893,16 +878,11 @@ MSMCreatePixmap2(ScreenPtr pScreen, int width, int height,
 	if (!size)
 		return priv;
 
-	if (usage_hint & CREATE_PIXMAP_USAGE_DRI2) {
-		priv->bo = fd_bo_new(pMsm->dev, size,
-				DRM_FREEDRENO_GEM_TYPE_KMEM |
-				DRM_FREEDRENO_GEM_TYPE_SMI);
-	}
+	flags = DRM_FREEDRENO_GEM_TYPE_KMEM;
+	if (usage_hint & CREATE_PIXMAP_USAGE_DRI2)
+		flags |= DRM_FREEDRENO_GEM_TYPE_SMI;  /* if there is any left */
 
-	if (!priv->bo) {
-		priv->bo = fd_bo_new(pMsm->dev, size,
-				DRM_FREEDRENO_GEM_TYPE_KMEM);
-	}
+	priv->bo = msm_bo_new(pMsm, size, flags);
 
 	if (priv->bo)
 		return priv;
@@ -954,13 +934,23 @@ MSMSetupExa(ScreenPtr pScreen, Bool softexa)
 	ExaDriverPtr pExa;
 
 	if (!softexa) {
-		pMsm->ring.context_bos[0] = fd_bo_new(pMsm->dev, 0x1000,
+		/* the gpu's context buffers (see ring_state()), sized like the
+		 * ones libC2D2 allocates.  What the gpu keeps in them, and so
+		 * how much of them it actually uses, is unknown:
+		 */
+		pMsm->ring.context_bos[0] = msm_bo_new(pMsm, 0x1000,
 				DRM_FREEDRENO_GEM_TYPE_KMEM);
-		pMsm->ring.context_bos[1] = fd_bo_new(pMsm->dev, 0x9000,
+		pMsm->ring.context_bos[1] = msm_bo_new(pMsm, 0x9000,
 				DRM_FREEDRENO_GEM_TYPE_KMEM);
-		pMsm->ring.context_bos[2] = fd_bo_new(pMsm->dev, 0x81000,
+		pMsm->ring.context_bos[2] = msm_bo_new(pMsm, 0x81000,
 				DRM_FREEDRENO_GEM_TYPE_KMEM);
 
+		/* before the first ring, to see the relocs in its state: */
+		if (pMsm->TraceFile)
+			msm_trace_init(pScrn, pMsm->TraceFile);
+		if (pMsm->CaptureFile)
+			msm_capture_init(pScrn, pMsm->CaptureFile);
+
 		/* Set up ringbuffers: */
 		next_ring(pMsm);
 		ring = pMsm->ring.ring;
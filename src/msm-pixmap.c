@@ -46,13 +46,19 @@ msm_get_pixmap_bo(PixmapPtr pix)
 		return priv->bo;
 
 #ifdef HAVE_XA
-	/* we should only hit this path for pageflip/dri2 (in which case
-	 * the buffer is already exported to an flink name):
+	/* we should only hit this path for pageflip/dri2/dri3.  Open the
+	 * surface via its flink name rather than wrapping XA's GEM handle,
+	 * so that we get our own handle (and the real size) and the bo can
+	 * be released independently of the surface.  (A dma-buf import on
+	 * the same fd would just hand back XA's handle again.)  The bo is
+	 * cached in the priv, so this only happens once per pixmap:
 	 */
 	if (priv && priv->surf) {
 		MSMPtr pMsm = MSMPTR_FROM_PIXMAP(pix);
 		uint32_t name, stride;
-		xa_surface_handle(priv->surf, xa_handle_type_shared, &name, &stride);
+		if (xa_surface_handle(priv->surf, xa_handle_type_shared,
+				&name, &stride))
+			return NULL;
 		priv->bo = fd_bo_from_name(pMsm->dev, name);
 		return priv->bo;
 	}
@@ -87,6 +93,9 @@ msm_set_pixmap_bo(PixmapPtr pix, struct fd_bo *bo)
 				type = (pix->drawable.bitsPerPixel > 8) ?
 						xa_type_argb : xa_type_a;
 
+				/* go via the flink name so XA opens its own handle,
+				 * rather than sharing (and later closing) ours:
+				 */
 				fd_bo_get_name(bo, &name);
 
 				priv->surf = xa_surface_from_handle(pMsm->xa,
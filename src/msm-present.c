@@ -0,0 +1,276 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "msm.h"
+
+#include "xf86drmMode.h"
+#include "list.h"
+#include "present.h"
+
+#include <errno.h>
+
+/*
+ * Present extension support.  Vblank and flip events are queued up
+ * through drmmode_display.c, which calls back into us from the DRM
+ * event handler.  We keep our own list of outstanding events, since
+ * there is no way to cancel an event once it is queued in the kernel,
+ * so aborted events are just flagged and dropped when they complete.
+ */
+
+struct msm_present_event {
+	struct xorg_list link;
+	uint64_t event_id;
+	Bool aborted;
+};
+
+static struct xorg_list msm_present_events;
+
+static struct msm_present_event *
+msm_present_event_new(uint64_t event_id)
+{
+	struct msm_present_event *event = calloc(1, sizeof(*event));
+
+	if (!event)
+		return NULL;
+
+	event->event_id = event_id;
+	xorg_list_add(&event->link, &msm_present_events);
+
+	return event;
+}
+
+static void
+msm_present_event_free(struct msm_present_event *event)
+{
+	xorg_list_del(&event->link);
+	free(event);
+}
+
+static void
+msm_present_event_handler(uint64_t msc, uint64_t ust, void *data)
+{
+	struct msm_present_event *event = data;
+
+	if (!event->aborted)
+		present_event_notify(event->event_id, ust, msc);
+
+	msm_present_event_free(event);
+}
+
+static RRCrtcPtr
+msm_present_get_crtc(WindowPtr window)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(window->drawable.pScreen);
+	xf86CrtcPtr crtc;
+	BoxRec box;
+
+	box.x1 = window->drawable.x;
+	box.y1 = window->drawable.y;
+	box.x2 = box.x1 + window->drawable.width;
+	box.y2 = box.y1 + window->drawable.height;
+
+	crtc = drmmode_covering_crtc(pScrn, &box);
+	if (!crtc)
+		return NULL;
+
+	return crtc->randr_crtc;
+}
+
+static int
+msm_present_get_ust_msc(RRCrtcPtr crtc, CARD64 *ust, CARD64 *msc)
+{
+	xf86CrtcPtr xf86_crtc = crtc->devPrivate;
+	uint64_t u, m;
+
+	if (!drmmode_crtc_get_ust_msc(xf86_crtc, &u, &m))
+		return BadMatch;
+
+	*ust = u;
+	*msc = m;
+
+	return Success;
+}
+
+static int
+msm_present_queue_vblank(RRCrtcPtr crtc, uint64_t event_id, uint64_t msc)
+{
+	xf86CrtcPtr xf86_crtc = crtc->devPrivate;
+	struct msm_present_event *event;
+
+	event = msm_present_event_new(event_id);
+	if (!event)
+		return BadAlloc;
+
+	if (!drmmode_queue_vblank(xf86_crtc, msc,
+			msm_present_event_handler, event)) {
+		msm_present_event_free(event);
+		return BadAlloc;
+	}
+
+	return Success;
+}
+
+static void
+msm_present_abort_vblank(RRCrtcPtr crtc, uint64_t event_id, uint64_t msc)
+{
+	struct msm_present_event *event;
+
+	xorg_list_for_each_entry(event, &msm_present_events, link) {
+		if (event->event_id == event_id) {
+			event->aborted = TRUE;
+			break;
+		}
+	}
+}
+
+static void
+msm_present_flush(WindowPtr window)
+{
+	MSMFlushAccel(window->drawable.pScreen);
+}
+
+static Bool
+msm_present_check_flip(RRCrtcPtr crtc, WindowPtr window, PixmapPtr pixmap,
+		Bool sync_flip)
+{
+	ScreenPtr pScreen = window->drawable.pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	PixmapPtr screen_pixmap = pScreen->GetScreenPixmap(pScreen);
+
+	if (!drmmode_can_flip(pScrn))
+		return FALSE;
+
+	if (!sync_flip && !drmmode_can_async_flip(pScrn))
+		return FALSE;
+
+	/* the new fb is created with the geometry of the screen pixmap: */
+	if ((pixmap->drawable.width != screen_pixmap->drawable.width) ||
+			(pixmap->drawable.height != screen_pixmap->drawable.height) ||
+			(pixmap->drawable.bitsPerPixel != screen_pixmap->drawable.bitsPerPixel) ||
+			(exaGetPixmapPitch(pixmap) != exaGetPixmapPitch(screen_pixmap)))
+		return FALSE;
+
+	if (!msm_get_pixmap_bo(pixmap))
+		return FALSE;
+
+	return TRUE;
+}
+
+static Bool
+msm_present_flip(RRCrtcPtr crtc, uint64_t event_id, uint64_t target_msc,
+		PixmapPtr pixmap, Bool sync_flip)
+{
+	ScreenPtr pScreen = pixmap->drawable.pScreen;
+	struct msm_present_event *event;
+
+	if (!msm_present_check_flip(crtc, pScreen->root, pixmap, sync_flip))
+		return FALSE;
+
+	event = msm_present_event_new(event_id);
+	if (!event)
+		return FALSE;
+
+	/* make sure rendering to the pixmap is submitted before the flip: */
+	MSMFlushAccel(pScreen);
+
+	if (!drmmode_page_flip(&pixmap->drawable, pixmap, !sync_flip,
+			msm_present_event_handler, event)) {
+		msm_present_event_free(event);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+msm_present_unflip(ScreenPtr pScreen, uint64_t event_id)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	MSMPtr pMsm = MSMPTR(pScrn);
+	PixmapPtr pixmap = pScreen->GetScreenPixmap(pScreen);
+	struct msm_present_event *event;
+
+	event = msm_present_event_new(event_id);
+	if (!event)
+		return;
+
+	if (drmmode_can_flip(pScrn) &&
+			drmmode_page_flip(&pixmap->drawable, pixmap, FALSE,
+					msm_present_event_handler, event))
+		return;
+
+	/* flipping back failed, so fall back to a modeset to get the
+	 * screen pixmap back on the display:
+	 */
+	pMsm->scanout = msm_get_pixmap_bo(pixmap);
+	drmmode_remove_fb(pScrn);
+	if (pScrn->vtSema)
+		xf86SetDesiredModes(pScrn);
+
+	present_event_notify(event_id, 0, 0);
+	msm_present_event_free(event);
+}
+
+static present_screen_info_rec msm_present_screen_info = {
+		.version = PRESENT_SCREEN_INFO_VERSION,
+
+		.get_crtc = msm_present_get_crtc,
+		.get_ust_msc = msm_present_get_ust_msc,
+		.queue_vblank = msm_present_queue_vblank,
+		.abort_vblank = msm_present_abort_vblank,
+		.flush = msm_present_flush,
+
+		.capabilities = PresentCapabilityNone,
+		.check_flip = msm_present_check_flip,
+		.flip = msm_present_flip,
+		.unflip = msm_present_unflip,
+};
+
+/**
+ * The Present ScreenInit() function.. register our handler fxns w/
+ * Present core.
+ */
+Bool
+MSMPresentScreenInit(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+
+	if (!msm_present_events.next)
+		xorg_list_init(&msm_present_events);
+
+	if (drmmode_can_async_flip(pScrn))
+		msm_present_screen_info.capabilities |= PresentCapabilityAsync;
+
+	if (!present_screen_init(pScreen, &msm_present_screen_info)) {
+		WARNING_MSG("Present initialization failed");
+		return FALSE;
+	}
+
+	INFO_MSG("Present enabled");
+
+	return TRUE;
+}
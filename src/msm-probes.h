@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MSM_PROBES_H_
+#define MSM_PROBES_H_
+
+/*
+ * Static tracepoints (USDT, as used by systemtap, perf and bpftrace) on
+ * the hot paths, built with --enable-probes.  Otherwise they compile to
+ * nothing.  The provider is "freedreno", and the probes come in
+ * foo__entry/foo__return pairs (shown as foo-entry/foo-return by most
+ * tools):
+ *
+ *   prepare_solid, prepare_copy, prepare_composite:
+ *       entry(pixmap), return() on success, otherwise the hook ends at
+ *       an exa_fallback(func, cond) probe instead
+ *   solid(x1, y1, x2, y2), copy(width, height), composite(width, height):
+ *       entry(args), return()
+ *   prepare_access(pixmap, index), return(ret)
+ *   fire_ring(), return(timestamp)           flush of the z1xx ring
+ *   pipe_wait(timestamp), return(timestamp)  waiting for the gpu..
+ *   bo_cpu_prep(handle, op), return(ret)     ..or for a bo to be idle
+ *   dri2_swap_schedule(drawable, cmd), return(ret)
+ *   dri2_swap_complete(drawable, cmd, type, frame)   (single probe)
+ *   flip_handler(crtc, frame, usec), return()   page flip event
+ *
+ * eg. a histogram of the time spent in PrepareAccess():
+ *
+ *   bpftrace -e '
+ *     usdt:$DRV:freedreno:prepare_access__entry { @t[tid] = nsecs; }
+ *     usdt:$DRV:freedreno:prepare_access__return /@t[tid]/ {
+ *       @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+ *
+ * where $DRV is the path to freedreno_drv.so.
+ */
+
+#ifdef HAVE_PROBES
+
+#include <sys/sdt.h>
+
+#define MSM_PROBE(name)                  DTRACE_PROBE(freedreno, name)
+#define MSM_PROBE1(name, a)              DTRACE_PROBE1(freedreno, name, a)
+#define MSM_PROBE2(name, a, b)           DTRACE_PROBE2(freedreno, name, a, b)
+#define MSM_PROBE3(name, a, b, c)        DTRACE_PROBE3(freedreno, name, a, b, c)
+#define MSM_PROBE4(name, a, b, c, d)     DTRACE_PROBE4(freedreno, name, a, b, c, d)
+
+#else
+
+#define MSM_PROBE(name)                  do { } while (0)
+#define MSM_PROBE1(name, a)              do { } while (0)
+#define MSM_PROBE2(name, a, b)           do { } while (0)
+#define MSM_PROBE3(name, a, b, c)        do { } while (0)
+#define MSM_PROBE4(name, a, b, c, d)     do { } while (0)
+
+#endif
+
+#endif /* MSM_PROBES_H_ */
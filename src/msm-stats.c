@@ -0,0 +1,441 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <X11/Xatom.h>
+#include "property.h"
+
+#include "msm.h"
+#include "msm-accel.h"
+
+/*
+ * Runtime statistics: which EXA hooks get called, which EXA_FAIL_IF()
+ * conditions send us to sw fallbacks, what the ring/bo traffic looks
+ * like, and how DRI2 swaps are done.  The counters are always collected;
+ * with Option "Stats" they are published as text in the _FREEDRENO_STATS
+ * property of the root window (at most once a second), ie:
+ *
+ *   xprop -root -notype _FREEDRENO_STATS
+ *
+ * The swap stats of each DRI2 drawable which swapped are published along
+ * with them, in the _FREEDRENO_SWAP_STATS property of the root window
+ * (one "drawable <id>" section each), rather than on the windows, which
+ * belong to the clients.  Changes which come in less than a second after
+ * the last update are published from a timer, so the properties don't
+ * go stale once the server goes idle.  Histograms are printed as
+ * "<bound:count" for each non-empty bucket.
+ */
+
+#define PUBLISH_INTERVAL_US  1000000
+
+static const char *op_names[MSM_STAT_NUM_OPS] = {
+	[MSM_STAT_PREPARE_SOLID]     = "PrepareSolid",
+	[MSM_STAT_SOLID]             = "Solid",
+	[MSM_STAT_PREPARE_COPY]      = "PrepareCopy",
+	[MSM_STAT_COPY]              = "Copy",
+	[MSM_STAT_CHECK_COMPOSITE]   = "CheckComposite",
+	[MSM_STAT_PREPARE_COMPOSITE] = "PrepareComposite",
+	[MSM_STAT_COMPOSITE]         = "Composite",
+	[MSM_STAT_PREPARE_ACCESS]    = "PrepareAccess",
+	[MSM_STAT_CREATE_PIXMAP]     = "CreatePixmap",
+};
+
+static const char *swap_names[MSM_SWAP_NUM_TYPES] = {
+	[MSM_SWAP_FLIP]     = "flip",
+	[MSM_SWAP_PLANE]    = "plane",
+	[MSM_SWAP_EXCHANGE] = "exchange",
+	[MSM_SWAP_BLIT]     = "blit",
+};
+
+/* the fallback sites don't know which screen they are for, so these are
+ * shared by all screens:
+ */
+static struct msm_fallback *fallbacks;
+static CARD64 fallback_total;
+
+void
+msm_stats_fallback(struct msm_fallback *fallback)
+{
+	if (!fallback->count++) {
+		fallback->next = fallbacks;
+		fallbacks = fallback;
+	}
+	fallback_total++;
+}
+
+CARD64
+msm_stats_wait(MSMPtr pMsm, CARD64 begin)
+{
+	CARD64 us = GetTimeInMicros() - begin;
+
+	pMsm->stats.waits++;
+	pMsm->stats.wait_us += us;
+
+	return us;
+}
+
+/* returns how long it waited, in usec: */
+CARD64
+msm_pipe_wait(MSMPtr pMsm, uint32_t timestamp)
+{
+	CARD64 begin = GetTimeInMicros();
+	MSM_PROBE1(pipe_wait__entry, timestamp);
+	fd_pipe_wait(pMsm->pipe, timestamp);
+	MSM_PROBE1(pipe_wait__return, timestamp);
+	return msm_stats_wait(pMsm, begin);
+}
+
+int
+msm_bo_cpu_prep(MSMPtr pMsm, struct fd_bo *bo, uint32_t op)
+{
+	CARD64 begin = GetTimeInMicros();
+	int ret;
+
+	MSM_PROBE2(bo_cpu_prep__entry, fd_bo_handle(bo), op);
+	ret = fd_bo_cpu_prep(bo, pMsm->pipe, op);
+	MSM_PROBE1(bo_cpu_prep__return, ret);
+
+	/* a NOSYNC prep is just a poll, it never waits: */
+	if (!(op & DRM_FREEDRENO_PREP_NOSYNC))
+		msm_stats_wait(pMsm, begin);
+	return ret;
+}
+
+struct fd_bo *
+msm_bo_new(MSMPtr pMsm, uint32_t size, uint32_t flags)
+{
+	struct fd_bo *bo = fd_bo_new(pMsm->dev, size, flags);
+	if (!bo && (flags & DRM_FREEDRENO_GEM_TYPE_SMI)) {
+		/* SMI is only a preference, so only the KMEM fallback failing
+		 * means memory is tight:
+		 */
+		bo = fd_bo_new(pMsm->dev, size,
+				(flags & ~DRM_FREEDRENO_GEM_TYPE_SMI) |
+				DRM_FREEDRENO_GEM_TYPE_KMEM);
+	}
+	if (bo) {
+		pMsm->stats.bo_allocs++;
+		pMsm->stats.bo_bytes += size;
+	} else {
+		/* memory is tight, so give back what we can: */
+		pMsm->ring.pressure = TRUE;
+	}
+	return bo;
+}
+
+void
+msm_hist_add(struct msm_hist *hist, CARD64 val)
+{
+	int i;
+
+	for (i = 0; (i < MSM_HIST_BUCKETS - 1) && (val >> i); i++)
+		;
+
+	hist->buckets[i]++;
+	hist->count++;
+	hist->sum += val;
+	if (val > hist->max)
+		hist->max = val;
+}
+
+/* account a completed swap, in the per-screen stats, and the per-drawable
+ * ones (if the drawable still exists).  missed is negative if unknown:
+ */
+void
+msm_stats_swap(MSMPtr pMsm, struct msm_swap_stats *stats,
+		enum msm_swap_type type, CARD64 latency, int missed)
+{
+	msm_hist_add(&pMsm->stats.swap.latency[type], latency);
+	if (missed >= 0)
+		msm_hist_add(&pMsm->stats.swap.missed, missed);
+
+	if (!stats)
+		return;
+
+	msm_hist_add(&stats->latency[type], latency);
+	if (missed >= 0)
+		msm_hist_add(&stats->missed, missed);
+}
+
+static CARD64
+swap_count(struct msm_swap_stats *stats)
+{
+	CARD64 count = 0;
+	int i;
+
+	for (i = 0; i < MSM_SWAP_NUM_TYPES; i++)
+		count += stats->latency[i].count;
+
+	return count;
+}
+
+/* called when a DRI2 drawable is created, and when it is destroyed: */
+void
+msm_stats_swap_add(MSMPtr pMsm, struct msm_swap_stats *stats, XID id)
+{
+	stats->id = id;
+	xorg_list_append(&stats->link, &pMsm->stats.swap_drawables);
+}
+
+void
+msm_stats_swap_del(MSMPtr pMsm, struct msm_swap_stats *stats)
+{
+	xorg_list_del(&stats->link);
+
+	/* so that it gets dropped from _FREEDRENO_SWAP_STATS: */
+	if (swap_count(stats))
+		pMsm->stats.swap_gone++;
+}
+
+struct stats_buf {
+	char *str;
+	int len, size;
+};
+
+static void
+stats_printf(struct stats_buf *buf, const char *fmt, ...)
+{
+	va_list ap;
+	char *str;
+	int n;
+
+	while (buf->str) {
+		va_start(ap, fmt);
+		n = vsnprintf(buf->str + buf->len, buf->size - buf->len, fmt, ap);
+		va_end(ap);
+
+		if (n < (buf->size - buf->len)) {
+			buf->len += n;
+			return;
+		}
+
+		buf->size = 2 * buf->size + n;
+		str = realloc(buf->str, buf->size);
+		if (!str)
+			free(buf->str);
+		buf->str = str;
+	}
+}
+
+static void
+stats_print_hist(struct stats_buf *buf, const char *name,
+		struct msm_hist *hist)
+{
+	int i;
+
+	stats_printf(buf, "%s count %llu sum %llu max %llu", name,
+			(unsigned long long)hist->count,
+			(unsigned long long)hist->sum,
+			(unsigned long long)hist->max);
+
+	for (i = 0; i < MSM_HIST_BUCKETS; i++) {
+		if (!hist->buckets[i])
+			continue;
+		if (i == (MSM_HIST_BUCKETS - 1)) {
+			stats_printf(buf, " >=%llu:%llu", 1ULL << (i - 1),
+					(unsigned long long)hist->buckets[i]);
+		} else {
+			stats_printf(buf, " <%llu:%llu", 1ULL << i,
+					(unsigned long long)hist->buckets[i]);
+		}
+	}
+
+	stats_printf(buf, "\n");
+}
+
+static void
+stats_print_swaps(struct stats_buf *buf, struct msm_swap_stats *stats)
+{
+	char name[32];
+	int i;
+
+	for (i = 0; i < MSM_SWAP_NUM_TYPES; i++)
+		stats_printf(buf, "swaps %s %llu\n", swap_names[i],
+				(unsigned long long)stats->latency[i].count);
+
+	for (i = 0; i < MSM_SWAP_NUM_TYPES; i++) {
+		if (!stats->latency[i].count)
+			continue;
+		snprintf(name, sizeof(name), "swap_latency_us %s", swap_names[i]);
+		stats_print_hist(buf, name, &stats->latency[i]);
+	}
+
+	if (stats->missed.count)
+		stats_print_hist(buf, "missed_vblanks", &stats->missed);
+}
+
+static void
+stats_publish(WindowPtr pWin, const char *name, struct stats_buf *buf)
+{
+	if (!buf->str)
+		return;
+
+	dixChangeWindowProperty(serverClient, pWin,
+			MakeAtom(name, strlen(name), TRUE), XA_STRING, 8,
+			PropModeReplace, buf->len, buf->str, TRUE);
+
+	free(buf->str);
+}
+
+static void
+stats_publish_swaps(ScreenPtr pScreen, MSMPtr pMsm)
+{
+	struct stats_buf buf = {0};
+	struct msm_swap_stats *stats;
+
+	if (!swap_count(&pMsm->stats.swap))
+		return;
+
+	buf.size = 1024;
+	buf.str = malloc(buf.size);
+
+	xorg_list_for_each_entry(stats, &pMsm->stats.swap_drawables, link) {
+		if (!swap_count(stats))
+			continue;
+		stats_printf(&buf, "drawable 0x%lx\n", (unsigned long)stats->id);
+		stats_print_swaps(&buf, stats);
+	}
+
+	stats_publish(pScreen->root, "_FREEDRENO_SWAP_STATS", &buf);
+}
+
+static CARD32
+stats_timer(OsTimerPtr timer, CARD32 time, pointer arg)
+{
+	MSMStatsUpdate(arg);
+	return 0;
+}
+
+/* called from the BlockHandler, and the timer: */
+void
+MSMStatsUpdate(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	MSMPtr pMsm = MSMPTR(pScrn);
+	struct stats_buf buf = {0};
+	struct msm_fallback *fallback;
+	CARD64 now, total;
+	uint64_t tf_frames = 0, tf_copied = 0, tf_full = 0;
+	Bool tearfree = FALSE;
+	const char *name = "_FREEDRENO_STATS";
+	int i;
+
+	if (!pMsm->Stats)
+		return;
+
+	/* the counters only go up, so the sum tells us if anything changed
+	 * (the per-drawable swaps are also counted in the screen's):
+	 */
+	total = fallback_total + pMsm->stats.flushes + pMsm->stats.waits +
+			pMsm->stats.bo_allocs + pMsm->stats.swap_gone;
+	for (i = 0; i < MSM_STAT_NUM_OPS; i++)
+		total += pMsm->stats.ops[i];
+	total += swap_count(&pMsm->stats.swap);
+
+	if (!pMsm->NoKMS)
+		tearfree = drmmode_tearfree_stats(pScrn, &tf_frames,
+				&tf_copied, &tf_full);
+	total += tf_frames;
+
+	if (pMsm->stats.published && (total == pMsm->stats.published_total))
+		return;
+
+	/* too soon, publish it once the interval is over: */
+	now = GetTimeInMicros();
+	if ((now - pMsm->stats.published) < PUBLISH_INTERVAL_US) {
+		CARD32 ms = (pMsm->stats.published + PUBLISH_INTERVAL_US -
+				now + 999) / 1000;
+		pMsm->stats.timer = TimerSet(pMsm->stats.timer, 0, ms,
+				stats_timer, pScreen);
+		return;
+	}
+
+	pMsm->stats.published = now;
+	pMsm->stats.published_total = total;
+
+	buf.size = 4096;
+	buf.str = malloc(buf.size);
+
+	for (i = 0; i < MSM_STAT_NUM_OPS; i++)
+		stats_printf(&buf, "%s %llu\n", op_names[i],
+				(unsigned long long)pMsm->stats.ops[i]);
+
+	stats_printf(&buf, "flushes %llu\n",
+			(unsigned long long)pMsm->stats.flushes);
+	stats_printf(&buf, "waits %llu\n",
+			(unsigned long long)pMsm->stats.waits);
+	stats_printf(&buf, "wait_us %llu\n",
+			(unsigned long long)pMsm->stats.wait_us);
+	stats_printf(&buf, "bo_allocs %llu\n",
+			(unsigned long long)pMsm->stats.bo_allocs);
+	stats_printf(&buf, "bo_bytes %llu\n",
+			(unsigned long long)pMsm->stats.bo_bytes);
+
+	if (pMsm->ring.ring) {
+		stats_printf(&buf, "rings %d\n", pMsm->ring.nrings);
+		stats_printf(&buf, "ring_size %u\n", pMsm->ring.size);
+		stats_printf(&buf, "ring_full %llu\n",
+				(unsigned long long)pMsm->stats.ring_full);
+		stats_printf(&buf, "ring_blocked %llu\n",
+				(unsigned long long)pMsm->stats.ring_blocked);
+		stats_printf(&buf, "ring_shrinks %llu\n",
+				(unsigned long long)pMsm->stats.ring_shrinks);
+	}
+
+	if (tearfree) {
+		stats_printf(&buf, "tearfree_frames %llu\n",
+				(unsigned long long)tf_frames);
+		stats_printf(&buf, "tearfree_copied %llu\n",
+				(unsigned long long)tf_copied);
+		stats_printf(&buf, "tearfree_full %llu\n",
+				(unsigned long long)tf_full);
+	}
+
+	stats_print_swaps(&buf, &pMsm->stats.swap);
+
+	for (fallback = fallbacks; fallback; fallback = fallback->next)
+		stats_printf(&buf, "fallback %llu %s: %s\n",
+				(unsigned long long)fallback->count,
+				fallback->func, fallback->cond);
+
+	stats_publish(pScreen->root, name, &buf);
+
+	stats_publish_swaps(pScreen, pMsm);
+}
+
+void
+MSMStatsFini(ScreenPtr pScreen)
+{
+	MSMPtr pMsm = MSMPTR_FROM_SCREEN(pScreen);
+
+	if (pMsm->stats.timer) {
+		TimerFree(pMsm->stats.timer);
+		pMsm->stats.timer = NULL;
+	}
+}
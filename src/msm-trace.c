@@ -0,0 +1,458 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "msm.h"
+#include "msm-accel-z1xx.h"
+
+/*
+ * Binary trace of the z1xx cmdstream (Option "TraceFile"), replacing the
+ * old compile time LOG_DWORDS ErrorF()'s.  Each flushed ring is copied,
+ * along with its relocs, into a circular buffer in a shared mapping of
+ * the trace file (see msm-trace.h for the format).  Tracing can be
+ * switched on and off while the server runs, with z1xx-dump -e/-d.
+ *
+ * A capture (Option "CaptureFile") additionally records the contents of
+ * the bo's referenced by each submit, so that the session can be replayed
+ * without the xserver (tools/z1xx-replay).  It is written sequentially
+ * with writev(), and is meant for recording a short session, not to be
+ * left on.  A bo is stored when a submit first references it, and again
+ * only once the cpu wrote to it (see msm_capture_cpu_write()).  What the
+ * gpu writes (the relocs with MSM_TRACE_RELOC_WRITE) is an output of the
+ * submits, which the replay reproduces, so render targets and the scanout
+ * are not read back at every submit.
+ *
+ * The relocs are tracked whenever either is configured, even while
+ * tracing is disabled, since the ones in the per-ring context state are
+ * only emitted once, when the ring is created.
+ */
+
+#define TRACE_SIZE  (16 * 1024 * 1024)
+
+struct trace_ring {
+	struct fd_ringbuffer *ring;
+	uint32_t id;
+	uint32_t nrelocs, max_relocs;
+	struct msm_trace_reloc *relocs;
+	struct fd_bo **bos;          /* referenced while capturing */
+	struct trace_ring *next;
+};
+
+/* a bo already stored in the capture, keyed by handle: */
+struct capture_bo {
+	uint32_t handle, size;
+	Bool dirty;                  /* written by the cpu since */
+	struct capture_bo *next;
+};
+
+Bool msm_trace_active;
+
+static volatile struct msm_trace_header *trace_hdr;
+static int capture_fd = -1;
+
+static struct trace_ring *trace_rings;
+static uint32_t trace_nrings;
+static struct capture_bo *capture_bos;
+
+/* trace/capture are shared by all screens, and kept until the server
+ * exits.  When a ring is freed (see next_ring()), its state relocs are
+ * dropped, and a new ring gets a new id.
+ */
+
+void
+msm_trace_init(ScrnInfoPtr pScrn, const char *path)
+{
+	volatile struct msm_trace_header *hdr;
+	size_t size = sizeof(*hdr) + TRACE_SIZE;
+	int fd;
+
+	if (trace_hdr)
+		return;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ERROR_MSG("could not open trace file %s: %s", path, strerror(errno));
+		return;
+	}
+
+	if (ftruncate(fd, size)) {
+		ERROR_MSG("could not size trace file %s: %s", path, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		ERROR_MSG("could not map trace file %s: %s", path, strerror(errno));
+		return;
+	}
+
+	hdr->version = MSM_TRACE_VERSION;
+	hdr->size = TRACE_SIZE;
+	hdr->head = hdr->tail = 0;
+	hdr->enabled = 1;
+	hdr->magic = MSM_TRACE_MAGIC;
+
+	trace_hdr = hdr;
+	msm_trace_active = TRUE;
+
+	INFO_MSG("tracing cmdstream to %s", path);
+}
+
+void
+msm_capture_init(ScrnInfoPtr pScrn, const char *path)
+{
+	struct msm_capture_header hdr = {
+		.magic = MSM_CAPTURE_MAGIC,
+		.version = MSM_TRACE_VERSION,
+	};
+	int fd;
+
+	if (capture_fd >= 0)
+		return;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ERROR_MSG("could not open capture file %s: %s", path,
+				strerror(errno));
+		return;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		ERROR_MSG("could not write capture file %s: %s", path,
+				strerror(errno));
+		close(fd);
+		return;
+	}
+
+	capture_fd = fd;
+	msm_trace_active = TRUE;
+
+	INFO_MSG("capturing cmdstream to %s", path);
+}
+
+static void
+capture_write(const struct iovec *iov, int iovcnt, uint32_t size)
+{
+	if (writev(capture_fd, iov, iovcnt) != size) {
+		ErrorF("capture write failed, stopping capture: %s\n",
+				strerror(errno));
+		close(capture_fd);
+		capture_fd = -1;
+	}
+}
+
+static struct trace_ring *
+get_trace_ring(struct fd_ringbuffer *ring)
+{
+	struct trace_ring *tr;
+
+	for (tr = trace_rings; tr; tr = tr->next)
+		if (tr->ring == ring)
+			return tr;
+
+	tr = calloc(1, sizeof(*tr));
+	if (!tr)
+		return NULL;
+
+	tr->ring = ring;
+	tr->id = trace_nrings++;
+	tr->next = trace_rings;
+	trace_rings = tr;
+
+	return tr;
+}
+
+void
+msm_trace_ring_del(struct fd_ringbuffer *ring)
+{
+	struct trace_ring **ptr, *tr;
+	uint32_t i;
+
+	for (ptr = &trace_rings; (tr = *ptr); ptr = &tr->next) {
+		if (tr->ring != ring)
+			continue;
+
+		for (i = 0; i < tr->nrelocs; i++)
+			if (tr->bos[i])
+				fd_bo_del(tr->bos[i]);
+
+		*ptr = tr->next;
+		free(tr->relocs);
+		free(tr->bos);
+		free(tr);
+		return;
+	}
+}
+
+void
+msm_trace_reloc(struct fd_ringbuffer *ring, struct fd_bo *bo, Bool write)
+{
+	struct trace_ring *tr = get_trace_ring(ring);
+	struct msm_trace_reloc *reloc;
+
+	if (!tr)
+		return;
+
+	if (tr->nrelocs == tr->max_relocs) {
+		uint32_t max = tr->max_relocs ? 2 * tr->max_relocs : 64;
+		struct fd_bo **bos;
+
+		reloc = realloc(tr->relocs, max * sizeof(*reloc));
+		if (!reloc)
+			return;
+		tr->relocs = reloc;
+
+		bos = realloc(tr->bos, max * sizeof(*bos));
+		if (!bos)
+			return;
+		tr->bos = bos;
+
+		tr->max_relocs = max;
+	}
+
+	/* keep the bo alive until it is captured with the submit: */
+	tr->bos[tr->nrelocs] = (capture_fd >= 0) ? fd_bo_ref(bo) : NULL;
+
+	reloc = &tr->relocs[tr->nrelocs++];
+	reloc->offset = ring->cur - ring->start;
+	reloc->handle = fd_bo_handle(bo);
+	reloc->size = fd_bo_size(bo);
+	reloc->flags = write ? MSM_TRACE_RELOC_WRITE : 0;
+}
+
+static struct capture_bo *
+find_capture_bo(uint32_t handle)
+{
+	struct capture_bo *cbo;
+
+	for (cbo = capture_bos; cbo; cbo = cbo->next)
+		if (cbo->handle == handle)
+			return cbo;
+
+	return NULL;
+}
+
+/* called before the cpu writes to a bo, so that its new contents are
+ * stored with the next submit which references it:
+ */
+void
+msm_capture_cpu_write(struct fd_bo *bo)
+{
+	struct capture_bo *cbo;
+
+	if (capture_fd < 0)
+		return;
+
+	cbo = find_capture_bo(fd_bo_handle(bo));
+	if (cbo)
+		cbo->dirty = TRUE;
+}
+
+static void
+capture_bo(struct fd_ringbuffer *ring, struct fd_bo *bo)
+{
+	struct msm_trace_bo rec = {
+		.rec.type = MSM_TRACE_BO,
+		.handle = fd_bo_handle(bo),
+		.size = fd_bo_size(bo),
+	};
+	static const uint64_t zero;
+	struct capture_bo *cbo;
+	struct iovec iov[3];
+	uint8_t *ptr;
+
+	/* handles get reused by the kernel once a bo is freed, but a new
+	 * bo's contents are undefined until it is written, by the cpu (so
+	 * it is dirty) or by a captured submit, so only a change of size
+	 * needs to be stored again:
+	 */
+	cbo = find_capture_bo(rec.handle);
+	if (cbo && !cbo->dirty && (cbo->size == rec.size))
+		return;
+
+	if (!cbo) {
+		cbo = calloc(1, sizeof(*cbo));
+		if (!cbo)
+			return;
+		cbo->handle = rec.handle;
+		cbo->next = capture_bos;
+		capture_bos = cbo;
+	}
+
+	ptr = fd_bo_map(bo);
+	if (!ptr)
+		return;
+
+	/* wait for the gpu to finish writing it: */
+	fd_bo_cpu_prep(bo, ring->pipe, DRM_FREEDRENO_PREP_READ);
+
+	cbo->size = rec.size;
+	cbo->dirty = FALSE;
+
+	rec.rec.size = (sizeof(rec) + rec.size + 7) & ~7;
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = ptr;
+	iov[1].iov_len = rec.size;
+	iov[2].iov_base = (void *)&zero;
+	iov[2].iov_len = rec.rec.size - sizeof(rec) - rec.size;
+	capture_write(iov, ARRAY_SIZE(iov), rec.rec.size);
+
+	fd_bo_cpu_fini(bo);
+}
+
+/* called from FIRE_RING(), before the ring is flushed: */
+void
+msm_trace_capture(struct fd_ringbuffer *ring)
+{
+	struct trace_ring *tr = get_trace_ring(ring);
+	uint32_t i, j;
+
+	if (!tr || (capture_fd < 0))
+		return;
+
+	for (i = 0; (i < tr->nrelocs) && (capture_fd >= 0); i++) {
+		if (!tr->bos[i])
+			continue;
+
+		/* each bo only once per submit: */
+		for (j = 0; j < i; j++)
+			if (tr->relocs[j].handle == tr->relocs[i].handle)
+				break;
+
+		if (j == i)
+			capture_bo(ring, tr->bos[i]);
+	}
+}
+
+/* discard the oldest records until there are 'size' bytes free: */
+static void
+trace_make_room(volatile struct msm_trace_header *hdr, uint8_t *area,
+		uint32_t size)
+{
+	while ((hdr->head + size - hdr->tail) > hdr->size) {
+		struct msm_trace_record *rec = (struct msm_trace_record *)
+				&area[hdr->tail % hdr->size];
+		hdr->tail += rec->size;
+	}
+}
+
+static void *
+trace_alloc(volatile struct msm_trace_header *hdr, uint32_t size)
+{
+	uint8_t *area = (uint8_t *)(hdr + 1);
+	uint32_t pos = hdr->head % hdr->size;
+
+	if (size > hdr->size)
+		return NULL;
+
+	/* records don't wrap, so pad out the end of the area instead: */
+	if ((pos + size) > hdr->size) {
+		struct msm_trace_record *pad;
+		uint32_t padsize = hdr->size - pos;
+
+		trace_make_room(hdr, area, padsize);
+		pad = (struct msm_trace_record *)&area[pos];
+		pad->type = MSM_TRACE_PAD;
+		pad->size = padsize;
+		hdr->head += padsize;
+		pos = 0;
+	}
+
+	trace_make_room(hdr, area, size);
+
+	return &area[pos];
+}
+
+/* called from FIRE_RING(), after the ring is flushed: */
+void
+msm_trace_submit(struct fd_ringbuffer *ring)
+{
+	volatile struct msm_trace_header *hdr = trace_hdr;
+	struct trace_ring *tr = get_trace_ring(ring);
+	struct msm_trace_submit submit = {
+		.rec.type = MSM_TRACE_SUBMIT,
+	};
+	static const uint64_t zero;
+	struct iovec iov[4];
+	uint8_t *ptr;
+	uint32_t i, j;
+
+	if (!tr)
+		return;
+
+	submit.time_us = GetTimeInMicros();
+	submit.timestamp = fd_ringbuffer_timestamp(ring);
+	submit.ring = tr->id;
+	submit.state_dwords = STATE_SIZE;
+	submit.ndwords = ring->cur - ring->start;
+	submit.nrelocs = tr->nrelocs;
+
+	iov[0].iov_base = &submit;
+	iov[0].iov_len = sizeof(submit);
+	iov[1].iov_base = tr->relocs;
+	iov[1].iov_len = tr->nrelocs * sizeof(struct msm_trace_reloc);
+	iov[2].iov_base = ring->start;
+	iov[2].iov_len = submit.ndwords * sizeof(uint32_t);
+	iov[3].iov_base = (void *)&zero;
+	iov[3].iov_len = (iov[2].iov_len % 8) ? 4 : 0;
+
+	submit.rec.size = iov[0].iov_len + iov[1].iov_len +
+			iov[2].iov_len + iov[3].iov_len;
+
+	if (hdr && hdr->enabled && (ptr = trace_alloc(hdr, submit.rec.size))) {
+		for (i = 0; i < ARRAY_SIZE(iov); i++) {
+			memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+			ptr += iov[i].iov_len;
+		}
+
+		/* publish the record only once it is complete: */
+		__sync_synchronize();
+		hdr->head += submit.rec.size;
+	}
+
+	if (capture_fd >= 0)
+		capture_write(iov, ARRAY_SIZE(iov), submit.rec.size);
+
+	/* the ring gets reset for its next use, except for the state: */
+	for (i = 0; i < tr->nrelocs; i++)
+		if (tr->relocs[i].offset >= STATE_SIZE)
+			break;
+
+	for (j = i; j < tr->nrelocs; j++)
+		if (tr->bos[j])
+			fd_bo_del(tr->bos[j]);
+
+	tr->nrelocs = i;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MSM_TRACE_H_
+#define MSM_TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Format of the binary cmdstream trace written by msm-trace.c (see
+ * Option "TraceFile"), and read by tools/z1xx-dump.  This header is
+ * shared with the tools, so it must not depend on the xserver.
+ *
+ * The file is a header followed by a circular record area, which the
+ * driver writes through a shared mapping.  Once the area fills up, the
+ * oldest records are discarded, so the file always holds the most recent
+ * submits.  Records never straddle the end of the area (a PAD record
+ * fills the gap instead), and are 8 byte aligned.
+ *
+ * A capture file (Option "CaptureFile", replayed by tools/z1xx-replay)
+ * is instead a msm_capture_header followed by records until EOF.  Each
+ * submit there is preceded by BO records with the contents of the bo's
+ * it references for the first time, or which the cpu wrote to since they
+ * were last stored.  The bo's the gpu writes (MSM_TRACE_RELOC_WRITE) are
+ * outputs of the submits, and are not stored again after them.
+ */
+
+#define MSM_TRACE_MAGIC    0x52544446   /* "FDTR" */
+#define MSM_TRACE_VERSION  1
+
+#define MSM_CAPTURE_MAGIC  0x50434446   /* "FDCP" */
+
+struct msm_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t enabled;     /* can be toggled by other processes */
+	uint32_t size;        /* size of the record area */
+	uint64_t head;        /* total bytes written */
+	uint64_t tail;        /* total bytes discarded, so the area holds
+	                       * [tail, head), modulo size */
+};
+
+struct msm_capture_header {
+	uint32_t magic;
+	uint32_t version;     /* MSM_TRACE_VERSION */
+};
+
+enum msm_trace_type {
+	MSM_TRACE_PAD     = 0,   /* skip to the start of the area */
+	MSM_TRACE_SUBMIT  = 1,
+	MSM_TRACE_BO      = 2,   /* only in capture files */
+};
+
+struct msm_trace_record {
+	uint32_t type;
+	uint32_t size;        /* of the whole record, incl. this header */
+};
+
+#define MSM_TRACE_RELOC_WRITE  0x1
+
+struct msm_trace_reloc {
+	uint32_t offset;      /* dword offset from the start of the ring */
+	uint32_t handle;      /* gem handle */
+	uint32_t size;        /* of the bo */
+	uint32_t flags;
+};
+
+/* a flushed ring, followed by relocs[nrelocs] then dwords[ndwords]: */
+struct msm_trace_submit {
+	struct msm_trace_record rec;
+	uint64_t time_us;     /* CLOCK_MONOTONIC, at flush */
+	uint32_t timestamp;   /* fence of the submit */
+	uint32_t ring;        /* which of the driver's rings */
+	uint32_t state_dwords;/* leading dwords of (per ring) context state */
+	uint32_t ndwords;     /* incl. the state */
+	uint32_t nrelocs;
+	uint32_t pad;
+};
+
+/* contents of a bo, as of the following submit, followed by size bytes: */
+struct msm_trace_bo {
+	struct msm_trace_record rec;
+	uint32_t handle;
+	uint32_t size;
+};
+
+#endif /* MSM_TRACE_H_ */
@@ -0,0 +1,116 @@
+/*
+ * Copyright © 2012, 2014 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MSM_Z1XX_BLEND_H_
+#define MSM_Z1XX_BLEND_H_
+
+#include <stdint.h>
+
+/* The z1xx blend state for each composite op, shared by the EXA code
+ * which emits it and the simulator (tools/z1xx-sim.c) which interprets
+ * it.  The PictOp values are part of the render protocol, so they are
+ * defined here for the simulator, which doesn't use the X headers:
+ */
+#ifndef PictOpAdd
+#  define PictOpClear        0
+#  define PictOpSrc          1
+#  define PictOpDst          2
+#  define PictOpOver         3
+#  define PictOpOverReverse  4
+#  define PictOpIn           5
+#  define PictOpInReverse    6
+#  define PictOpOut          7
+#  define PictOpOutReverse   8
+#  define PictOpAtop         9
+#  define PictOpAtopReverse  10
+#  define PictOpXor          11
+#  define PictOpAdd          12
+#endif
+
+/* Indexed by whether the src (bit 1) and the dst (bit 0) have alpha, and
+ * by op.  The dwords are either a REGM() header plus a full 32b value,
+ * or a REG() with 24b value, ie. the same as they appear in the
+ * cmdstream.
+ *
+ * NOTE ARGB and A8 seem to be treated the same when it comes to the
+ * composite-op dwords:
+ */
+#define COMPOSITE_SRC_ALPHA 2
+#define COMPOSITE_DST_ALPHA 1
+
+static const uint32_t composite_op_dwords[4][PictOpAdd+1][4] = {
+	{ /* xRGB->xRGB */         /*           G2D_BLEND_A0            G2D_BLEND_C0 */
+		[PictOpSrc]          = { 0x7c000114, 0x10002010, 0x00000000, 0x18012210 },
+		[PictOpIn]           = { 0x7c000114, 0xb0100004, 0x00000000, 0x18110a04 },
+		[PictOpOut]          = { 0x7c000114, 0xb0102004, 0x00000000, 0x18112a04 },
+		[PictOpOver]         = { 0x7c000114, 0xd080a004, 0x7c000118, 0x8081aa04 },
+		[PictOpOutReverse]   = { 0x7c000114, 0x80808040, 0x7c000118, 0x80808840 },
+		[PictOpAdd]          = { 0x7c000114, 0x5080a004, 0x7c000118, 0x20818204 },
+		[PictOpOverReverse]  = { 0x7c000114, 0x7090a004, 0x7c000118, 0x2091a204 },
+		[PictOpInReverse]    = { 0x7c000114, 0x80800040, 0x7c000118, 0x80800840 },
+		[PictOpAtop]         = { 0x7c000114, 0xf0908004, 0x7c000118, 0xa0918a04 },
+		[PictOpAtopReverse]  = { 0x7c000114, 0xf0902004, 0x7c000118, 0xa0912a04 },
+		[PictOpXor]          = { 0x7c000114, 0xf090a004, 0x7c000118, 0xa091aa04 },
+	},
+	{ /* xRGB->ARGB, xRGB->A8 */
+		[PictOpSrc]          = { 0x7c000114, 0x10002010, 0x00000000, 0x18012210 },
+		[PictOpIn]           = { 0x7c000114, 0x90100004, 0x00000000, 0x18110a04 },
+		[PictOpOut]          = { 0x7c000114, 0x90102004, 0x00000000, 0x18112a04 },
+		[PictOpOver]         = { 0x7c000114, 0x9080a004, 0x7c000118, 0x8081aa04 },
+		[PictOpOutReverse]   = { 0x7c000114, 0x80808040, 0x7c000118, 0x80808840 },
+		[PictOpAdd]          = { 0x7c000114, 0x1080a004, 0x7c000118, 0x20818204 },
+		[PictOpOverReverse]  = { 0x7c000114, 0x1090a004, 0x00000000, 0x1891a204 },
+		[PictOpInReverse]    = { 0x7c000114, 0x80800040, 0x7c000118, 0x80800840 },
+		[PictOpAtop]         = { 0x7c000114, 0x90908004, 0x7c000118, 0x80918a04 },
+		[PictOpAtopReverse]  = { 0x7c000114, 0x90902004, 0x7c000118, 0x80912a04 },
+		[PictOpXor]          = { 0x7c000114, 0x9090a004, 0x7c000118, 0x8091aa04 },
+	},
+	{ /* ARGB->xRGB, A8->xRGB */
+		[PictOpSrc]          = { 0x00000000, 0x14012010, 0x00000000, 0x18012210 },
+		[PictOpIn]           = { 0x7c000114, 0x20110004, 0x00000000, 0x18110a04 },
+		[PictOpOut]          = { 0x7c000114, 0x20112004, 0x00000000, 0x18112a04 },
+		[PictOpOver]         = { 0x7c000114, 0x4281a004, 0x7c000118, 0x0281aa04 },
+		[PictOpOutReverse]   = { 0x7c000114, 0x02808040, 0x7c000118, 0x02808840 },
+		[PictOpAdd]          = { 0x7c000114, 0x4081a004, 0x00000000, 0x18898204 },
+		[PictOpOverReverse]  = { 0x7c000114, 0x6091a004, 0x7c000118, 0x2091a204 },
+		[PictOpInReverse]    = { 0x7c000114, 0x02800040, 0x7c000118, 0x02800840 },
+		[PictOpAtop]         = { 0x7c000114, 0x62918004, 0x7c000118, 0x22918a04 },
+		[PictOpAtopReverse]  = { 0x7c000114, 0x62912004, 0x7c000118, 0x22912a04 },
+		[PictOpXor]          = { 0x7c000114, 0x6291a004, 0x7c000118, 0x2291aa04 },
+	},
+	{ /* ARGB->ARGB, A8->A8 */
+		[PictOpSrc]          = { 0x00000000, 0x14012010, 0x00000000, 0x18012210 },
+		[PictOpIn]           = { 0x00000000, 0x14110004, 0x00000000, 0x18110a04 },
+		[PictOpOut]          = { 0x00000000, 0x14112004, 0x00000000, 0x18112a04 },
+		[PictOpOver]         = { 0x7c000114, 0x0281a004, 0x7c000118, 0x0281aa04 },
+		[PictOpOutReverse]   = { 0x7c000114, 0x02808040, 0x7c000118, 0x02808840 },
+		[PictOpAdd]          = { 0x00000000, 0x1481a004, 0x00000000, 0x18898204 },
+		[PictOpOverReverse]  = { 0x00000000, 0x1491a004, 0x00000000, 0x1891a204 },
+		[PictOpInReverse]    = { 0x7c000114, 0x02800040, 0x7c000118, 0x02800840 },
+		[PictOpAtop]         = { 0x7c000114, 0x02918004, 0x7c000118, 0x02918a04 },
+		[PictOpAtopReverse]  = { 0x7c000114, 0x02912004, 0x7c000118, 0x02912a04 },
+		[PictOpXor]          = { 0x7c000114, 0x0291a004, 0x7c000118, 0x0291aa04 },
+	},
+};
+
+#endif /* MSM_Z1XX_BLEND_H_ */
@@ -33,11 +33,15 @@
 #include "xf86.h"
 #include "damage.h"
 #include "exa.h"
+#include "xf86Crtc.h"
+#include "list.h"
 #include <compat-api.h>
 
 #include <freedreno_drmif.h>
 #include <freedreno_ringbuffer.h>
 
+#include "msm-probes.h"
+
 struct xa_tracker;
 struct xa_surface;
 
@@ -58,9 +62,67 @@ typedef enum
 	OPTION_EXAMASK,
 	OPTION_VSYNC,
 	OPTION_DEBUG,
+	OPTION_ATOMIC,
+	OPTION_TEARFREE,
+	OPTION_STATS,
+	OPTION_TRACEFILE,
+	OPTION_CAPTUREFILE,
+	OPTION_MAXRINGS,
+	OPTION_MAXRINGSIZE,
 } MSMOpts;
 
 struct exa_state;
+struct dri2_state;
+
+/* z1xx ringbuffers, which are resized as needed, see next_ring(): */
+#define MSM_RINGS         8         /* initial number of rings */
+#define MSM_MIN_RINGS     2
+#define MSM_MAX_RINGS     32
+#define MSM_RING_SIZE     0x4000    /* initial size, in bytes (excl. state) */
+#define MSM_MAX_RING_SIZE 0x40000
+
+/* EXA hooks counted in the runtime stats, see msm-stats.c: */
+enum msm_stat_op {
+	MSM_STAT_PREPARE_SOLID,
+	MSM_STAT_SOLID,
+	MSM_STAT_PREPARE_COPY,
+	MSM_STAT_COPY,
+	MSM_STAT_CHECK_COMPOSITE,
+	MSM_STAT_PREPARE_COMPOSITE,
+	MSM_STAT_COMPOSITE,
+	MSM_STAT_PREPARE_ACCESS,
+	MSM_STAT_CREATE_PIXMAP,
+	MSM_STAT_NUM_OPS
+};
+
+/* log2 histogram, bucket i counts values in [2^(i-1), 2^i), and bucket 0
+ * the zeros:
+ */
+#define MSM_HIST_BUCKETS 24
+
+struct msm_hist {
+	CARD64 count, sum, max;
+	CARD64 buckets[MSM_HIST_BUCKETS];
+};
+
+/* how DRI2 swaps ended up being done: */
+enum msm_swap_type {
+	MSM_SWAP_FLIP,
+	MSM_SWAP_PLANE,
+	MSM_SWAP_EXCHANGE,
+	MSM_SWAP_BLIT,
+	MSM_SWAP_NUM_TYPES
+};
+
+/* kept both per-screen and per-drawable, see msm-stats.c: */
+struct msm_swap_stats {
+	struct msm_hist latency[MSM_SWAP_NUM_TYPES];  /* request to completion, usec */
+	struct msm_hist missed;   /* vblanks missed per flip */
+
+	/* per-drawable only, in the screen's swap_drawables: */
+	XID id;
+	struct xorg_list link;
+};
 
 typedef struct _MSMRec
 {
@@ -68,6 +130,7 @@ typedef struct _MSMRec
 	ExaDriverPtr pExa;
 
 	Bool dri;
+	struct dri2_state *dri2;
 
 	CloseScreenProcPtr CloseScreen;
 	CreateScreenResourcesProcPtr CreateScreenResources;
@@ -77,6 +140,10 @@ typedef struct _MSMRec
 	Bool NoAccel;
 	Bool HWCursor;
 	Bool SWRefresher;
+	Bool TearFree;
+	Bool Stats;
+	const char *TraceFile;
+	const char *CaptureFile;
 
 	enum {
 		ACCEL_SOLID     = 0x1,
@@ -93,11 +160,15 @@ typedef struct _MSMRec
 	char *deviceName;
 
 	struct {
-		int idx;
-		struct fd_ringbuffer *rings[8];
+		int idx;                  /* of the next ring to use */
+		int nrings, max_rings;
+		uint32_t size, max_size;  /* of new rings, excl. the state */
+		struct fd_ringbuffer *rings[MSM_MAX_RINGS];
 		struct fd_ringbuffer *ring;
 		struct fd_bo *context_bos[3];
 		Bool fire;
+		/* why the rings should be resized, for next_ring(): */
+		Bool full, blocked, pressure;
 		uint32_t timestamp;
 	} ring;
 	struct fd_pipe *pipe;
@@ -105,6 +176,9 @@ typedef struct _MSMRec
 	/* for XA state tracker EXA: */
 	struct xa_tracker *xa;
 
+	Bool present;
+	Bool dri3;
+
 	/* EXA state: */
 	struct exa_state *exa;
 
@@ -112,8 +186,27 @@ typedef struct _MSMRec
 
 	OptionInfoPtr     options;
 	EntityInfoPtr     pEnt;
+
+	/* startup timing, in usec: */
+	CARD64 startup_begin, startup_phase;
+
+	/* runtime stats, see msm-stats.c: */
+	struct {
+		CARD64 ops[MSM_STAT_NUM_OPS];
+		CARD64 flushes;
+		CARD64 waits, wait_us;    /* pipe waits and cpu_preps */
+		CARD64 bo_allocs, bo_bytes;
+		CARD64 ring_full, ring_blocked, ring_shrinks;
+		struct msm_swap_stats swap;
+		struct xorg_list swap_drawables;
+		CARD64 swap_gone;         /* drawables dropped from the list */
+		CARD64 published, published_total;
+		OsTimerPtr timer;
+	} stats;
 } MSMRec, *MSMPtr;
 
+#define MSM_STAT_OP(pMsm, op) ((pMsm)->stats.ops[MSM_STAT_ ## op]++)
+
 struct msm_pixmap_priv {
 	struct fd_bo *bo;        /* for traditional 2d EXA */
 	struct xa_surface *surf; /* for XA state tracker EXA */
@@ -129,6 +222,20 @@ struct msm_pixmap_priv {
 #define MSMPTR_FROM_PIXMAP(_x)         \
 		MSMPTR_FROM_SCREEN((_x)->drawable.pScreen)
 
+void MSMStartupPhase(ScrnInfoPtr pScrn, const char *phase);
+
+void MSMStatsUpdate(ScreenPtr pScreen);
+void MSMStatsFini(ScreenPtr pScreen);
+CARD64 msm_stats_wait(MSMPtr pMsm, CARD64 begin);
+CARD64 msm_pipe_wait(MSMPtr pMsm, uint32_t timestamp);
+int msm_bo_cpu_prep(MSMPtr pMsm, struct fd_bo *bo, uint32_t op);
+struct fd_bo *msm_bo_new(MSMPtr pMsm, uint32_t size, uint32_t flags);
+void msm_hist_add(struct msm_hist *hist, CARD64 val);
+void msm_stats_swap(MSMPtr pMsm, struct msm_swap_stats *stats,
+		enum msm_swap_type type, CARD64 latency, int missed);
+void msm_stats_swap_add(MSMPtr pMsm, struct msm_swap_stats *stats, XID id);
+void msm_stats_swap_del(MSMPtr pMsm, struct msm_swap_stats *stats);
+
 Bool MSMAccelInit(ScreenPtr pScreen);
 void MSMAccelFini(ScreenPtr pScreen);
 void MSMFlushAccel(ScreenPtr pScreen);
@@ -136,15 +243,37 @@ Bool MSMSetupExa(ScreenPtr, Bool softexa);
 Bool MSMSetupExaXA(ScreenPtr);
 void MSMFlushXA(MSMPtr pMsm);
 
-typedef struct _MSMDRISwapCmd MSMDRISwapCmd;
-void MSMDRI2SwapComplete(MSMDRISwapCmd *cmd, uint32_t frame,
-		uint32_t tv_sec, uint32_t tv_usec);
 Bool MSMDRI2ScreenInit(ScreenPtr pScreen);
 void MSMDRI2CloseScreen(ScreenPtr pScreen);
+void MSMDRI2BlockHandler(ScreenPtr pScreen);
+
+Bool MSMPresentScreenInit(ScreenPtr pScreen);
+Bool MSMDRI3ScreenInit(ScreenPtr pScreen);
+
+/* completion callback for flips and vblank events, msc is the 64bit
+ * frame counter of the crtc, ust in usec:
+ */
+typedef void (*drmmode_event_handler)(uint64_t msc, uint64_t ust, void *data);
 
 Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp);
 int drmmode_cursor_init(ScreenPtr pScreen);
-Bool drmmode_page_flip(DrawablePtr draw, PixmapPtr back, void *priv);
+Bool drmmode_page_flip(DrawablePtr draw, PixmapPtr back, Bool async,
+		drmmode_event_handler handler, void *priv);
+Bool drmmode_can_flip(ScrnInfoPtr pScrn);
+Bool drmmode_can_async_flip(ScrnInfoPtr pScrn);
+void drmmode_remove_fb(ScrnInfoPtr pScrn);
+xf86CrtcPtr drmmode_covering_crtc(ScrnInfoPtr pScrn, BoxPtr box);
+Bool drmmode_crtc_get_ust_msc(xf86CrtcPtr crtc, uint64_t *ust, uint64_t *msc);
+Bool drmmode_queue_vblank(xf86CrtcPtr crtc, uint64_t msc,
+		drmmode_event_handler handler, void *data);
+Bool drmmode_plane_available(xf86CrtcPtr crtc);
+Bool drmmode_plane_show(xf86CrtcPtr crtc, PixmapPtr pix,
+		drmmode_event_handler handler, void *data);
+void drmmode_plane_hide(xf86CrtcPtr crtc);
+void drmmode_tearfree_update(ScreenPtr pScreen);
+void drmmode_tearfree_fini(ScreenPtr pScreen);
+Bool drmmode_tearfree_stats(ScrnInfoPtr pScrn, uint64_t *frames,
+		uint64_t *copied, uint64_t *full);
 void drmmode_wait_for_event(ScrnInfoPtr pScrn);
 Bool drmmode_screen_init(ScreenPtr pScreen);
 void drmmode_screen_fini(ScreenPtr pScreen);
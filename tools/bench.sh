@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Run exa-bench against an xserver using the just-built driver on top of
+# libfd-mock, so no gpu or display is needed.  Normally run by "make bench",
+# which sets up the paths; extra arguments are passed to exa-bench, ie.
+#
+#   make bench BENCH_ARGS="-t 2 glyph"
+#
+# Starting Xorg with a custom config needs root (or a permissive
+# Xwrapper.config).  To benchmark real hw (including the XA backend),
+# start the server normally and run exa-bench without -s.
+
+: ${XORG:=Xorg}
+: ${BENCH_DISPLAY:=:99}
+: ${FD_MOCK_MODE:=1920x1080}
+: ${XORG_MODULEDIR:=$(pkg-config --variable=moduledir xorg-server)}
+
+tmp=$(mktemp -d) || exit 1
+trap 'kill $xpid 2>/dev/null; wait $xpid 2>/dev/null; rm -rf $tmp' EXIT INT TERM
+
+cat > $tmp/xorg.conf <<CONF
+Section "ServerFlags"
+	Option "AutoAddDevices" "false"
+	Option "AutoAddGPU" "false"
+EndSection
+
+Section "Device"
+	Identifier "bench"
+	Driver "freedreno"
+EndSection
+CONF
+
+FD_MOCK_MODE=$FD_MOCK_MODE FD_MOCK_SHM=$tmp/stats LD_PRELOAD=$MOCK \
+	$XORG $BENCH_DISPLAY -config $tmp/xorg.conf \
+		-modulepath "$DRIVER_DIR,$XORG_MODULEDIR" \
+		-logfile $tmp/Xorg.log -noreset -nolisten tcp \
+		> /dev/null 2>&1 &
+xpid=$!
+
+if ! $EXA_BENCH -d $BENCH_DISPLAY -s $tmp/stats -w 10 "$@"; then
+	cat $tmp/Xorg.log >&2
+	exit 1
+fi
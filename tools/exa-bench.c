@@ -0,0 +1,408 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Benchmark for the EXA hot paths (solid, copy, composite, put/get image).
+ *
+ * This is an X client, which runs a set of workloads against the server
+ * and reports ops/s for each.  If the server is running the driver on top
+ * of libfd-mock (with FD_MOCK_SHM pointing at the file passed with -s), it
+ * also reports what each op cost in the ring: dwords and relocs emitted,
+ * and how many flushes/waits/cpu_preps it took.  See bench.sh.
+ *
+ * Each workload ends with a 1x1 XGetImage, which makes the driver flush
+ * and wait for the gpu, so queued up work is accounted to the workload
+ * that queued it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xrender.h>
+
+#include "fd-mock.h"
+
+#ifndef ARRAY_SIZE
+#  define ARRAY_SIZE(a) (sizeof((a)) / (sizeof(*(a))))
+#endif
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+enum kind {
+	FILL,          /* XFillRectangle: solid */
+	COPY,          /* XCopyArea between pixmaps: copy */
+	SCROLL,        /* overlapping XCopyArea within a pixmap: copy */
+	OVER,          /* ARGB src OVER dst: composite */
+	GLYPH_A8,      /* solid src IN a8 mask OVER dst: composite w/ mask */
+	GLYPH_CA,      /* component-alpha mask: composite w/ mask */
+	PUT,           /* XPutImage: upload */
+	GET,           /* XGetImage: download */
+};
+
+/* 0x0 means screen size: */
+static const struct test {
+	const char *name;
+	enum kind kind;
+	int w, h;
+} tests[] = {
+	{ "fill-1x1",         FILL,     1,   1 },
+	{ "fill-10x10",       FILL,    10,  10 },
+	{ "fill-100x100",     FILL,   100, 100 },
+	{ "fill-500x500",     FILL,   500, 500 },
+	{ "fill-screen",      FILL,     0,   0 },
+	{ "copy-10x10",       COPY,    10,  10 },
+	{ "copy-100x100",     COPY,   100, 100 },
+	{ "copy-500x500",     COPY,   500, 500 },
+	{ "scroll-100x100",   SCROLL, 100, 100 },
+	{ "scroll-screen",    SCROLL,   0,   0 },
+	{ "over-10x10",       OVER,    10,  10 },
+	{ "over-100x100",     OVER,   100, 100 },
+	{ "over-500x500",     OVER,   500, 500 },
+	{ "glyph-a8-10x10",   GLYPH_A8, 10, 10 },
+	{ "glyph-a8-24x24",   GLYPH_A8, 24, 24 },
+	{ "glyph-ca-10x10",   GLYPH_CA, 10, 10 },
+	{ "mask-a8-500x500",  GLYPH_A8, 500, 500 },
+	{ "put-10x10",        PUT,     10,  10 },
+	{ "put-500x500",      PUT,    500, 500 },
+	{ "get-10x10",        GET,     10,  10 },
+	{ "get-500x500",      GET,    500, 500 },
+};
+
+static struct {
+	Display *dpy;
+	int width, height;
+	GC gc;
+
+	/* depth 24 destination and copy source, and ARGB composite source: */
+	Pixmap dst, src, argb;
+	Picture dst_pict, argb_pict;
+
+	/* 1x1 repeat solid source, and the mask of the current test: */
+	Picture solid_pict, mask_pict;
+	Pixmap mask;
+
+	XImage *image;
+
+	const struct fd_mock_stats *stats;
+} bench;
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Picture
+create_picture(Pixmap pix, int format, Bool repeat, Bool ca)
+{
+	XRenderPictureAttributes pa = {
+			.repeat = repeat,
+			.component_alpha = ca,
+	};
+
+	return XRenderCreatePicture(bench.dpy, pix,
+			XRenderFindStandardFormat(bench.dpy, format),
+			CPRepeat | CPComponentAlpha, &pa);
+}
+
+static Pixmap
+create_filled(int w, int h, int depth, int format, Picture *pict,
+		Bool repeat, Bool ca, const XRenderColor *color)
+{
+	Pixmap pix = XCreatePixmap(bench.dpy, DefaultRootWindow(bench.dpy),
+			w, h, depth);
+
+	*pict = create_picture(pix, format, repeat, ca);
+	XRenderFillRectangle(bench.dpy, PictOpSrc, *pict, color, 0, 0, w, h);
+
+	return pix;
+}
+
+static void
+init(void)
+{
+	static const XRenderColor grey = { 0x8000, 0x8000, 0x8000, 0xffff };
+	static const XRenderColor red = { 0x8000, 0x0000, 0x0000, 0x8000 };
+	static const XRenderColor blue = { 0x0000, 0x0000, 0xffff, 0xffff };
+	Picture src_pict;
+	Window root = DefaultRootWindow(bench.dpy);
+
+	bench.width = DisplayWidth(bench.dpy, DefaultScreen(bench.dpy));
+	bench.height = DisplayHeight(bench.dpy, DefaultScreen(bench.dpy));
+
+	bench.dst = create_filled(bench.width, bench.height, 24,
+			PictStandardRGB24, &bench.dst_pict, False, False, &grey);
+	bench.src = create_filled(bench.width, bench.height, 24,
+			PictStandardRGB24, &src_pict, False, False, &blue);
+	XRenderFreePicture(bench.dpy, src_pict);
+	bench.argb = create_filled(bench.width, bench.height, 32,
+			PictStandardARGB32, &bench.argb_pict, False, False, &red);
+	XFreePixmap(bench.dpy, create_filled(1, 1, 32, PictStandardARGB32,
+			&bench.solid_pict, True, False, &red));
+
+	bench.gc = XCreateGC(bench.dpy, root, 0, NULL);
+	XSetForeground(bench.dpy, bench.gc, 0x123456);
+	XSetGraphicsExposures(bench.dpy, bench.gc, False);
+}
+
+static void
+setup(const struct test *t, int w, int h)
+{
+	static const XRenderColor mask = { 0x4000, 0x8000, 0xc000, 0x8000 };
+
+	switch (t->kind) {
+	case GLYPH_A8:
+		bench.mask = create_filled(w, h, 8, PictStandardA8,
+				&bench.mask_pict, False, False, &mask);
+		break;
+	case GLYPH_CA:
+		bench.mask = create_filled(w, h, 32, PictStandardARGB32,
+				&bench.mask_pict, False, True, &mask);
+		break;
+	case PUT:
+		bench.image = XCreateImage(bench.dpy,
+				DefaultVisual(bench.dpy, DefaultScreen(bench.dpy)),
+				24, ZPixmap, 0, calloc(w * h, 4), w, h, 32, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+teardown(const struct test *t)
+{
+	if (bench.mask_pict) {
+		XRenderFreePicture(bench.dpy, bench.mask_pict);
+		XFreePixmap(bench.dpy, bench.mask);
+		bench.mask_pict = None;
+		bench.mask = None;
+	}
+
+	if (bench.image) {
+		XDestroyImage(bench.image);
+		bench.image = NULL;
+	}
+}
+
+static void
+op(const struct test *t, int w, int h, int i)
+{
+	/* move around a bit, so the ops aren't all identical: */
+	int x = (i * 7) % (bench.width - w + 1);
+	int y = (i * 13) % (bench.height - h + 1);
+	XImage *image;
+
+	switch (t->kind) {
+	case FILL:
+		XFillRectangle(bench.dpy, bench.dst, bench.gc, x, y, w, h);
+		break;
+	case COPY:
+		XCopyArea(bench.dpy, bench.src, bench.dst, bench.gc, x, y, w, h,
+				bench.width - w - x, bench.height - h - y);
+		break;
+	case SCROLL:
+		/* scroll up by one line: */
+		y %= bench.height - h;
+		XCopyArea(bench.dpy, bench.dst, bench.dst, bench.gc, x, y + 1,
+				w, h, x, y);
+		break;
+	case OVER:
+		XRenderComposite(bench.dpy, PictOpOver, bench.argb_pict, None, bench.dst_pict,
+				x, y, 0, 0, x, y, w, h);
+		break;
+	case GLYPH_A8:
+	case GLYPH_CA:
+		XRenderComposite(bench.dpy, PictOpOver, bench.solid_pict, bench.mask_pict,
+				bench.dst_pict, 0, 0, 0, 0, x, y, w, h);
+		break;
+	case PUT:
+		XPutImage(bench.dpy, bench.dst, bench.gc, bench.image, 0, 0, x, y, w, h);
+		break;
+	case GET:
+		image = XGetImage(bench.dpy, bench.dst, x, y, w, h, AllPlanes, ZPixmap);
+		if (image)
+			XDestroyImage(image);
+		break;
+	}
+}
+
+/* wait for the server, and the gpu, to finish: */
+static void
+finish(void)
+{
+	XImage *image = XGetImage(bench.dpy, bench.dst, 0, 0, 1, 1,
+			AllPlanes, ZPixmap);
+	if (image)
+		XDestroyImage(image);
+}
+
+static void
+run(const struct test *t, double duration)
+{
+	struct fd_mock_stats before, after;
+	int w = t->w ? MIN(t->w, bench.width) : bench.width;
+	int h = t->h ? MIN(t->h, bench.height) : bench.height;
+	double start, elapsed;
+	int i, n = 0;
+
+	/* leave room to scroll into: */
+	if (t->kind == SCROLL)
+		h = MIN(h, bench.height - 1);
+
+	setup(t, w, h);
+
+	for (i = 0; i < 16; i++)
+		op(t, w, h, i);
+	finish();
+
+	if (bench.stats)
+		before = *bench.stats;
+
+	start = now();
+	do {
+		for (i = 0; i < 64; i++)
+			op(t, w, h, n++);
+		XSync(bench.dpy, False);
+	} while ((now() - start) < duration);
+	finish();
+	elapsed = now() - start;
+
+	teardown(t);
+
+	printf("%-18s %10.0f", t->name, n / elapsed);
+
+	if (bench.stats) {
+		after = *bench.stats;
+#define DELTA(field) (double)(after.field - before.field)
+		printf(" %10.1f %10.2f %8.0f %8.0f %8.0f %8.0f",
+				DELTA(dwords) / n,
+				DELTA(calls[FD_MOCK_RING_RELOC]) / n,
+				DELTA(calls[FD_MOCK_RING_FLUSH]),
+				DELTA(calls[FD_MOCK_PIPE_WAIT]),
+				DELTA(calls[FD_MOCK_BO_CPU_PREP]),
+				DELTA(stall_us) / 1000);
+		if (after.sim_errors != before.sim_errors)
+			printf("  (%.0f simulator errors)", DELTA(sim_errors));
+#undef DELTA
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+static const struct fd_mock_stats *
+map_stats(const char *path)
+{
+	void *stats;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	stats = mmap(NULL, sizeof(struct fd_mock_stats), PROT_READ,
+			MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (stats == MAP_FAILED) {
+		perror(path);
+		return NULL;
+	}
+
+	return stats;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d display] [-s stats-file] [-t seconds] "
+			"[-w wait-seconds] [test-name-substring...]\n", name);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *display = NULL, *stats = NULL;
+	double duration = 1.0;
+	int wait = 0;
+	unsigned i;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:s:t:w:h")) != -1) {
+		switch (c) {
+		case 'd': display = optarg;          break;
+		case 's': stats = optarg;            break;
+		case 't': duration = atof(optarg);   break;
+		case 'w': wait = atoi(optarg);       break;
+		default:  usage(argv[0]);
+		}
+	}
+
+	/* the server might still be starting up: */
+	while (!(bench.dpy = XOpenDisplay(display)) && (wait-- > 0))
+		sleep(1);
+
+	if (!bench.dpy) {
+		fprintf(stderr, "could not open display %s\n", XDisplayName(display));
+		return 1;
+	}
+
+	if (stats && !(bench.stats = map_stats(stats)))
+		return 1;
+
+	init();
+
+	printf("%-18s %10s", "test", "ops/s");
+	if (bench.stats)
+		printf(" %10s %10s %8s %8s %8s %8s", "dwords/op", "relocs/op",
+				"flushes", "waits", "preps", "stall-ms");
+	printf("\n");
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		int j, match = (optind == argc);
+
+		for (j = optind; j < argc; j++)
+			if (strstr(tests[i].name, argv[j]))
+				match = 1;
+
+		if (match)
+			run(&tests[i], duration);
+	}
+
+	XCloseDisplay(bench.dpy);
+
+	return 0;
+}
@@ -0,0 +1,1536 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <freedreno_drmif.h>
+#include <freedreno_ringbuffer.h>
+
+#include "fd-mock.h"
+#include "z1xx-sim.h"
+
+#ifndef ARRAY_SIZE
+#  define ARRAY_SIZE(a) (sizeof((a)) / (sizeof(*(a))))
+#endif
+
+#define ALIGN(v, a)   (((v) + (a) - 1) & ~((a) - 1))
+
+/* libdrm reserves this many dwords at the start of z1xx rings for the
+ * context state (see next_ring() in msm-accel-z1xx.c):
+ */
+#define STATE_SIZE    0x140
+
+#define VBLANK_US     16667
+
+#define CRTC_ID       30
+#define ENCODER_ID    35
+#define CONNECTOR_ID  40
+#define PLANE_ID      50
+
+#define MAX_PLANES    4
+
+static const char *call_names[FD_MOCK_NUM_CALLS] = {
+	[FD_MOCK_DEVICE_NEW]     = "device_new",
+	[FD_MOCK_PIPE_NEW]       = "pipe_new",
+	[FD_MOCK_PIPE_WAIT]      = "pipe_wait",
+	[FD_MOCK_BO_NEW]         = "bo_new",
+	[FD_MOCK_BO_FROM_HANDLE] = "bo_from_handle",
+	[FD_MOCK_BO_FROM_NAME]   = "bo_from_name",
+	[FD_MOCK_BO_DEL]         = "bo_del",
+	[FD_MOCK_BO_MAP]         = "bo_map",
+	[FD_MOCK_BO_CPU_PREP]    = "bo_cpu_prep",
+	[FD_MOCK_BO_CPU_FINI]    = "bo_cpu_fini",
+	[FD_MOCK_RING_NEW]       = "ringbuffer_new",
+	[FD_MOCK_RING_RESET]     = "ringbuffer_reset",
+	[FD_MOCK_RING_FLUSH]     = "ringbuffer_flush",
+	[FD_MOCK_RING_RELOC]     = "ringbuffer_reloc",
+	[FD_MOCK_ADDFB]          = "drmModeAddFB",
+	[FD_MOCK_RMFB]           = "drmModeRmFB",
+	[FD_MOCK_SETCRTC]        = "drmModeSetCrtc",
+	[FD_MOCK_PAGEFLIP]       = "drmModePageFlip",
+	[FD_MOCK_WAITVBLANK]     = "drmWaitVBlank",
+	[FD_MOCK_HANDLE_EVENT]   = "drmHandleEvent",
+	[FD_MOCK_SETCURSOR]      = "drmModeSetCursor",
+	[FD_MOCK_MOVECURSOR]     = "drmModeMoveCursor",
+	[FD_MOCK_GETCONNECTOR]   = "drmModeGetConnector",
+	[FD_MOCK_SETPLANE]       = "drmModeSetPlane",
+};
+
+struct fd_device {
+	int refcnt;
+};
+
+struct fd_pipe {
+	struct fd_device *dev;
+	enum fd_pipe_id id;
+	uint32_t timestamp;     /* last submitted */
+	uint64_t done_us;       /* when the last submit completes */
+};
+
+struct fd_bo {
+	struct fd_device *dev;
+	uint32_t handle, size, iova;
+	int refcnt;
+	void *map;
+	struct fd_bo *next;
+};
+
+struct mock_ring {
+	struct fd_ringbuffer base;
+	uint32_t timestamp;
+};
+
+struct mock_fb {
+	uint32_t id, handle;
+	uint32_t width, height, pitch, bpp, depth;
+	struct mock_fb *next;
+};
+
+enum mock_event_type {
+	EVENT_VBLANK,
+	EVENT_FLIP,
+};
+
+struct mock_event {
+	enum mock_event_type type;
+	uint64_t msc;
+	void *data;
+};
+
+static struct fd_mock_stats local_stats;
+
+static struct {
+	int initialized;
+
+	int fd;                 /* timerfd, standing in for the drm fd */
+	uint64_t t0;            /* time of msc 0 */
+
+	drmModeModeInfo mode;
+	uint32_t crtc_fb;
+	int crtc_mode_valid;
+	int flip_pending;
+
+	/* overlay planes, and the fb each is showing (0 if disabled): */
+	int num_planes;
+	uint32_t plane_fb[MAX_PLANES];
+
+	struct mock_event events[64];
+	int num_events;
+
+	struct fd_bo *bos;
+	uint32_t last_handle;
+	uint32_t next_iova;
+
+	struct mock_fb *fbs;
+	uint32_t last_fb_id;
+
+	uint64_t gpu_us;
+	struct z1xx_sim *sim;
+
+	/* either local, or in FD_MOCK_SHM: */
+	struct fd_mock_stats *stats;
+} mock = {
+	.stats = &local_stats,
+};
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sleep_until(uint64_t t)
+{
+	uint64_t now = now_us();
+
+	if (t <= now)
+		return;
+
+	mock.stats->stalls++;
+	mock.stats->stall_us += t - now;
+	usleep(t - now);
+}
+
+static void
+mock_exit(void)
+{
+	const char *path = getenv("FD_MOCK_STATS");
+	if (path)
+		fd_mock_dump_stats(path);
+}
+
+/* mode with made up blanking, at 60Hz: */
+static void
+init_mode(drmModeModeInfo *mode, int w, int h)
+{
+	memset(mode, 0, sizeof(*mode));
+	mode->hdisplay    = w;
+	mode->hsync_start = w + 48;
+	mode->hsync_end   = w + 80;
+	mode->htotal      = w + 160;
+	mode->vdisplay    = h;
+	mode->vsync_start = h + 3;
+	mode->vsync_end   = h + 8;
+	mode->vtotal      = h + 45;
+	mode->vrefresh    = 60;
+	mode->clock       = mode->htotal * mode->vtotal * 60 / 1000;
+	mode->flags       = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_PVSYNC;
+	mode->type        = DRM_MODE_TYPE_PREFERRED | DRM_MODE_TYPE_DRIVER;
+	snprintf(mode->name, sizeof(mode->name), "%dx%d", w, h);
+}
+
+/* put the stats in a shared file, so another process (ie. exa-bench) can
+ * sample them while we run:
+ */
+static void
+init_shm(const char *path)
+{
+	struct fd_mock_stats *stats;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+
+	if (ftruncate(fd, sizeof(*stats)) == 0) {
+		stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+		if (stats != MAP_FAILED)
+			mock.stats = stats;
+	}
+
+	close(fd);
+}
+
+static void
+mock_init(void)
+{
+	const char *s;
+	int w = 1920, h = 1080;
+
+	if (mock.initialized)
+		return;
+
+	mock.initialized = 1;
+	mock.fd = -1;
+	mock.t0 = now_us();
+	mock.next_iova = 0x10000000;
+
+	s = getenv("FD_MOCK_MODE");
+	if (s && (sscanf(s, "%dx%d", &w, &h) != 2))
+		w = 1920, h = 1080;
+	init_mode(&mock.mode, w, h);
+
+	s = getenv("FD_MOCK_PLANES");
+	if (s) {
+		mock.num_planes = atoi(s);
+		if (mock.num_planes < 0)
+			mock.num_planes = 0;
+		if (mock.num_planes > MAX_PLANES)
+			mock.num_planes = MAX_PLANES;
+	}
+
+	s = getenv("FD_MOCK_GPU_US");
+	if (s)
+		mock.gpu_us = strtoull(s, NULL, 0);
+
+	if (!getenv("FD_MOCK_NOSIM"))
+		mock.sim = z1xx_sim_new();
+
+	s = getenv("FD_MOCK_SHM");
+	if (s)
+		init_shm(s);
+
+	atexit(mock_exit);
+}
+
+/*
+ * Stats:
+ */
+
+const char *
+fd_mock_call_name(enum fd_mock_call call)
+{
+	return call_names[call];
+}
+
+const struct fd_mock_stats *
+fd_mock_get_stats(void)
+{
+	mock_init();
+	return mock.stats;
+}
+
+void
+fd_mock_reset_stats(void)
+{
+	uint64_t bo_bytes = mock.stats->bo_bytes;
+	uint32_t bos = mock.stats->bos;
+
+	memset(mock.stats, 0, sizeof(*mock.stats));
+
+	/* these are current values, rather than counts: */
+	mock.stats->bo_bytes = mock.stats->bo_bytes_max = bo_bytes;
+	mock.stats->bos = bos;
+
+	if (mock.sim)
+		z1xx_sim_reset_stats(mock.sim);
+}
+
+void
+fd_mock_dump_stats(const char *path)
+{
+	const struct fd_mock_stats *stats = fd_mock_get_stats();
+	FILE *f = strcmp(path, "-") ? fopen(path, "w") : stderr;
+	int i;
+
+	if (!f)
+		return;
+
+	for (i = 0; i < FD_MOCK_NUM_CALLS; i++)
+		fprintf(f, "fd-mock: %-20s %llu\n", call_names[i],
+				(unsigned long long)stats->calls[i]);
+	fprintf(f, "fd-mock: %-20s %llu\n", "bo_bytes_max",
+			(unsigned long long)stats->bo_bytes_max);
+	fprintf(f, "fd-mock: %-20s %llu\n", "dwords",
+			(unsigned long long)stats->dwords);
+	fprintf(f, "fd-mock: %-20s %llu\n", "stalls",
+			(unsigned long long)stats->stalls);
+	fprintf(f, "fd-mock: %-20s %llu\n", "stall_us",
+			(unsigned long long)stats->stall_us);
+	fprintf(f, "fd-mock: %-20s %llu\n", "events",
+			(unsigned long long)stats->events);
+	fprintf(f, "fd-mock: %-20s %llu\n", "sim_errors",
+			(unsigned long long)stats->sim_errors);
+
+	if (f != stderr)
+		fclose(f);
+}
+
+struct z1xx_sim *
+fd_mock_sim(void)
+{
+	mock_init();
+	return mock.sim;
+}
+
+/*
+ * libdrm_freedreno:
+ */
+
+struct fd_device *
+fd_device_new(int fd)
+{
+	struct fd_device *dev;
+
+	mock_init();
+	mock.stats->calls[FD_MOCK_DEVICE_NEW]++;
+
+	dev = calloc(1, sizeof(*dev));
+	if (dev)
+		dev->refcnt = 1;
+
+	return dev;
+}
+
+struct fd_device *
+fd_device_new_dup(int fd)
+{
+	return fd_device_new(fd);
+}
+
+struct fd_device *
+fd_device_ref(struct fd_device *dev)
+{
+	dev->refcnt++;
+	return dev;
+}
+
+void
+fd_device_del(struct fd_device *dev)
+{
+	if (dev && !--dev->refcnt)
+		free(dev);
+}
+
+struct fd_pipe *
+fd_pipe_new(struct fd_device *dev, enum fd_pipe_id id)
+{
+	struct fd_pipe *pipe;
+
+	mock.stats->calls[FD_MOCK_PIPE_NEW]++;
+
+	pipe = calloc(1, sizeof(*pipe));
+	if (!pipe)
+		return NULL;
+
+	pipe->dev = dev;
+	pipe->id = id;
+
+	return pipe;
+}
+
+void
+fd_pipe_del(struct fd_pipe *pipe)
+{
+	free(pipe);
+}
+
+/* submits complete in order, so this (conservatively) waits for the last
+ * one rather than tracking the completion time of each:
+ */
+int
+fd_pipe_wait(struct fd_pipe *pipe, uint32_t timestamp)
+{
+	mock.stats->calls[FD_MOCK_PIPE_WAIT]++;
+
+	if (timestamp && (timestamp <= pipe->timestamp))
+		sleep_until(pipe->done_us);
+
+	return 0;
+}
+
+int
+fd_pipe_wait_timeout(struct fd_pipe *pipe, uint32_t timestamp,
+		uint64_t timeout)
+{
+	return fd_pipe_wait(pipe, timestamp);
+}
+
+static struct fd_bo *
+lookup_bo(uint32_t handle)
+{
+	struct fd_bo *bo;
+
+	for (bo = mock.bos; bo; bo = bo->next)
+		if (bo->handle == handle)
+			return bo;
+
+	return NULL;
+}
+
+static struct fd_bo *
+bo_new(struct fd_device *dev, uint32_t handle, uint32_t size)
+{
+	struct fd_bo *bo;
+
+	bo = calloc(1, sizeof(*bo));
+	if (!bo)
+		return NULL;
+
+	bo->map = mmap(NULL, ALIGN(size, 0x1000), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bo->map == MAP_FAILED) {
+		free(bo);
+		return NULL;
+	}
+
+	bo->dev = dev;
+	bo->handle = handle;
+	bo->size = size;
+	bo->refcnt = 1;
+
+	/* leave a gap between buffers, so overruns hit unmapped gpu
+	 * addresses in the simulator:
+	 */
+	bo->iova = mock.next_iova;
+	mock.next_iova += ALIGN(size, 0x1000) + 0x1000;
+
+	if (mock.sim)
+		z1xx_sim_map(mock.sim, bo->iova, bo->map, size);
+
+	bo->next = mock.bos;
+	mock.bos = bo;
+
+	mock.stats->bos++;
+	mock.stats->bo_bytes += size;
+	if (mock.stats->bo_bytes > mock.stats->bo_bytes_max)
+		mock.stats->bo_bytes_max = mock.stats->bo_bytes;
+
+	return bo;
+}
+
+struct fd_bo *
+fd_bo_new(struct fd_device *dev, uint32_t size, uint32_t flags)
+{
+	mock.stats->calls[FD_MOCK_BO_NEW]++;
+	return bo_new(dev, ++mock.last_handle, size);
+}
+
+struct fd_bo *
+fd_bo_from_handle(struct fd_device *dev, uint32_t handle, uint32_t size)
+{
+	struct fd_bo *bo;
+
+	mock.stats->calls[FD_MOCK_BO_FROM_HANDLE]++;
+
+	bo = lookup_bo(handle);
+	if (bo)
+		return fd_bo_ref(bo);
+
+	return bo_new(dev, handle, size);
+}
+
+/* flink names are the same as the handles: */
+struct fd_bo *
+fd_bo_from_name(struct fd_device *dev, uint32_t name)
+{
+	struct fd_bo *bo;
+
+	mock.stats->calls[FD_MOCK_BO_FROM_NAME]++;
+
+	bo = lookup_bo(name);
+	if (bo)
+		return fd_bo_ref(bo);
+
+	return NULL;
+}
+
+struct fd_bo *
+fd_bo_from_dmabuf(struct fd_device *dev, int fd)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+struct fd_bo *
+fd_bo_from_fbdev(struct fd_pipe *pipe, int fbfd, uint32_t size)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+struct fd_bo *
+fd_bo_ref(struct fd_bo *bo)
+{
+	bo->refcnt++;
+	return bo;
+}
+
+void
+fd_bo_del(struct fd_bo *bo)
+{
+	struct fd_bo **p;
+
+	if (!bo)
+		return;
+
+	mock.stats->calls[FD_MOCK_BO_DEL]++;
+
+	if (--bo->refcnt)
+		return;
+
+	for (p = &mock.bos; *p; p = &(*p)->next) {
+		if (*p == bo) {
+			*p = bo->next;
+			break;
+		}
+	}
+
+	if (mock.sim)
+		z1xx_sim_unmap(mock.sim, bo->iova);
+
+	mock.stats->bos--;
+	mock.stats->bo_bytes -= bo->size;
+
+	munmap(bo->map, ALIGN(bo->size, 0x1000));
+	free(bo);
+}
+
+int
+fd_bo_get_name(struct fd_bo *bo, uint32_t *name)
+{
+	*name = bo->handle;
+	return 0;
+}
+
+uint32_t
+fd_bo_handle(struct fd_bo *bo)
+{
+	return bo->handle;
+}
+
+int
+fd_bo_dmabuf(struct fd_bo *bo)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+uint32_t
+fd_bo_size(struct fd_bo *bo)
+{
+	return bo->size;
+}
+
+void *
+fd_bo_map(struct fd_bo *bo)
+{
+	mock.stats->calls[FD_MOCK_BO_MAP]++;
+	return bo->map;
+}
+
+/* there is only one pipe doing any rendering, so cpu access waits for
+ * that to be idle:
+ */
+int
+fd_bo_cpu_prep(struct fd_bo *bo, struct fd_pipe *pipe, uint32_t op)
+{
+	mock.stats->calls[FD_MOCK_BO_CPU_PREP]++;
+
+	if (!pipe)
+		return 0;
+
+	if (op & DRM_FREEDRENO_PREP_NOSYNC)
+		return (now_us() < pipe->done_us) ? -EBUSY : 0;
+
+	sleep_until(pipe->done_us);
+
+	return 0;
+}
+
+void
+fd_bo_cpu_fini(struct fd_bo *bo)
+{
+	mock.stats->calls[FD_MOCK_BO_CPU_FINI]++;
+}
+
+struct fd_ringbuffer *
+fd_ringbuffer_new(struct fd_pipe *pipe, uint32_t size)
+{
+	struct mock_ring *ring;
+
+	mock.stats->calls[FD_MOCK_RING_NEW]++;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->base.start = calloc(1, size);
+	if (!ring->base.start) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->base.size = size;
+	ring->base.end = &ring->base.start[size / 4];
+	ring->base.pipe = pipe;
+
+	fd_ringbuffer_reset(&ring->base);
+	mock.stats->calls[FD_MOCK_RING_RESET]--;
+
+	return &ring->base;
+}
+
+void
+fd_ringbuffer_del(struct fd_ringbuffer *ring)
+{
+	if (!ring)
+		return;
+	free(ring->start);
+	free(ring);
+}
+
+void
+fd_ringbuffer_set_parent(struct fd_ringbuffer *ring,
+		struct fd_ringbuffer *parent)
+{
+}
+
+void
+fd_ringbuffer_reset(struct fd_ringbuffer *ring)
+{
+	uint32_t *start = ring->start;
+
+	mock.stats->calls[FD_MOCK_RING_RESET]++;
+
+	if (ring->pipe->id == FD_PIPE_2D)
+		start = &ring->start[STATE_SIZE];
+
+	ring->cur = ring->last_start = start;
+}
+
+int
+fd_ringbuffer_flush(struct fd_ringbuffer *ring)
+{
+	struct mock_ring *mring = (struct mock_ring *)ring;
+	struct fd_pipe *pipe = ring->pipe;
+	uint64_t now = now_us();
+
+	mock.stats->calls[FD_MOCK_RING_FLUSH]++;
+	mock.stats->dwords += ring->cur - ring->last_start;
+
+	if (mock.sim && (pipe->id == FD_PIPE_2D)) {
+		/* the context state is executed with each submit: */
+		mock.stats->sim_errors +=
+				z1xx_sim_exec(mock.sim, ring->start, STATE_SIZE);
+		mock.stats->sim_errors += z1xx_sim_exec(mock.sim, ring->last_start,
+				ring->cur - ring->last_start);
+	}
+
+	mring->timestamp = ++pipe->timestamp;
+	pipe->done_us = ((pipe->done_us > now) ? pipe->done_us : now) +
+			mock.gpu_us;
+
+	ring->last_start = ring->cur;
+
+	return 0;
+}
+
+uint32_t
+fd_ringbuffer_timestamp(struct fd_ringbuffer *ring)
+{
+	return ((struct mock_ring *)ring)->timestamp;
+}
+
+void
+fd_ringbuffer_reloc(struct fd_ringbuffer *ring, const struct fd_reloc *reloc)
+{
+	uint32_t addr = reloc->bo->iova + reloc->offset;
+
+	mock.stats->calls[FD_MOCK_RING_RELOC]++;
+
+	if (reloc->shift < 0)
+		addr >>= -reloc->shift;
+	else
+		addr <<= reloc->shift;
+
+	(*ring->cur++) = addr | reloc->or;
+}
+
+/*
+ * libdrm core:
+ */
+
+void
+drmSetServerInfo(drmServerInfoPtr info)
+{
+}
+
+int
+drmOpen(const char *name, const char *busid)
+{
+	mock_init();
+
+	if (strcmp(name, "msm")) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	if (mock.fd < 0)
+		mock.fd = timerfd_create(CLOCK_MONOTONIC,
+				TFD_NONBLOCK | TFD_CLOEXEC);
+
+	return mock.fd;
+}
+
+int
+drmClose(int fd)
+{
+	if (fd == mock.fd)
+		mock.fd = -1;
+	return close(fd);
+}
+
+drmVersionPtr
+drmGetVersion(int fd)
+{
+	drmVersionPtr version = calloc(1, sizeof(*version));
+
+	if (!version)
+		return NULL;
+
+	version->version_major = 1;
+	version->name = strdup("msm");
+	version->name_len = strlen(version->name);
+	version->date = strdup("0");
+	version->date_len = strlen(version->date);
+	version->desc = strdup("fd-mock");
+	version->desc_len = strlen(version->desc);
+
+	return version;
+}
+
+void
+drmFreeVersion(drmVersionPtr version)
+{
+	if (!version)
+		return;
+	free(version->name);
+	free(version->date);
+	free(version->desc);
+	free(version);
+}
+
+char *
+drmGetDeviceNameFromFd(int fd)
+{
+	return strdup("/dev/dri/card0");
+}
+
+int
+drmGetCap(int fd, uint64_t capability, uint64_t *value)
+{
+	switch (capability) {
+	case DRM_CAP_ASYNC_PAGE_FLIP:
+	case DRM_CAP_TIMESTAMP_MONOTONIC:
+		*value = 1;
+		return 0;
+#ifdef DRM_CAP_CURSOR_WIDTH
+	case DRM_CAP_CURSOR_WIDTH:
+	case DRM_CAP_CURSOR_HEIGHT:
+		*value = 64;
+		return 0;
+#endif
+	default:
+		return -EINVAL;
+	}
+}
+
+/* no atomic or universal planes: */
+int
+drmSetClientCap(int fd, uint64_t capability, uint64_t value)
+{
+	return -EINVAL;
+}
+
+int
+drmSetMaster(int fd)
+{
+	return 0;
+}
+
+int
+drmDropMaster(int fd)
+{
+	return 0;
+}
+
+int
+drmGetMagic(int fd, drm_magic_t *magic)
+{
+	*magic = 1;
+	return 0;
+}
+
+int
+drmAuthMagic(int fd, drm_magic_t magic)
+{
+	return 0;
+}
+
+/*
+ * Events.  The drm fd is a timerfd, armed for the vblank of the earliest
+ * pending event:
+ */
+
+static uint64_t
+cur_msc(void)
+{
+	return (now_us() - mock.t0) / VBLANK_US;
+}
+
+static uint64_t
+msc_time(uint64_t msc)
+{
+	return mock.t0 + msc * VBLANK_US;
+}
+
+static void
+arm_timer(void)
+{
+	struct itimerspec its = {{0}};
+	uint64_t msc = ~0ULL, t;
+	int i;
+
+	for (i = 0; i < mock.num_events; i++)
+		if (mock.events[i].msc < msc)
+			msc = mock.events[i].msc;
+
+	if (mock.num_events) {
+		t = msc_time(msc);
+		its.it_value.tv_sec = t / 1000000;
+		its.it_value.tv_nsec = (t % 1000000) * 1000;
+	}
+
+	timerfd_settime(mock.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int
+queue_event(enum mock_event_type type, uint64_t msc, void *data)
+{
+	if (mock.num_events == ARRAY_SIZE(mock.events))
+		return -EBUSY;
+
+	mock.events[mock.num_events++] = (struct mock_event){
+		.type = type,
+		.msc = msc,
+		.data = data,
+	};
+
+	arm_timer();
+
+	return 0;
+}
+
+int
+drmHandleEvent(int fd, drmEventContextPtr evctx)
+{
+	struct mock_event due[ARRAY_SIZE(mock.events)];
+	uint64_t expirations, msc = cur_msc();
+	int i, n = 0;
+
+	mock.stats->calls[FD_MOCK_HANDLE_EVENT]++;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return -1;
+
+	/* handlers can queue new events, so pull out the due ones first: */
+	for (i = 0; i < mock.num_events; ) {
+		if (mock.events[i].msc <= msc) {
+			due[n++] = mock.events[i];
+			mock.events[i] = mock.events[--mock.num_events];
+		} else {
+			i++;
+		}
+	}
+
+	arm_timer();
+
+	for (i = 0; i < n; i++) {
+		uint64_t t = msc_time(due[i].msc);
+		unsigned int sec = t / 1000000, usec = t % 1000000;
+
+		mock.stats->events++;
+
+		if (due[i].type == EVENT_FLIP) {
+			mock.flip_pending = 0;
+#if DRM_EVENT_CONTEXT_VERSION >= 3
+			if ((evctx->version >= 3) && evctx->page_flip_handler2) {
+				evctx->page_flip_handler2(fd, due[i].msc, sec, usec,
+						CRTC_ID, due[i].data);
+				continue;
+			}
+#endif
+			if ((evctx->version >= 2) && evctx->page_flip_handler)
+				evctx->page_flip_handler(fd, due[i].msc, sec, usec,
+						due[i].data);
+		} else if (evctx->vblank_handler) {
+			evctx->vblank_handler(fd, due[i].msc, sec, usec,
+					due[i].data);
+		}
+	}
+
+	return 0;
+}
+
+int
+drmWaitVBlank(int fd, drmVBlankPtr vbl)
+{
+	unsigned int type = vbl->request.type;
+	uint64_t msc = cur_msc(), target;
+	uint64_t t;
+
+	mock.stats->calls[FD_MOCK_WAITVBLANK]++;
+
+	target = vbl->request.sequence;
+	if (type & DRM_VBLANK_RELATIVE)
+		target += msc;
+
+	if ((type & DRM_VBLANK_NEXTONMISS) && (target <= msc))
+		target = msc + 1;
+
+	if (type & DRM_VBLANK_EVENT) {
+		int ret = queue_event(EVENT_VBLANK, target,
+				(void *)vbl->request.signal);
+		if (ret) {
+			errno = -ret;
+			return -1;
+		}
+		vbl->reply.sequence = target;
+		return 0;
+	}
+
+	if (target > msc) {
+		sleep_until(msc_time(target));
+		msc = target;
+	}
+
+	t = msc_time(msc);
+	vbl->reply.sequence = msc;
+	vbl->reply.tval_sec = t / 1000000;
+	vbl->reply.tval_usec = t % 1000000;
+
+	return 0;
+}
+
+/*
+ * KMS.  There is a single crtc, encoder and (connected) connector:
+ */
+
+static struct mock_fb *
+lookup_fb(uint32_t id)
+{
+	struct mock_fb *fb;
+
+	for (fb = mock.fbs; fb; fb = fb->next)
+		if (fb->id == id)
+			return fb;
+
+	return NULL;
+}
+
+drmModeResPtr
+drmModeGetResources(int fd)
+{
+	drmModeResPtr res = calloc(1, sizeof(*res));
+
+	if (!res)
+		return NULL;
+
+	res->count_crtcs = 1;
+	res->crtcs = malloc(sizeof(uint32_t));
+	res->count_encoders = 1;
+	res->encoders = malloc(sizeof(uint32_t));
+	res->count_connectors = 1;
+	res->connectors = malloc(sizeof(uint32_t));
+
+	if (!res->crtcs || !res->encoders || !res->connectors) {
+		drmModeFreeResources(res);
+		return NULL;
+	}
+
+	res->crtcs[0] = CRTC_ID;
+	res->encoders[0] = ENCODER_ID;
+	res->connectors[0] = CONNECTOR_ID;
+	res->min_width = res->min_height = 1;
+	res->max_width = res->max_height = 4096;
+
+	return res;
+}
+
+void
+drmModeFreeResources(drmModeResPtr res)
+{
+	if (!res)
+		return;
+	free(res->fbs);
+	free(res->crtcs);
+	free(res->encoders);
+	free(res->connectors);
+	free(res);
+}
+
+drmModeConnectorPtr
+drmModeGetConnector(int fd, uint32_t connector_id)
+{
+	drmModeConnectorPtr c;
+
+	mock.stats->calls[FD_MOCK_GETCONNECTOR]++;
+
+	if (connector_id != CONNECTOR_ID) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->modes = malloc(sizeof(*c->modes));
+	c->encoders = malloc(sizeof(*c->encoders));
+	if (!c->modes || !c->encoders) {
+		drmModeFreeConnector(c);
+		return NULL;
+	}
+
+	c->connector_id = CONNECTOR_ID;
+	c->encoder_id = ENCODER_ID;
+	c->connector_type = DRM_MODE_CONNECTOR_HDMIA;
+	c->connector_type_id = 1;
+	c->connection = DRM_MODE_CONNECTED;
+	/* ~96dpi: */
+	c->mmWidth = mock.mode.hdisplay * 254 / 960;
+	c->mmHeight = mock.mode.vdisplay * 254 / 960;
+	c->subpixel = DRM_MODE_SUBPIXEL_UNKNOWN;
+	c->count_modes = 1;
+	c->modes[0] = mock.mode;
+	c->count_encoders = 1;
+	c->encoders[0] = ENCODER_ID;
+
+	return c;
+}
+
+drmModeConnectorPtr
+drmModeGetConnectorCurrent(int fd, uint32_t connector_id)
+{
+	return drmModeGetConnector(fd, connector_id);
+}
+
+void
+drmModeFreeConnector(drmModeConnectorPtr c)
+{
+	if (!c)
+		return;
+	free(c->modes);
+	free(c->props);
+	free(c->prop_values);
+	free(c->encoders);
+	free(c);
+}
+
+drmModeEncoderPtr
+drmModeGetEncoder(int fd, uint32_t encoder_id)
+{
+	drmModeEncoderPtr e;
+
+	if (encoder_id != ENCODER_ID) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+
+	e->encoder_id = ENCODER_ID;
+	e->encoder_type = DRM_MODE_ENCODER_TMDS;
+	e->crtc_id = CRTC_ID;
+	e->possible_crtcs = 0x1;
+
+	return e;
+}
+
+void
+drmModeFreeEncoder(drmModeEncoderPtr e)
+{
+	free(e);
+}
+
+drmModeCrtcPtr
+drmModeGetCrtc(int fd, uint32_t crtc_id)
+{
+	drmModeCrtcPtr crtc;
+
+	if (crtc_id != CRTC_ID) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	crtc = calloc(1, sizeof(*crtc));
+	if (!crtc)
+		return NULL;
+
+	crtc->crtc_id = CRTC_ID;
+	crtc->buffer_id = mock.crtc_fb;
+	crtc->mode_valid = mock.crtc_mode_valid;
+	if (crtc->mode_valid) {
+		crtc->mode = mock.mode;
+		crtc->width = mock.mode.hdisplay;
+		crtc->height = mock.mode.vdisplay;
+	}
+	crtc->gamma_size = 256;
+
+	return crtc;
+}
+
+void
+drmModeFreeCrtc(drmModeCrtcPtr crtc)
+{
+	free(crtc);
+}
+
+int
+drmModeSetCrtc(int fd, uint32_t crtc_id, uint32_t buffer_id,
+		uint32_t x, uint32_t y, uint32_t *connectors, int count,
+		drmModeModeInfoPtr mode)
+{
+	mock.stats->calls[FD_MOCK_SETCRTC]++;
+
+	if ((crtc_id != CRTC_ID) || (buffer_id && !lookup_fb(buffer_id)))
+		return -EINVAL;
+
+	mock.crtc_fb = buffer_id;
+	mock.crtc_mode_valid = !!mode;
+
+	return 0;
+}
+
+int
+drmModeCrtcSetGamma(int fd, uint32_t crtc_id, uint32_t size,
+		uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+	return 0;
+}
+
+int
+drmModeAddFB(int fd, uint32_t width, uint32_t height, uint8_t depth,
+		uint8_t bpp, uint32_t pitch, uint32_t bo_handle, uint32_t *buf_id)
+{
+	struct mock_fb *fb;
+
+	mock.stats->calls[FD_MOCK_ADDFB]++;
+
+	if (!lookup_bo(bo_handle))
+		return -ENOENT;
+
+	fb = calloc(1, sizeof(*fb));
+	if (!fb)
+		return -ENOMEM;
+
+	fb->id = *buf_id = ++mock.last_fb_id + 100;
+	fb->handle = bo_handle;
+	fb->width = width;
+	fb->height = height;
+	fb->pitch = pitch;
+	fb->bpp = bpp;
+	fb->depth = depth;
+	fb->next = mock.fbs;
+	mock.fbs = fb;
+
+	return 0;
+}
+
+int
+drmModeRmFB(int fd, uint32_t buffer_id)
+{
+	struct mock_fb **p;
+	int i;
+
+	mock.stats->calls[FD_MOCK_RMFB]++;
+
+	for (p = &mock.fbs; *p; p = &(*p)->next) {
+		if ((*p)->id == buffer_id) {
+			struct mock_fb *fb = *p;
+			*p = fb->next;
+			free(fb);
+			/* like the kernel, removing the scanout fb disables the crtc
+			 * (or plane):
+			 */
+			if (mock.crtc_fb == buffer_id) {
+				mock.crtc_fb = 0;
+				mock.crtc_mode_valid = 0;
+			}
+			for (i = 0; i < mock.num_planes; i++)
+				if (mock.plane_fb[i] == buffer_id)
+					mock.plane_fb[i] = 0;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+drmModeFBPtr
+drmModeGetFB(int fd, uint32_t buffer_id)
+{
+	struct mock_fb *mfb = lookup_fb(buffer_id);
+	drmModeFBPtr fb;
+
+	if (!mfb) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	fb = calloc(1, sizeof(*fb));
+	if (!fb)
+		return NULL;
+
+	fb->fb_id = mfb->id;
+	fb->width = mfb->width;
+	fb->height = mfb->height;
+	fb->pitch = mfb->pitch;
+	fb->bpp = mfb->bpp;
+	fb->depth = mfb->depth;
+	fb->handle = mfb->handle;
+
+	return fb;
+}
+
+void
+drmModeFreeFB(drmModeFBPtr fb)
+{
+	free(fb);
+}
+
+int
+drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id,
+		uint32_t flags, void *user_data)
+{
+	uint64_t msc = cur_msc();
+	int ret;
+
+	mock.stats->calls[FD_MOCK_PAGEFLIP]++;
+
+	if ((crtc_id != CRTC_ID) || !lookup_fb(fb_id) || !mock.crtc_mode_valid)
+		return -EINVAL;
+
+	if (mock.flip_pending)
+		return -EBUSY;
+
+	/* async flips complete right away, others on the next vblank: */
+	if (!(flags & DRM_MODE_PAGE_FLIP_ASYNC))
+		msc++;
+
+	if (flags & DRM_MODE_PAGE_FLIP_EVENT) {
+		ret = queue_event(EVENT_FLIP, msc, user_data);
+		if (ret)
+			return ret;
+		mock.flip_pending = 1;
+	}
+
+	mock.crtc_fb = fb_id;
+
+	return 0;
+}
+
+int
+drmModeSetCursor(int fd, uint32_t crtc_id, uint32_t bo_handle,
+		uint32_t width, uint32_t height)
+{
+	mock.stats->calls[FD_MOCK_SETCURSOR]++;
+	return 0;
+}
+
+int
+drmModeSetCursor2(int fd, uint32_t crtc_id, uint32_t bo_handle,
+		uint32_t width, uint32_t height, int32_t hot_x, int32_t hot_y)
+{
+	return drmModeSetCursor(fd, crtc_id, bo_handle, width, height);
+}
+
+int
+drmModeMoveCursor(int fd, uint32_t crtc_id, int x, int y)
+{
+	mock.stats->calls[FD_MOCK_MOVECURSOR]++;
+	return 0;
+}
+
+/* no properties or blobs: */
+
+drmModePropertyPtr
+drmModeGetProperty(int fd, uint32_t property_id)
+{
+	errno = ENOENT;
+	return NULL;
+}
+
+void
+drmModeFreeProperty(drmModePropertyPtr prop)
+{
+	free(prop);
+}
+
+int
+drmModeConnectorSetProperty(int fd, uint32_t connector_id,
+		uint32_t property_id, uint64_t value)
+{
+	return -EINVAL;
+}
+
+drmModeObjectPropertiesPtr
+drmModeObjectGetProperties(int fd, uint32_t object_id, uint32_t object_type)
+{
+	return calloc(1, sizeof(drmModeObjectProperties));
+}
+
+void
+drmModeFreeObjectProperties(drmModeObjectPropertiesPtr props)
+{
+	if (!props)
+		return;
+	free(props->props);
+	free(props->prop_values);
+	free(props);
+}
+
+drmModePropertyBlobPtr
+drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+{
+	errno = ENOENT;
+	return NULL;
+}
+
+void
+drmModeFreePropertyBlob(drmModePropertyBlobPtr blob)
+{
+	free(blob);
+}
+
+int
+drmModeCreatePropertyBlob(int fd, const void *data, size_t length,
+		uint32_t *id)
+{
+	return -ENOSYS;
+}
+
+int
+drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+	return 0;
+}
+
+/* Overlay planes, without a type property (like older kernels), which
+ * can scan out XRGB8888 fbs on the crtc, with scaling:
+ */
+
+static int
+plane_idx(uint32_t plane_id)
+{
+	int idx = plane_id - PLANE_ID;
+
+	if ((idx < 0) || (idx >= mock.num_planes))
+		return -1;
+
+	return idx;
+}
+
+drmModePlaneResPtr
+drmModeGetPlaneResources(int fd)
+{
+	drmModePlaneResPtr res = calloc(1, sizeof(*res));
+	int i;
+
+	if (!res)
+		return NULL;
+
+	if (mock.num_planes) {
+		res->planes = calloc(mock.num_planes, sizeof(*res->planes));
+		if (!res->planes) {
+			free(res);
+			return NULL;
+		}
+		res->count_planes = mock.num_planes;
+		for (i = 0; i < mock.num_planes; i++)
+			res->planes[i] = PLANE_ID + i;
+	}
+
+	return res;
+}
+
+void
+drmModeFreePlaneResources(drmModePlaneResPtr res)
+{
+	if (!res)
+		return;
+	free(res->planes);
+	free(res);
+}
+
+drmModePlanePtr
+drmModeGetPlane(int fd, uint32_t plane_id)
+{
+	int idx = plane_idx(plane_id);
+	drmModePlanePtr plane;
+
+	if (idx < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	plane = calloc(1, sizeof(*plane));
+	if (!plane)
+		return NULL;
+
+	plane->formats = calloc(1, sizeof(*plane->formats));
+	if (!plane->formats) {
+		free(plane);
+		return NULL;
+	}
+
+	plane->count_formats = 1;
+	plane->formats[0] = DRM_FORMAT_XRGB8888;
+	plane->plane_id = plane_id;
+	plane->possible_crtcs = 1;
+	plane->fb_id = mock.plane_fb[idx];
+	plane->crtc_id = plane->fb_id ? CRTC_ID : 0;
+
+	return plane;
+}
+
+void
+drmModeFreePlane(drmModePlanePtr plane)
+{
+	if (!plane)
+		return;
+	free(plane->formats);
+	free(plane);
+}
+
+int
+drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
+		uint32_t fb_id, uint32_t flags,
+		int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+		uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	int idx = plane_idx(plane_id);
+	struct mock_fb *fb;
+
+	mock.stats->calls[FD_MOCK_SETPLANE]++;
+
+	if (idx < 0) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	if (!fb_id) {
+		mock.plane_fb[idx] = 0;
+		return 0;
+	}
+
+	fb = lookup_fb(fb_id);
+
+	/* same checks as the kernel does, the source (16.16 fixed point)
+	 * has to be inside the fb, and the destination inside the mode:
+	 */
+	if ((crtc_id != CRTC_ID) || !fb || !mock.crtc_mode_valid ||
+			(fb->bpp != 32) || !src_w || !src_h ||
+			!crtc_w || !crtc_h || (crtc_x < 0) || (crtc_y < 0) ||
+			((uint64_t)src_x + src_w > ((uint64_t)fb->width << 16)) ||
+			((uint64_t)src_y + src_h > ((uint64_t)fb->height << 16)) ||
+			(crtc_x + crtc_w > mock.mode.hdisplay) ||
+			(crtc_y + crtc_h > mock.mode.vdisplay)) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	mock.plane_fb[idx] = fb_id;
+
+	return 0;
+}
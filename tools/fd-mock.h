@@ -0,0 +1,102 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FD_MOCK_H_
+#define FD_MOCK_H_
+
+#include <stdint.h>
+
+/*
+ * Stand-in for libdrm_freedreno and the libdrm KMS API, which lets the
+ * driver run without a gpu or display: either LD_PRELOAD'd into the
+ * xserver, or linked directly into a test harness.
+ *
+ * Buffers live in anonymous memory, and the device looks like a z1xx
+ * (2d pipe) with one connector/crtc, and optionally overlay planes.  Submits are executed by the z1xx
+ * simulator (unless FD_MOCK_NOSIM is set), and complete FD_MOCK_GPU_US
+ * usec (default 0) after they are flushed.  Vblank and page-flip events
+ * are delivered at a 60Hz cadence through the drm fd, which is a timerfd.
+ *
+ * Environment:
+ *   FD_MOCK_MODE=WxH      mode of the connector (default 1920x1080)
+ *   FD_MOCK_PLANES=n      number of (XRGB8888, scaling) overlay planes on
+ *                         the crtc, at most 4 (default 0)
+ *   FD_MOCK_GPU_US=n      simulated gpu latency of a submit
+ *   FD_MOCK_NOSIM=1       don't execute submits
+ *   FD_MOCK_STATS=path    dump stats at exit ("-" for stderr)
+ *   FD_MOCK_SHM=path      keep the live stats in a shared file, which
+ *                         other processes can mmap (see exa-bench.c)
+ */
+
+enum fd_mock_call {
+	FD_MOCK_DEVICE_NEW,
+	FD_MOCK_PIPE_NEW,
+	FD_MOCK_PIPE_WAIT,
+	FD_MOCK_BO_NEW,
+	FD_MOCK_BO_FROM_HANDLE,
+	FD_MOCK_BO_FROM_NAME,
+	FD_MOCK_BO_DEL,
+	FD_MOCK_BO_MAP,
+	FD_MOCK_BO_CPU_PREP,
+	FD_MOCK_BO_CPU_FINI,
+	FD_MOCK_RING_NEW,
+	FD_MOCK_RING_RESET,
+	FD_MOCK_RING_FLUSH,
+	FD_MOCK_RING_RELOC,
+	FD_MOCK_ADDFB,
+	FD_MOCK_RMFB,
+	FD_MOCK_SETCRTC,
+	FD_MOCK_PAGEFLIP,
+	FD_MOCK_WAITVBLANK,
+	FD_MOCK_HANDLE_EVENT,
+	FD_MOCK_SETCURSOR,
+	FD_MOCK_MOVECURSOR,
+	FD_MOCK_GETCONNECTOR,
+	FD_MOCK_SETPLANE,
+	FD_MOCK_NUM_CALLS
+};
+
+struct fd_mock_stats {
+	uint64_t calls[FD_MOCK_NUM_CALLS];
+
+	uint64_t bo_bytes;          /* currently allocated */
+	uint64_t bo_bytes_max;      /* high water mark */
+	uint32_t bos;               /* currently allocated */
+
+	uint64_t dwords;            /* dwords submitted (excl. context state) */
+	uint64_t stalls;            /* waits/cpu_preps that had to block */
+	uint64_t stall_us;          /* usec spent blocked */
+	uint64_t events;            /* vblank/flip events delivered */
+
+	uint64_t sim_errors;        /* problems seen by the simulator */
+};
+
+const char *fd_mock_call_name(enum fd_mock_call call);
+const struct fd_mock_stats *fd_mock_get_stats(void);
+void fd_mock_reset_stats(void);
+void fd_mock_dump_stats(const char *path);
+
+/* the simulator executing submits (NULL if FD_MOCK_NOSIM): */
+struct z1xx_sim *fd_mock_sim(void);
+
+#endif /* FD_MOCK_H_ */
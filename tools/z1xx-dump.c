@@ -0,0 +1,500 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Decoder for the cmdstream traces written by the driver with Option
+ * "TraceFile" (see msm-trace.h).  Prints each submit, oldest first, with
+ * the REG/REGM packets decoded into register names and bitfields from
+ * freedreno_z1xx.h, and the relocs annotated with the bo they point at.
+ *
+ * Capture files (Option "CaptureFile") are decoded the same way, with
+ * the bo contents they carry listed but not dumped.
+ *
+ * With -e/-d it instead switches tracing on/off in the (running) server.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "freedreno_z1xx.h"
+#include "msm-trace.h"
+
+static const char *reg_names[256] = {
+#define NAME(reg) [reg] = #reg
+	NAME(G2D_BASE0),
+	NAME(G2D_CFG0),
+	NAME(G2D_CFG1),
+	NAME(G2D_SCISSORX),
+	NAME(G2D_SCISSORY),
+	NAME(G2D_FOREGROUND),
+	NAME(G2D_BACKGROUND),
+	NAME(G2D_ALPHABLEND),
+	NAME(G2D_ROP),
+	NAME(G2D_CONFIG),
+	NAME(G2D_INPUT),
+	NAME(G2D_MASK),
+	NAME(G2D_BLENDERCFG),
+	NAME(G2D_CONST0),
+	NAME(G2D_CONST1),
+	NAME(G2D_CONST2),
+	NAME(G2D_CONST3),
+	NAME(G2D_CONST4),
+	NAME(G2D_CONST5),
+	NAME(G2D_CONST6),
+	NAME(G2D_CONST7),
+	NAME(G2D_GRADIENT),
+	NAME(G2D_XY),
+	NAME(G2D_WIDTHHEIGHT),
+	NAME(G2D_SXY),
+	NAME(G2D_SXY2),
+	NAME(G2D_IDLE),
+	NAME(G2D_COLOR),
+	NAME(G2D_BLEND_A0),
+	NAME(G2D_BLEND_A1),
+	NAME(G2D_BLEND_A2),
+	NAME(G2D_BLEND_A3),
+	NAME(G2D_BLEND_C0),
+	NAME(G2D_BLEND_C1),
+	NAME(G2D_BLEND_C2),
+	NAME(G2D_BLEND_C3),
+	NAME(G2D_BLEND_C4),
+	NAME(G2D_BLEND_C5),
+	NAME(G2D_BLEND_C6),
+	NAME(G2D_BLEND_C7),
+	NAME(VGV1_DIRTYBASE),
+	NAME(VGV1_CBASE1),
+	NAME(VGV1_UBASE2),
+	NAME(VGV3_NEXTADDR),
+	NAME(VGV3_NEXTCMD),
+	NAME(VGV3_WRITERAW),
+	NAME(VGV3_LAST),
+	NAME(GRADW_CONST0),
+	NAME(GRADW_CONST1),
+	NAME(GRADW_CONST2),
+	NAME(GRADW_CONST3),
+	NAME(GRADW_CONST4),
+	NAME(GRADW_CONST5),
+	NAME(GRADW_CONST6),
+	NAME(GRADW_CONST7),
+	NAME(GRADW_CONST8),
+	NAME(GRADW_CONST9),
+	NAME(GRADW_CONSTA),
+	NAME(GRADW_CONSTB),
+	NAME(GRADW_TEXCFG),
+	NAME(GRADW_TEXSIZE),
+	NAME(GRADW_TEXBASE),
+	NAME(GRADW_TEXCFG2),
+	NAME(GRADW_INST0),
+	NAME(GRADW_INST1),
+	NAME(GRADW_INST2),
+	NAME(GRADW_INST3),
+	NAME(GRADW_INST4),
+	NAME(GRADW_INST5),
+	NAME(GRADW_INST6),
+	NAME(GRADW_INST7),
+#undef NAME
+};
+
+static const char *format_names[16] = {
+	"1", "1BW", "4", "8", "4444", "1555", "0565", "8888",
+	"YUY2", "UYVY", "YVYU", "4444_RGBA", "5551_RGBA", "8888_RGBA", "A8",
+	"?",
+};
+
+static const char *wrap_names[4] = {
+	"CLAMP", "REPEAT", "MIRROR", "BORDER",
+};
+
+struct bit {
+	uint32_t mask;
+	const char *name;
+};
+
+static const struct bit config_bits[] = {
+	{ G2D_CONFIG_DST,           "DST" },
+	{ G2D_CONFIG_SRC1,          "SRC1" },
+	{ G2D_CONFIG_SRC2,          "SRC2" },
+	{ G2D_CONFIG_SRC3,          "SRC3" },
+	{ G2D_CONFIG_SRCCK,         "SRCCK" },
+	{ G2D_CONFIG_DSTCK,         "DSTCK" },
+	{ G2D_CONFIG_OBS_GAMMA,     "OBS_GAMMA" },
+	{ G2D_CONFIG_IGNORECKALPHA, "IGNORECKALPHA" },
+	{ G2D_CONFIG_DITHER,        "DITHER" },
+	{ G2D_CONFIG_WRITESRGB,     "WRITESRGB" },
+	{ G2D_CONFIG_ALPHATEX,      "ALPHATEX" },
+	{ G2D_CONFIG_PALMLINES,     "PALMLINES" },
+	{ G2D_CONFIG_NOLASTPIXEL,   "NOLASTPIXEL" },
+	{ G2D_CONFIG_NOPROTECT,     "NOPROTECT" },
+	{ 0 }
+};
+
+static const struct bit input_bits[] = {
+	{ G2D_INPUT_COLOR,          "COLOR" },
+	{ G2D_INPUT_SCOORD1,        "SCOORD1" },
+	{ G2D_INPUT_SCOORD2,        "SCOORD2" },
+	{ G2D_INPUT_COPYCOORD,      "COPYCOORD" },
+	{ G2D_INPUT_VGMODE,         "VGMODE" },
+	{ G2D_INPUT_LINEMODE,       "LINEMODE" },
+	{ 0 }
+};
+
+static const struct bit blendercfg_bits[] = {
+	{ G2D_BLENDERCFG_ENABLE,       "ENABLE" },
+	{ G2D_BLENDERCFG_OOALPHA,      "OOALPHA" },
+	{ G2D_BLENDERCFG_OBS_DIVALPHA, "OBS_DIVALPHA" },
+	{ G2D_BLENDERCFG_NOMASK,       "NOMASK" },
+	{ 0 }
+};
+
+static const struct bit idle_bits[] = {
+	{ G2D_IDLE_IRQ,             "IRQ" },
+	{ G2D_IDLE_BCFLUSH,         "BCFLUSH" },
+	{ G2D_IDLE_V3,              "V3" },
+	{ 0 }
+};
+
+static const struct bit texcfg_bits[] = {
+	{ GRADW_TEXCFG_TILED,       "TILED" },
+	{ GRADW_TEXCFG_BILIN,       "BILIN" },
+	{ GRADW_TEXCFG_SRGB,        "SRGB" },
+	{ GRADW_TEXCFG_PREMULTIPLY, "PREMULTIPLY" },
+	{ GRADW_TEXCFG_SWAPWORDS,   "SWAPWORDS" },
+	{ GRADW_TEXCFG_SWAPBYTES,   "SWAPBYTES" },
+	{ GRADW_TEXCFG_SWAPALL,     "SWAPALL" },
+	{ GRADW_TEXCFG_SWAPRB,      "SWAPRB" },
+	{ GRADW_TEXCFG_TEX2D,       "TEX2D" },
+	{ GRADW_TEXCFG_SWAPBITS,    "SWAPBITS" },
+	{ 0 }
+};
+
+static void
+print_bits(const struct bit *bits, uint32_t val)
+{
+	for (; bits->mask; bits++)
+		if (val & bits->mask)
+			printf(" %s", bits->name);
+}
+
+/* decode the fields of a register value, if known: */
+static void
+print_fields(uint32_t reg, uint32_t val)
+{
+	switch (reg) {
+	case G2D_CFG0:
+	case G2D_CFG1:
+		printf(" PITCH=%u FORMAT=%s", val & 0xfff,
+				format_names[(val >> 12) & 0xf]);
+		break;
+	case G2D_CONFIG:
+		print_bits(config_bits, val);
+		printf(" ROTATE=%u ARGBMASK=0x%x",
+				(val >> 6) & 0x3, (val >> 12) & 0xf);
+		break;
+	case G2D_INPUT:
+		print_bits(input_bits, val);
+		break;
+	case G2D_BLENDERCFG:
+		print_bits(blendercfg_bits, val);
+		printf(" PASSES=%u ALPHAPASSES=%u", val & 0x7, (val >> 3) & 0x3);
+		break;
+	case G2D_IDLE:
+		print_bits(idle_bits, val);
+		break;
+	case G2D_XY:
+		printf(" X=%u Y=%u", (val >> 16) & 0xfff, val & 0xfff);
+		break;
+	case G2D_WIDTHHEIGHT:
+		printf(" WIDTH=%u HEIGHT=%u", (val >> 16) & 0xfff, val & 0xfff);
+		break;
+	case G2D_SXY:
+	case G2D_SXY2:
+		printf(" X=%u Y=%u", (val >> 16) & 0x7ff, val & 0x7ff);
+		break;
+	case GRADW_TEXCFG:
+		printf(" PITCH=%u FORMAT=%s WRAPU=%s WRAPV=%s", val & 0xfff,
+				format_names[(val >> 12) & 0xf],
+				wrap_names[(val >> 17) & 0x3],
+				wrap_names[(val >> 19) & 0x3]);
+		print_bits(texcfg_bits, val);
+		break;
+	case GRADW_TEXCFG2:
+		if (val & GRADW_TEXCFG2_ALPHA_TEX)
+			printf(" ALPHA_TEX");
+		break;
+	case GRADW_TEXSIZE:
+		printf(" WIDTH=%u HEIGHT=%u", val & 0x7ff, (val >> 13) & 0x7ff);
+		break;
+	}
+}
+
+static void
+print_reg(uint32_t reg, uint32_t val)
+{
+	if (reg_names[reg])
+		printf("%s = 0x%08x", reg_names[reg], val);
+	else
+		printf("REG_%02x = 0x%08x", reg, val);
+	print_fields(reg, val);
+}
+
+static const struct msm_trace_reloc *
+find_reloc(const struct msm_trace_submit *submit, uint32_t offset)
+{
+	const struct msm_trace_reloc *relocs = (const void *)(submit + 1);
+	uint32_t i;
+
+	for (i = 0; i < submit->nrelocs; i++)
+		if (relocs[i].offset == offset)
+			return &relocs[i];
+
+	return NULL;
+}
+
+/* annotate the dword, if it is a reloc, and end the line: */
+static void
+print_reloc(const struct msm_trace_submit *submit, uint32_t i)
+{
+	const struct msm_trace_reloc *reloc = find_reloc(submit, i);
+
+	if (reloc) {
+		printf("  (reloc: handle %u, size 0x%x%s)", reloc->handle,
+				reloc->size,
+				(reloc->flags & MSM_TRACE_RELOC_WRITE) ? ", write" : "");
+	}
+	printf("\n");
+}
+
+static void
+dump_submit(const struct msm_trace_submit *submit, int state, int raw)
+{
+	const struct msm_trace_reloc *relocs = (const void *)(submit + 1);
+	const uint32_t *dwords = (const uint32_t *)&relocs[submit->nrelocs];
+	uint32_t i = state ? 0 : submit->state_dwords;
+
+	printf("submit: time %llu.%06llu, timestamp %u, ring %u, "
+			"%u dwords (%u state), %u relocs\n",
+			(unsigned long long)(submit->time_us / 1000000),
+			(unsigned long long)(submit->time_us % 1000000),
+			submit->timestamp, submit->ring, submit->ndwords,
+			submit->state_dwords, submit->nrelocs);
+
+	while (i < submit->ndwords) {
+		uint32_t dword = dwords[i];
+		uint32_t reg = dword >> 24;
+
+		printf("\t%04x: %08x", i, dword);
+
+		if (raw) {
+			print_reloc(submit, i++);
+		} else if (reg == VGV3_WRITERAW) {
+			/* REGM(): 'n' consecutive registers follow: */
+			uint32_t n = (dword >> 8) & 0xff;
+			uint32_t base = dword & 0xff;
+			uint32_t j;
+
+			printf("  REGM %s x%u", reg_names[base] ?
+					reg_names[base] : "?", n);
+			print_reloc(submit, i++);
+
+			for (j = 0; (j < n) && (i < submit->ndwords); j++) {
+				printf("\t%04x: %08x    ", i, dwords[i]);
+				print_reg((base + j) & 0xff, dwords[i]);
+				print_reloc(submit, i++);
+			}
+
+			if (j < n)
+				printf("\t(truncated packet)\n");
+		} else {
+			/* REG(): single register, 24b value: */
+			printf("  ");
+			print_reg(reg, dword & 0xffffff);
+			print_reloc(submit, i++);
+		}
+	}
+
+	printf("\n");
+}
+
+static int
+check_record(const struct msm_trace_record *rec, uint64_t pos, uint64_t avail)
+{
+	if ((rec->size < sizeof(*rec)) || (rec->size % 8) ||
+			(rec->size > avail)) {
+		fprintf(stderr, "bad record at 0x%llx\n", (unsigned long long)pos);
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t nsubmits, nbos, bo_bytes;
+
+static void
+dump_record(const struct msm_trace_record *rec, int state, int raw)
+{
+	const struct msm_trace_bo *bo = (const void *)rec;
+
+	switch (rec->type) {
+	case MSM_TRACE_SUBMIT:
+		dump_submit((const void *)rec, state, raw);
+		nsubmits++;
+		break;
+	case MSM_TRACE_BO:
+		printf("bo: handle %u, size 0x%x\n\n", bo->handle, bo->size);
+		nbos++;
+		bo_bytes += bo->size;
+		break;
+	}
+}
+
+/* a capture file is just the records in order: */
+static int
+dump_capture(const uint8_t *data, uint64_t size, int state, int raw)
+{
+	uint64_t pos = sizeof(struct msm_capture_header);
+
+	while (pos < size) {
+		const struct msm_trace_record *rec = (const void *)&data[pos];
+
+		if (((size - pos) < sizeof(*rec)) ||
+				check_record(rec, pos, size - pos))
+			return 1;
+
+		dump_record(rec, state, raw);
+		pos += rec->size;
+	}
+
+	printf("%llu submits, %llu bo's (%llu bytes)\n",
+			(unsigned long long)nsubmits, (unsigned long long)nbos,
+			(unsigned long long)bo_bytes);
+
+	return 0;
+}
+
+static int
+dump_trace(const struct msm_trace_header *hdr, int state, int raw)
+{
+	const uint8_t *area = (const uint8_t *)(hdr + 1);
+	uint64_t pos;
+
+	/* the server may still be writing, in which case the oldest
+	 * records can get overwritten under us.. stopping the trace
+	 * first (-d) avoids that.
+	 */
+	for (pos = hdr->tail; pos < hdr->head; ) {
+		const struct msm_trace_record *rec =
+				(const void *)&area[pos % hdr->size];
+
+		if (check_record(rec, pos, hdr->size - (pos % hdr->size)))
+			return 1;
+
+		dump_record(rec, state, raw);
+		pos += rec->size;
+	}
+
+	printf("%llu submits%s\n", (unsigned long long)nsubmits,
+			hdr->enabled ? "" : " (tracing disabled)");
+
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-s] [-r] trace-or-capture-file\n"
+			"       %s -e|-d trace-file\n"
+			"  -s  also decode the per-ring context state\n"
+			"  -r  raw dwords, don't decode packets\n"
+			"  -e  enable tracing\n"
+			"  -d  disable tracing\n", name, name);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct msm_trace_header *hdr;
+	int enable = -1, state = 0, raw = 0;
+	struct stat st;
+	size_t size;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "edrsh")) != -1) {
+		switch (c) {
+		case 'e': enable = 1;  break;
+		case 'd': enable = 0;  break;
+		case 'r': raw = 1;     break;
+		case 's': state = 1;   break;
+		default:  usage(argv[0]);
+		}
+	}
+
+	if (optind != (argc - 1))
+		usage(argv[0]);
+
+	fd = open(argv[optind], (enable >= 0) ? O_RDWR : O_RDONLY);
+	if ((fd < 0) || fstat(fd, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	size = st.st_size;
+
+	if (size < sizeof(struct msm_capture_header)) {
+		fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+		return 1;
+	}
+
+	hdr = mmap(NULL, size, PROT_READ |
+			((enable >= 0) ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if ((hdr->magic == MSM_CAPTURE_MAGIC) && (enable < 0) &&
+			(hdr->version == MSM_TRACE_VERSION))
+		return dump_capture((const uint8_t *)hdr, size, state, raw);
+
+	if ((size < sizeof(*hdr)) ||
+			(hdr->magic != MSM_TRACE_MAGIC) ||
+			(hdr->version != MSM_TRACE_VERSION) ||
+			(size < (sizeof(*hdr) + hdr->size))) {
+		fprintf(stderr, "%s: not a (version %u) trace file\n",
+				argv[optind], MSM_TRACE_VERSION);
+		return 1;
+	}
+
+	if (enable >= 0) {
+		hdr->enabled = enable;
+		return 0;
+	}
+
+	return dump_trace(hdr, state, raw);
+}
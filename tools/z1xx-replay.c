@@ -0,0 +1,403 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Replays a capture (Option "CaptureFile", see msm-trace.h) through
+ * libdrm_freedreno, without the xserver: bo contents are uploaded as
+ * they were captured, and each submit is rebuilt in a ring of its own
+ * (with the relocs pointed at the replay's bo's) and flushed, waiting
+ * for the gpu only where the driver would have (reusing a ring, or cpu
+ * access to a bo).  Reports how long the whole thing took.
+ *
+ * It runs on the hw (kgsl 2d), or on the mock:
+ *
+ *   LD_PRELOAD=.libs/libfd-mock.so FD_MOCK_STATS=- ./z1xx-replay cap
+ *
+ * in which case the submits are also executed by the simulator.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <xf86drm.h>
+#include <freedreno_drmif.h>
+#include <freedreno_ringbuffer.h>
+
+#include "msm-trace.h"
+
+/* libdrm_freedreno skips this much context state when it resets a 2d
+ * ring, see fd_ringbuffer_reset():
+ */
+#define STATE_SIZE  0x140
+
+struct replay_bo {
+	uint32_t handle;           /* captured handle */
+	struct fd_bo *bo;
+	struct replay_bo *next;
+};
+
+struct replay_ring {
+	uint32_t id;               /* captured ring */
+	struct fd_ringbuffer *ring;
+	uint32_t timestamp;        /* of its last submit */
+	struct replay_ring *next;
+};
+
+static struct {
+	struct fd_device *dev;
+	struct fd_pipe *pipe;
+	struct replay_bo *bos;
+	struct replay_ring *rings;
+	uint32_t timestamp;
+
+	/* per run: */
+	uint64_t submits, dwords, bo_uploads, bo_bytes, wait_us;
+} replay;
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+pipe_wait(uint32_t timestamp)
+{
+	uint64_t begin = now_us();
+	fd_pipe_wait(replay.pipe, timestamp);
+	replay.wait_us += now_us() - begin;
+}
+
+static struct fd_bo *
+get_bo(uint32_t handle, uint32_t size)
+{
+	struct replay_bo *rbo;
+
+	for (rbo = replay.bos; rbo; rbo = rbo->next)
+		if (rbo->handle == handle)
+			break;
+
+	if (!rbo) {
+		rbo = calloc(1, sizeof(*rbo));
+		if (!rbo)
+			return NULL;
+		rbo->handle = handle;
+		rbo->next = replay.bos;
+		replay.bos = rbo;
+	}
+
+	/* handles get reused by the kernel once a bo is freed: */
+	if (rbo->bo && (fd_bo_size(rbo->bo) < size)) {
+		fd_bo_del(rbo->bo);
+		rbo->bo = NULL;
+	}
+
+	if (!rbo->bo)
+		rbo->bo = fd_bo_new(replay.dev, size, DRM_FREEDRENO_GEM_TYPE_KMEM);
+
+	return rbo->bo;
+}
+
+static int
+replay_bo(const struct msm_trace_bo *rec)
+{
+	struct fd_bo *bo = get_bo(rec->handle, rec->size);
+	uint64_t begin;
+	void *ptr;
+
+	if (!bo || !(ptr = fd_bo_map(bo))) {
+		fprintf(stderr, "could not allocate bo of size 0x%x\n", rec->size);
+		return -1;
+	}
+
+	begin = now_us();
+	fd_bo_cpu_prep(bo, replay.pipe, DRM_FREEDRENO_PREP_WRITE);
+	replay.wait_us += now_us() - begin;
+
+	memcpy(ptr, rec + 1, rec->size);
+	fd_bo_cpu_fini(bo);
+
+	replay.bo_uploads++;
+	replay.bo_bytes += rec->size;
+
+	return 0;
+}
+
+static struct replay_ring *
+get_ring(uint32_t id, uint32_t ndwords)
+{
+	struct replay_ring *rr;
+	uint32_t size = 0x4000 + STATE_SIZE * sizeof(uint32_t);
+
+	for (rr = replay.rings; rr; rr = rr->next)
+		if (rr->id == id)
+			break;
+
+	if (!rr) {
+		rr = calloc(1, sizeof(*rr));
+		if (!rr)
+			return NULL;
+		rr->id = id;
+		rr->next = replay.rings;
+		replay.rings = rr;
+	}
+
+	if (size < (ndwords * sizeof(uint32_t)))
+		size = ndwords * sizeof(uint32_t);
+
+	if (rr->ring && (rr->ring->size < size)) {
+		pipe_wait(rr->timestamp);
+		fd_ringbuffer_del(rr->ring);
+		rr->ring = NULL;
+	}
+
+	if (!rr->ring)
+		rr->ring = fd_ringbuffer_new(replay.pipe, size);
+
+	return rr;
+}
+
+static void
+emit(struct fd_ringbuffer *ring, const struct msm_trace_reloc *reloc,
+		uint32_t dword)
+{
+	struct fd_bo *bo;
+
+	if (!reloc) {
+		fd_ringbuffer_emit(ring, dword);
+		return;
+	}
+
+	bo = get_bo(reloc->handle, reloc->size);
+	fd_ringbuffer_reloc(ring, &(struct fd_reloc){
+		.bo = bo,
+		.flags = FD_RELOC_READ |
+			((reloc->flags & MSM_TRACE_RELOC_WRITE) ? FD_RELOC_WRITE : 0),
+	});
+}
+
+static int
+replay_submit(const struct msm_trace_submit *submit)
+{
+	const struct msm_trace_reloc *relocs = (const void *)(submit + 1);
+	const uint32_t *dwords = (const uint32_t *)&relocs[submit->nrelocs];
+	struct fd_ringbuffer *ring;
+	struct replay_ring *rr;
+	uint32_t i, r = 0;
+
+	if (submit->state_dwords != STATE_SIZE) {
+		fprintf(stderr, "unexpected context state size: 0x%x\n",
+				submit->state_dwords);
+		return -1;
+	}
+
+	rr = get_ring(submit->ring, submit->ndwords);
+	if (!rr || !rr->ring) {
+		fprintf(stderr, "could not allocate ring\n");
+		return -1;
+	}
+
+	ring = rr->ring;
+
+	/* like the driver, don't overwrite a ring the gpu may still be
+	 * executing:
+	 */
+	if (rr->timestamp)
+		pipe_wait(rr->timestamp);
+
+	/* the context state lives below where the ring is reset to: */
+	for (i = 0; i < submit->state_dwords; i++) {
+		const struct msm_trace_reloc *reloc = NULL;
+
+		if ((r < submit->nrelocs) && (relocs[r].offset == i))
+			reloc = &relocs[r++];
+
+		ring->cur = &ring->start[i];
+		emit(ring, reloc, dwords[i]);
+	}
+
+	fd_ringbuffer_reset(ring);
+
+	for (; i < submit->ndwords; i++) {
+		const struct msm_trace_reloc *reloc = NULL;
+
+		if ((r < submit->nrelocs) && (relocs[r].offset == i))
+			reloc = &relocs[r++];
+
+		emit(ring, reloc, dwords[i]);
+	}
+
+	fd_ringbuffer_flush(ring);
+
+	rr->timestamp = replay.timestamp = fd_ringbuffer_timestamp(ring);
+
+	replay.submits++;
+	replay.dwords += submit->ndwords - submit->state_dwords;
+
+	return 0;
+}
+
+static int
+replay_capture(const uint8_t *data, uint64_t size, int realtime)
+{
+	uint64_t pos = sizeof(struct msm_capture_header);
+	uint64_t start = now_us(), first = 0;
+
+	while (pos < size) {
+		const struct msm_trace_record *rec = (const void *)&data[pos];
+		const struct msm_trace_submit *submit = (const void *)rec;
+
+		if (((size - pos) < sizeof(*rec)) || (rec->size < sizeof(*rec)) ||
+				(rec->size > (size - pos))) {
+			fprintf(stderr, "bad record at 0x%llx\n",
+					(unsigned long long)pos);
+			return -1;
+		}
+
+		switch (rec->type) {
+		case MSM_TRACE_BO:
+			if (replay_bo((const void *)rec))
+				return -1;
+			break;
+		case MSM_TRACE_SUBMIT:
+			/* keep the captured gaps between submits: */
+			if (realtime) {
+				uint64_t t;
+
+				if (!first)
+					first = submit->time_us;
+				t = start + (submit->time_us - first);
+				if (t > now_us())
+					usleep(t - now_us());
+			}
+			if (replay_submit(submit))
+				return -1;
+			break;
+		}
+
+		pos += rec->size;
+	}
+
+	pipe_wait(replay.timestamp);
+
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-D device] [-n loops] [-t] capture-file\n"
+			"  -D  device to open (default: the msm or kgsl drm device)\n"
+			"  -n  replay the capture this many times (default 1)\n"
+			"  -t  keep the captured timing between submits\n", name);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct msm_capture_header *hdr;
+	const char *device = NULL;
+	int loops = 1, realtime = 0;
+	struct stat st;
+	int c, i, fd;
+
+	while ((c = getopt(argc, argv, "D:n:th")) != -1) {
+		switch (c) {
+		case 'D': device = optarg;        break;
+		case 'n': loops = atoi(optarg);   break;
+		case 't': realtime = 1;           break;
+		default:  usage(argv[0]);
+		}
+	}
+
+	if (optind != (argc - 1))
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDONLY);
+	if ((fd < 0) || fstat(fd, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ((st.st_size < sizeof(*hdr)) || (hdr == MAP_FAILED) ||
+			(hdr->magic != MSM_CAPTURE_MAGIC) ||
+			(hdr->version != MSM_TRACE_VERSION)) {
+		fprintf(stderr, "%s: not a (version %u) capture file\n",
+				argv[optind], MSM_TRACE_VERSION);
+		return 1;
+	}
+
+	if (device)
+		fd = open(device, O_RDWR);
+	else if ((fd = drmOpen("msm", NULL)) < 0)
+		fd = drmOpen("kgsl", NULL);
+	if (fd < 0) {
+		fprintf(stderr, "could not open device\n");
+		return 1;
+	}
+
+	replay.dev = fd_device_new(fd);
+	replay.pipe = replay.dev ? fd_pipe_new(replay.dev, FD_PIPE_2D) : NULL;
+	if (!replay.pipe) {
+		fprintf(stderr, "could not open 2d pipe\n");
+		return 1;
+	}
+
+	printf("%-6s %10s %10s %12s %10s %10s %10s\n", "loop", "ms",
+			"submits/s", "dwords/s", "uploads", "upload-MB", "wait-ms");
+
+	for (i = 0; i < loops; i++) {
+		uint64_t t;
+
+		replay.submits = replay.dwords = 0;
+		replay.bo_uploads = replay.bo_bytes = replay.wait_us = 0;
+
+		t = now_us();
+		if (replay_capture((const uint8_t *)hdr, st.st_size, realtime))
+			return 1;
+		t = now_us() - t;
+		if (!t)
+			t = 1;
+
+		printf("%-6d %10.2f %10.0f %12.0f %10llu %10.2f %10.2f\n", i,
+				t / 1000.0, replay.submits * 1000000.0 / t,
+				replay.dwords * 1000000.0 / t,
+				(unsigned long long)replay.bo_uploads,
+				replay.bo_bytes / (1024.0 * 1024.0),
+				replay.wait_us / 1000.0);
+	}
+
+	return 0;
+}
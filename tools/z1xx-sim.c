@@ -0,0 +1,595 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "z1xx-sim.h"
+#include "freedreno_z1xx.h"
+#include "msm-z1xx-blend.h"
+
+#ifndef ARRAY_SIZE
+#  define ARRAY_SIZE(a) (sizeof((a)) / (sizeof(*(a))))
+#endif
+
+/* The blend config is not understood, so the blend registers are matched
+ * against the composite-op dwords that msm-exa.c emits.  Where the dst
+ * with and without alpha use the same dwords (Src, OutReverse and
+ * InReverse, which don't read the dst alpha for the color channels), the
+ * entry for a dst with alpha has to be the one that matches, since it is
+ * also right for a dst without: so those are looked at first.
+ */
+static const int blend_order[] = {
+	COMPOSITE_DST_ALPHA,
+	COMPOSITE_SRC_ALPHA | COMPOSITE_DST_ALPHA,
+	0,
+	COMPOSITE_SRC_ALPHA,
+};
+
+/* texture state is banked, selected by G2D_GRADIENT bits 16..17.  Bank 0
+ * is the (copy/composite) src, bank 2 the composite mask, and bank 3
+ * the dst:
+ */
+#define NUM_BANKS 4
+#define BANK_SRC  0
+#define BANK_MASK 2
+
+struct sim_mapping {
+	uint32_t gpuaddr, size;
+	uint8_t *ptr;
+};
+
+struct sim_surface {
+	uint8_t *ptr;         /* start of the buffer */
+	uint32_t size;        /* bytes in the buffer */
+	uint32_t pitch;       /* bytes */
+	enum g2d_format fmt;
+	int cpp;
+	int width, height;    /* only for textures */
+};
+
+struct z1xx_sim {
+	uint32_t regs[256];
+	uint32_t tex[NUM_BANKS][8];  /* GRADW_TEXCFG..GRADW_TEXCFG2 */
+	int bank;
+
+	struct sim_mapping *maps;
+	int num_maps;
+
+	struct z1xx_sim_stats stats;
+};
+
+struct z1xx_sim *
+z1xx_sim_new(void)
+{
+	return calloc(1, sizeof(struct z1xx_sim));
+}
+
+void
+z1xx_sim_del(struct z1xx_sim *sim)
+{
+	if (!sim)
+		return;
+	free(sim->maps);
+	free(sim);
+}
+
+int
+z1xx_sim_map(struct z1xx_sim *sim, uint32_t gpuaddr, void *ptr, uint32_t size)
+{
+	struct sim_mapping *maps;
+
+	z1xx_sim_unmap(sim, gpuaddr);
+
+	maps = realloc(sim->maps, (sim->num_maps + 1) * sizeof(*maps));
+	if (!maps)
+		return -1;
+
+	maps[sim->num_maps].gpuaddr = gpuaddr;
+	maps[sim->num_maps].size = size;
+	maps[sim->num_maps].ptr = ptr;
+	sim->maps = maps;
+	sim->num_maps++;
+
+	return 0;
+}
+
+void
+z1xx_sim_unmap(struct z1xx_sim *sim, uint32_t gpuaddr)
+{
+	int i;
+
+	for (i = 0; i < sim->num_maps; i++) {
+		if (sim->maps[i].gpuaddr == gpuaddr) {
+			sim->maps[i] = sim->maps[--sim->num_maps];
+			return;
+		}
+	}
+}
+
+const struct z1xx_sim_stats *
+z1xx_sim_stats(struct z1xx_sim *sim)
+{
+	return &sim->stats;
+}
+
+void
+z1xx_sim_reset_stats(struct z1xx_sim *sim)
+{
+	memset(&sim->stats, 0, sizeof(sim->stats));
+}
+
+static int
+format_cpp(enum g2d_format fmt)
+{
+	switch (fmt) {
+	case G2D_8:
+	case G2D_A8:
+		return 1;
+	case G2D_4444:
+	case G2D_1555:
+	case G2D_0565:
+		return 2;
+	case G2D_8888:
+	case G2D_8888_RGBA:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static int
+get_surface(struct z1xx_sim *sim, struct sim_surface *surf,
+		uint32_t gpuaddr, uint32_t cfg)
+{
+	int i;
+
+	/* pitch is in units of 32 bytes: */
+	surf->pitch = (cfg & 0xfff) * 32;
+	surf->fmt = (cfg >> 12) & 0xf;
+	surf->cpp = format_cpp(surf->fmt);
+
+	if (!surf->cpp) {
+		sim->stats.bad_format++;
+		return -1;
+	}
+
+	for (i = 0; i < sim->num_maps; i++) {
+		struct sim_mapping *m = &sim->maps[i];
+		if ((gpuaddr >= m->gpuaddr) && (gpuaddr < m->gpuaddr + m->size)) {
+			surf->ptr = m->ptr + (gpuaddr - m->gpuaddr);
+			surf->size = m->size - (gpuaddr - m->gpuaddr);
+			return 0;
+		}
+	}
+
+	sim->stats.bad_addr++;
+	return -1;
+}
+
+static int
+get_texture(struct z1xx_sim *sim, struct sim_surface *surf, int bank)
+{
+	uint32_t *tex = sim->tex[bank];
+	uint32_t size = tex[GRADW_TEXSIZE - GRADW_TEXCFG];
+
+	surf->width = size & 0x7ff;
+	surf->height = (size >> 13) & 0x7ff;
+
+	return get_surface(sim, surf, tex[GRADW_TEXBASE - GRADW_TEXCFG],
+			tex[0]);
+}
+
+static uint8_t *
+pixel_ptr(struct z1xx_sim *sim, struct sim_surface *surf, int x, int y)
+{
+	uint32_t off = y * surf->pitch + x * surf->cpp;
+
+	if ((off + surf->cpp) > surf->size) {
+		sim->stats.bad_addr++;
+		return NULL;
+	}
+
+	return surf->ptr + off;
+}
+
+/* read pixel as a8r8g8b8: */
+static uint32_t
+read_pixel(struct sim_surface *surf, const uint8_t *p)
+{
+	switch (surf->cpp) {
+	case 1:
+		return (uint32_t)p[0] << 24;
+	case 4:
+		return *(const uint32_t *)p;
+	default:
+		/* 16b formats are not accelerated by the driver: */
+		return 0;
+	}
+}
+
+static void
+write_pixel(struct sim_surface *surf, uint8_t *p, uint32_t val)
+{
+	switch (surf->cpp) {
+	case 1:
+		p[0] = val >> 24;
+		break;
+	case 4:
+		*(uint32_t *)p = val;
+		break;
+	}
+}
+
+/* (a * b) / 255, rounded the same way as pixman: */
+static inline uint32_t
+mul_un8(uint32_t a, uint32_t b)
+{
+	uint32_t t = a * b + 0x80;
+	return ((t >> 8) + t) >> 8;
+}
+
+static uint32_t
+mul_un8x4(uint32_t x, uint32_t a)
+{
+	return (mul_un8((x >> 24) & 0xff, a) << 24) |
+			(mul_un8((x >> 16) & 0xff, a) << 16) |
+			(mul_un8((x >>  8) & 0xff, a) <<  8) |
+			(mul_un8((x >>  0) & 0xff, a) <<  0);
+}
+
+static uint32_t
+add_un8x4(uint32_t x, uint32_t y)
+{
+	uint32_t r = 0;
+	int i;
+
+	for (i = 0; i < 32; i += 8) {
+		uint32_t c = ((x >> i) & 0xff) + ((y >> i) & 0xff);
+		r |= ((c > 0xff) ? 0xff : c) << i;
+	}
+
+	return r;
+}
+
+/* porter-duff, on premultiplied a8r8g8b8: */
+static uint32_t
+blend(int op, uint32_t src, uint32_t dst)
+{
+	uint32_t sa = src >> 24, da = dst >> 24;
+	uint32_t fa, fb;
+
+	switch (op) {
+	case PictOpSrc:         fa = 0xff;      fb = 0x00;      break;
+	case PictOpIn:          fa = da;        fb = 0x00;      break;
+	case PictOpOut:         fa = 0xff - da; fb = 0x00;      break;
+	case PictOpOver:        fa = 0xff;      fb = 0xff - sa; break;
+	case PictOpOutReverse:  fa = 0x00;      fb = 0xff - sa; break;
+	case PictOpAdd:         fa = 0xff;      fb = 0xff;      break;
+	case PictOpOverReverse: fa = 0xff - da; fb = 0xff;      break;
+	case PictOpInReverse:   fa = 0x00;      fb = sa;        break;
+	case PictOpAtop:        fa = da;        fb = 0xff - sa; break;
+	case PictOpAtopReverse: fa = 0xff - da; fb = sa;        break;
+	case PictOpXor:         fa = 0xff - da; fb = 0xff - sa; break;
+	default:                fa = 0xff;      fb = 0x00;      break;
+	}
+
+	return add_un8x4(mul_un8x4(src, fa), mul_un8x4(dst, fb));
+}
+
+/* The destination rectangle, clipped to the scissor: */
+static int
+get_rect(struct z1xx_sim *sim, int *x, int *y, int *w, int *h)
+{
+	uint32_t xy = sim->regs[G2D_XY];
+	uint32_t wh = sim->regs[G2D_WIDTHHEIGHT];
+	int maxx = (sim->regs[G2D_SCISSORX] >> 12) & 0xfff;
+	int maxy = (sim->regs[G2D_SCISSORY] >> 12) & 0xfff;
+
+	*x = (xy >> 16) & 0xfff;
+	*y = xy & 0xfff;
+	*w = (wh >> 16) & 0xfff;
+	*h = wh & 0xfff;
+
+	if ((*x + *w) > maxx)
+		*w = maxx - *x;
+	if ((*y + *h) > maxy)
+		*h = maxy - *y;
+
+	return (*w > 0) && (*h > 0);
+}
+
+static void
+do_fill(struct z1xx_sim *sim)
+{
+	struct sim_surface dst;
+	int x, y, w, h, i, j;
+
+	sim->stats.fills++;
+
+	if (!get_rect(sim, &x, &y, &w, &h))
+		return;
+
+	if (get_surface(sim, &dst, sim->regs[G2D_BASE0], sim->regs[G2D_CFG0]))
+		return;
+
+	for (j = 0; j < h; j++) {
+		for (i = 0; i < w; i++) {
+			uint8_t *p = pixel_ptr(sim, &dst, x + i, y + j);
+			if (!p)
+				return;
+			write_pixel(&dst, p, sim->regs[G2D_COLOR]);
+		}
+	}
+
+	sim->stats.pixels += w * h;
+}
+
+static void
+do_copy(struct z1xx_sim *sim)
+{
+	struct sim_surface dst, src;
+	uint32_t sxy = sim->regs[G2D_SXY];
+	int sx = (sxy >> 16) & 0x7ff, sy = sxy & 0x7ff;
+	int x, y, w, h, i, j;
+	uint32_t *tmp;
+
+	sim->stats.copies++;
+
+	if (!get_rect(sim, &x, &y, &w, &h))
+		return;
+
+	if (get_surface(sim, &dst, sim->regs[G2D_BASE0], sim->regs[G2D_CFG0]))
+		return;
+
+	if (get_texture(sim, &src, BANK_SRC))
+		return;
+
+	/* src and dst can overlap (scrolling), so go via a temporary: */
+	tmp = malloc(w * h * sizeof(*tmp));
+	if (!tmp)
+		return;
+
+	for (j = 0; j < h; j++) {
+		for (i = 0; i < w; i++) {
+			uint8_t *p = pixel_ptr(sim, &src, sx + i, sy + j);
+			if (!p)
+				goto out;
+			tmp[j * w + i] = read_pixel(&src, p);
+		}
+	}
+
+	for (j = 0; j < h; j++) {
+		for (i = 0; i < w; i++) {
+			uint8_t *p = pixel_ptr(sim, &dst, x + i, y + j);
+			if (!p)
+				goto out;
+			write_pixel(&dst, p, tmp[j * w + i]);
+		}
+	}
+
+	sim->stats.pixels += w * h;
+
+out:
+	free(tmp);
+}
+
+/* returns the index into composite_op_dwords[] and the op, or -1: */
+static int
+find_blend(struct z1xx_sim *sim, int *op)
+{
+	uint32_t a0 = sim->regs[G2D_BLEND_A0];
+	uint32_t c0 = sim->regs[G2D_BLEND_C0];
+	unsigned i, o;
+
+	for (i = 0; i < ARRAY_SIZE(blend_order); i++) {
+		int idx = blend_order[i];
+		for (o = 0; o < ARRAY_SIZE(composite_op_dwords[idx]); o++) {
+			const uint32_t *d = composite_op_dwords[idx][o];
+			uint32_t ba0 = d[0] ? d[1] : (d[1] & 0xffffff);
+			uint32_t bc0 = d[2] ? d[3] : (d[3] & 0xffffff);
+			if (!d[1])
+				continue;
+			if ((a0 == ba0) && (c0 == bc0)) {
+				*op = o;
+				return idx;
+			}
+		}
+	}
+
+	return -1;
+}
+
+/* fetch a texel, with repeat or transparent-black outside of the texture: */
+static uint32_t
+fetch(struct z1xx_sim *sim, struct sim_surface *tex, int x, int y,
+		int repeat, int *err)
+{
+	uint8_t *p;
+
+	if (repeat && tex->width && tex->height) {
+		x %= tex->width;
+		y %= tex->height;
+		if (x < 0)
+			x += tex->width;
+		if (y < 0)
+			y += tex->height;
+	} else if ((x >= tex->width) || (y >= tex->height)) {
+		return 0;
+	}
+
+	p = pixel_ptr(sim, tex, x, y);
+	if (!p) {
+		*err = 1;
+		return 0;
+	}
+
+	return read_pixel(tex, p);
+}
+
+static void
+do_composite(struct z1xx_sim *sim)
+{
+	struct sim_surface dst, src, mask;
+	uint32_t sxy = sim->regs[G2D_SXY];
+	uint32_t sxy2 = sim->regs[G2D_SXY2];
+	int sx = (sxy >> 16) & 0x7ff, sy = sxy & 0x7ff;
+	int mx = (sxy2 >> 16) & 0x7ff, my = sxy2 & 0x7ff;
+	int has_mask = !(sim->regs[G2D_BLENDERCFG] & G2D_BLENDERCFG_NOMASK);
+	int repeat = (sim->regs[G2D_GRADIENT] & 0xffff) == 0x1001;
+	int x, y, w, h, i, j, b, op, err = 0;
+
+	sim->stats.composites++;
+
+	b = find_blend(sim, &op);
+	if (b < 0) {
+		sim->stats.bad_blend++;
+		return;
+	}
+
+	if (!get_rect(sim, &x, &y, &w, &h))
+		return;
+
+	if (get_surface(sim, &dst, sim->regs[G2D_BASE0], sim->regs[G2D_CFG0]))
+		return;
+
+	if (get_texture(sim, &src, BANK_SRC))
+		return;
+
+	if (has_mask && get_texture(sim, &mask, BANK_MASK))
+		return;
+
+	for (j = 0; j < h; j++) {
+		for (i = 0; i < w; i++) {
+			uint8_t *p = pixel_ptr(sim, &dst, x + i, y + j);
+			uint32_t s, d;
+
+			if (!p)
+				return;
+
+			s = fetch(sim, &src, sx + i, sy + j, repeat, &err);
+			if (!(b & COMPOSITE_SRC_ALPHA) && (src.cpp == 4))
+				s |= 0xff000000;
+
+			if (has_mask) {
+				uint32_t m = fetch(sim, &mask, mx + i, my + j, 0, &err);
+				s = mul_un8x4(s, m >> 24);
+			}
+
+			d = read_pixel(&dst, p);
+			if (!(b & COMPOSITE_DST_ALPHA))
+				d |= 0xff000000;
+
+			if (err)
+				return;
+
+			write_pixel(&dst, p, blend(op, s, d));
+		}
+	}
+
+	sim->stats.pixels += w * h;
+}
+
+static void
+write_reg(struct z1xx_sim *sim, uint32_t reg, uint32_t val)
+{
+	uint32_t input;
+
+	sim->stats.reg_writes++;
+
+	reg &= 0xff;
+
+	if ((reg >= GRADW_TEXCFG) && (reg <= GRADW_TEXCFG2)) {
+		sim->tex[sim->bank][reg - GRADW_TEXCFG] = val;
+		return;
+	}
+
+	sim->regs[reg] = val;
+
+	/* A blit is kicked off by writing the last of the coordinates (or
+	 * the color) that G2D_INPUT says are used:
+	 */
+	input = sim->regs[G2D_INPUT];
+
+	switch (reg) {
+	case G2D_GRADIENT:
+		sim->bank = (val >> 16) & (NUM_BANKS - 1);
+		break;
+	case G2D_COLOR:
+		if (input & G2D_INPUT_COLOR)
+			do_fill(sim);
+		break;
+	case G2D_SXY:
+		if (!(input & G2D_INPUT_SCOORD1) || (input & G2D_INPUT_SCOORD2))
+			break;
+		if (sim->regs[G2D_BLENDERCFG] & G2D_BLENDERCFG_ENABLE)
+			do_composite(sim);
+		else
+			do_copy(sim);
+		break;
+	case G2D_SXY2:
+		if (input & G2D_INPUT_SCOORD2)
+			do_composite(sim);
+		break;
+	case G2D_IDLE:
+		sim->stats.idles++;
+		break;
+	}
+}
+
+int
+z1xx_sim_exec(struct z1xx_sim *sim, const uint32_t *dwords, uint32_t count)
+{
+	struct z1xx_sim_stats before = sim->stats;
+	uint32_t i = 0;
+
+	while (i < count) {
+		uint32_t dword = dwords[i++];
+		uint32_t reg = dword >> 24;
+
+		if (reg == VGV3_WRITERAW) {
+			/* REGM(): write 'n' consecutive registers: */
+			uint32_t n = (dword >> 8) & 0xff;
+			uint32_t base = dword & 0xff;
+			uint32_t j;
+
+			if ((i + n) > count) {
+				sim->stats.bad_packet++;
+				break;
+			}
+
+			for (j = 0; j < n; j++)
+				write_reg(sim, base + j, dwords[i++]);
+		} else {
+			/* REG(): single register, 24b value: */
+			write_reg(sim, reg, dword & 0xffffff);
+		}
+	}
+
+	sim->stats.dwords += i;
+
+	return (sim->stats.bad_blend - before.bad_blend) +
+			(sim->stats.bad_format - before.bad_format) +
+			(sim->stats.bad_addr - before.bad_addr) +
+			(sim->stats.bad_packet - before.bad_packet);
+}
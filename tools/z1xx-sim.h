@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2015 Rob Clark <robclark@freedesktop.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef Z1XX_SIM_H_
+#define Z1XX_SIM_H_
+
+#include <stdint.h>
+
+/*
+ * Software simulator for the z1xx 2d core, which executes the cmdstream
+ * built by msm-exa.c (the REG/REGM packets from freedreno_z1xx.h) and
+ * rasterizes into CPU buffers.  It only models what the driver relies
+ * on (fills, copies, and composites with the blend configs that the
+ * driver uses), since that is all that is known about the hw.
+ *
+ * Buffers referenced by the cmdstream are registered with their gpu
+ * address (whatever the relocs were resolved to) and CPU pointer.
+ */
+
+struct z1xx_sim;
+
+struct z1xx_sim_stats {
+	uint64_t dwords;       /* dwords executed */
+	uint64_t reg_writes;   /* individual register writes */
+	uint64_t fills;
+	uint64_t copies;
+	uint64_t composites;
+	uint64_t pixels;       /* pixels written */
+	uint64_t idles;        /* G2D_IDLE, ie. end of a submit */
+
+	/* things the simulator didn't understand, which should be zero
+	 * for any cmdstream the driver produces:
+	 */
+	uint64_t bad_blend;    /* unknown blend config */
+	uint64_t bad_format;   /* unknown surface format */
+	uint64_t bad_addr;     /* access to unregistered gpu address */
+	uint64_t bad_packet;   /* truncated packet */
+};
+
+struct z1xx_sim *z1xx_sim_new(void);
+void z1xx_sim_del(struct z1xx_sim *sim);
+
+/* register/unregister a buffer at the given gpu address: */
+int z1xx_sim_map(struct z1xx_sim *sim, uint32_t gpuaddr,
+		void *ptr, uint32_t size);
+void z1xx_sim_unmap(struct z1xx_sim *sim, uint32_t gpuaddr);
+
+/* execute a chunk of cmdstream, returns the number of problems seen
+ * (see the bad_* stats), ie. zero on success:
+ */
+int z1xx_sim_exec(struct z1xx_sim *sim, const uint32_t *dwords,
+		uint32_t count);
+
+const struct z1xx_sim_stats *z1xx_sim_stats(struct z1xx_sim *sim);
+void z1xx_sim_reset_stats(struct z1xx_sim *sim);
+
+#endif /* Z1XX_SIM_H_ */